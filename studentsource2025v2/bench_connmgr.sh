@@ -0,0 +1,58 @@
+#!/bin/bash
+# Connection manager benchmark: the same load on the three backends (thread per client, epoll, io_uring)
+# Usage: ./bench_connmgr.sh [records per connection] [connection counts...]   (default: 10 records, 1000 10000 50000)
+# Every run: a fresh gateway in finite mode (max_conn = connections) and conn_bench opening all connections at once;
+# 'total' runs from the first connect until the gateway exited (every record stored), cpu/rss are the gateway's
+# 50k connections need an open file limit above 50k for both processes (ulimit -Hn) and several source addresses
+records=${1:-10}
+shift
+counts=${@:-1000 10000 50000}
+port=$((20000 + RANDOM % 10000)) # below the ephemeral range: the client ports of a run stay in TIME_WAIT
+
+make -s lib/libdplist.so lib/libtcpsock.so conn_bench || exit 1
+for backend in threaded epoll uring; do
+    case $backend in
+        threaded) flags=-DCONNMGR_THREADED ;;
+        epoll) flags= ;;
+        uring) flags=-DCONNMGR_URING ;;
+    esac
+    make -s -B sensor_gateway CONNMGR_FLAGS="$flags" > /dev/null || exit 1
+    cp sensor_gateway bench_gateway_$backend
+done
+make -s -B sensor_gateway > /dev/null
+
+ulimit -n "$(ulimit -Hn)"
+ticks=$(getconf CLK_TCK)
+printf "%-9s %7s %9s %9s %9s %9s %9s\n" backend conns connect_s send_s total_s cpu_s rss_mb
+for conns in $counts; do
+    if [ "$(ulimit -n)" -lt $((conns + 64)) ]; then
+        echo "skipping $conns connections: open file limit $(ulimit -n)"
+        continue
+    fi
+    sources=$(( (conns + 19999) / 20000 ))
+    for backend in threaded epoll uring; do
+        rm -f data.csv gateway.log
+        ./bench_gateway_$backend $port $conns -b 4096 > /dev/null 2>&1 &
+        gw=$!
+        sleep 0.5
+        start=$(date +%s.%N)
+        out=$(./conn_bench $port $conns $records $sources)
+        cpu=0; rss=0
+        while kill -0 $gw 2> /dev/null; do # last sample before the gateway exits
+            stat=$(cat /proc/$gw/stat 2> /dev/null) && cpu=$(echo "$stat" | awk '{print $14 + $15}')
+            hwm=$(awk '/VmHWM/ {print $2}' /proc/$gw/status 2> /dev/null) && [ -n "$hwm" ] && rss=$hwm
+            sleep 0.05
+        done
+        end=$(date +%s.%N)
+        wait $gw
+        connect=$(echo "$out" | sed -n 's/.*connect_s=\([0-9.]*\).*/\1/p')
+        send=$(echo "$out" | sed -n 's/.*send_s=\([0-9.]*\).*/\1/p')
+        rows=$(wc -l < data.csv 2> /dev/null)
+        printf "%-9s %7d %9s %9s %9.3f %9.2f %9.1f" $backend $conns "$connect" "$send" \
+            "$(awk "BEGIN {print $end - $start}")" "$(awk "BEGIN {print $cpu / $ticks}")" "$(awk "BEGIN {print $rss / 1024}")"
+        [ "$rows" != "$((conns * records))" ] && printf "  (stored %s of %d records; %s)" "$rows" $((conns * records)) "$out"
+        echo
+        port=$((port + 1))
+    done
+done
+rm -f bench_gateway_threaded bench_gateway_epoll bench_gateway_uring
@@ -0,0 +1,173 @@
+/**
+ * \author {Diego Vallés}
+ */
+//Load generator for the connection manager benchmark (bench_connmgr.sh): opens <conns> sensor connections at once,
+//sends <records> frames on each of them round after round, then closes them all
+//Usage: ./conn_bench <port> <conns> <records> [sources]
+//sources: local addresses 127.0.0.1 .. 127.0.0.<sources> are used round-robin, one address has ~28k ephemeral ports
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "config.h"
+
+#define BENCH_FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define BENCH_CONNECT_WINDOW 512 // connects in flight: more than the backlog only ends in SYN retransmits
+#define BENCH_MAX_IDS 64
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//the sensor ids of room_sensor.map, so the data manager knows them
+static int load_ids(sensor_id_t *ids) {
+    int n = 0;
+    FILE *f = fopen("room_sensor.map", "r");
+    unsigned room = 0, sensor = 0;
+    while (f != NULL && n < BENCH_MAX_IDS && fscanf(f, "%u %u", &room, &sensor) == 2) {ids[n++] = (sensor_id_t)sensor;}
+    if (f != NULL) {fclose(f);}
+    if (n == 0) {ids[n++] = 15;}
+    return n;
+}
+
+static int open_one(int port, int source) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {return -1;}
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0};
+    if (source > 0) {
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)); // port picked at connect: per 4-tuple
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + (uint32_t)source);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {close(fd);return -1;}
+    }
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {close(fd);return -1;}
+    return fd;
+}
+
+//writes the whole frame, waiting on the socket when its send buffer is full
+static int send_frame(int fd, const unsigned char *frame) {
+    size_t done = 0;
+    while (done < BENCH_FRAME_SIZE) {
+        ssize_t n = send(fd, frame + done, BENCH_FRAME_SIZE - done, MSG_NOSIGNAL);
+        if (n > 0) {done += (size_t)n;continue;}
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {continue;}
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <port> <conns> <records> [sources]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int const port = atoi(argv[1]);
+    int const nconns = atoi(argv[2]);
+    int const records = atoi(argv[3]);
+    int const sources = (argc > 4) ? atoi(argv[4]) : 1;
+    if (port <= 0 || nconns <= 0 || records <= 0 || sources <= 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)nconns + 16) {
+            fprintf(stderr, "conn_bench: open file limit %llu is too low for %d connections\n", (unsigned long long)rl.rlim_cur, nconns);
+            return EXIT_FAILURE;
+        }
+    }
+
+    sensor_id_t ids[BENCH_MAX_IDS];
+    int const nids = load_ids(ids);
+    int *fds = malloc((size_t)nconns * sizeof(int));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (fds == NULL || epfd < 0) {
+        fprintf(stderr, "conn_bench: setup failed\n");
+        return EXIT_FAILURE;
+    }
+
+    //1. connect everything, at most BENCH_CONNECT_WINDOW handshakes at a time
+    double const t0 = now_s();
+    int next = 0, inflight = 0, established = 0, failed = 0;
+    struct epoll_event events[256];
+    while (established + failed < nconns) {
+        while (next < nconns && inflight < BENCH_CONNECT_WINDOW) {
+            fds[next] = open_one(port, (sources > 1) ? next % sources : 0);
+            if (fds[next] < 0) {failed++;next++;continue;}
+            struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = (uint32_t)next};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fds[next], &ev);
+            inflight++;
+            next++;
+        }
+        int n = epoll_wait(epfd, events, 256, 10000);
+        if (n == 0) {
+            fprintf(stderr, "conn_bench: connects stalled\n");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int const k = (int)events[i].data.u32;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[k], SOL_SOCKET, SO_ERROR, &err, &len);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fds[k], NULL);
+            inflight--;
+            if (err != 0) {close(fds[k]);fds[k] = -1;failed++;}
+            else {established++;}
+        }
+    }
+    double const t1 = now_s();
+
+    //2. one frame per connection per round, the first one identifies the sensor
+    unsigned long long frames = 0;
+    unsigned char frame[BENCH_FRAME_SIZE];
+    for (int r = 0; r < records; r++) {
+        for (int k = 0; k < nconns; k++) {
+            if (fds[k] < 0) {continue;}
+            sensor_id_t const id = ids[k % nids];
+            sensor_value_t const value = 15.0 + (double)(r % 10);
+            sensor_ts_t const ts = (sensor_ts_t)time(NULL);
+            memcpy(frame, &id, sizeof(id));
+            memcpy(frame + sizeof(id), &value, sizeof(value));
+            memcpy(frame + sizeof(id) + sizeof(value), &ts, sizeof(ts));
+            if (send_frame(fds[k], frame) != 0) {close(fds[k]);fds[k] = -1;continue;}
+            frames++;
+        }
+    }
+    double const t2 = now_s();
+
+    //3. close everything
+    for (int k = 0; k < nconns; k++) {
+        if (fds[k] >= 0) {close(fds[k]);}
+    }
+    double const t3 = now_s();
+
+    printf("conns=%d established=%d failed=%d connect_s=%.3f send_s=%.3f close_s=%.3f frames=%llu send_rate=%.0f/s\n",
+           nconns, established, failed, t1 - t0, t2 - t1, t3 - t2, frames, (t2 > t1) ? (double)frames / (t2 - t1) : 0.0);
+    close(epfd);
+    free(fds);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
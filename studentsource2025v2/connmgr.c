@@ -1,26 +1,56 @@
 /**
  * \author {Diego Vallés}
  */
+#define _GNU_SOURCE // eventfd, accept flags
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <pthread.h>
-#include <sys/select.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#if defined(CONNMGR_URING)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#elif !defined(CONNMGR_THREADED)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include "lib/tcpsock.h"
 #include "config.h"
 #include "sbuffer.h"
 #include "connmgr.h"
 #include "sensor_db.h"
+#include "timerwheel.h"
+#include "wire.h"
+#include "udp_listener.h"
 //Static: https://learn.microsoft.com/fr-fr/dotnet/csharp/language-reference/keywords/static
 //Const: https://learn.microsoft.com/fr-fr/cpp/cpp/const-cpp?view=msvc-170
-//Use of Select to implement time_out: https://man7.org/linux/man-pages/man2/select.2.html; https://www.youtube.com/watch?v=Y6pFtgRdUts&t=524s
-//required time out for client inactivity + extra to wake up waiting process periodically
 // served based logic changed to accepted based logic
-typedef struct {
-    tcpsock_t *client;
-    sbuffer_t *buffer;
-    conn_state_t *state;
-} client_handler_args_t;
+//Accepting: N acceptor threads, each one blocks in poll() on its own listen socket (SO_REUSEPORT: the kernel spreads the
+//connections over the sockets, https://lwn.net/Articles/542629/) and on a stop pipe
+//Continuous mode: max_conn caps the clients connected at once instead of the clients accepted in total, an acceptor at the
+//cap leaves the new connections in its backlog until a client leaves
+//Three backends behind connmgr_start, chosen at build time (make ... CONNMGR_FLAGS=-DCONNMGR_THREADED):
+//default: a few epoll reactor threads own all the client sockets; CONNMGR_THREADED: one thread per client blocking in recv();
+//CONNMGR_URING: io_uring rings that accept and receive themselves
+//TIMEOUT: a timer wheel (timerwheel.h) with one timer per connection, pushed back on every read, replaces the select() timeouts
+//UDP (args.udp_port): one more thread takes datagrams next to the TCP clients (udp_listener.h), same sbuffer
+#define CONNMGR_TICK_MS 100 // resolution of the inactivity timeout
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
 
 static void conn_state_init(conn_state_t *state) {
     state->accepted = 0;
@@ -34,208 +64,1368 @@ static void conn_state_destroy(conn_state_t *state) {
     pthread_mutex_destroy(&state->mtx);
 }
 
-static int wait_readable_with_timeout(tcpsock_t *sock, int timeout_sec)
-{
-    int fd = -1;
-    if (tcp_get_sd(sock, &fd) != TCP_NO_ERROR || fd < 0) {return -1;}
+static void conn_state_release(conn_state_t *state) {
+    pthread_mutex_lock(&state->mtx);
+    state->active--;
+    pthread_cond_broadcast(&state->condition);
+    pthread_mutex_unlock(&state->mtx);
+}
+
+//Framing shared by the backends: one read takes as many bytes as the connection buffer has room for,
+//every complete unit goes to the sbuffer in one batch, a partial unit stays for the next read
+//(a read may end anywhere, even inside a field)
+//The first bytes tell the protocol: a v2 client (wire.h) starts with a hello, anything else is v1 (bare 18-byte frames)
+#define CONNMGR_FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t)) // 18 bytes on the wire
+#define CONNMGR_RX_FRAMES 256 // records per sbuffer batch, v1 frames one read can take at most
+#define CONNMGR_RX_SIZE ((CONNMGR_RX_FRAMES * CONNMGR_FRAME_SIZE > WIRE_V2_MAX_FRAME) ? CONNMGR_RX_FRAMES * CONNMGR_FRAME_SIZE : WIRE_V2_MAX_FRAME)
+
+typedef struct {
+    size_t len;
+    unsigned char buf[CONNMGR_RX_SIZE];
+} conn_rx_t;
+
+typedef enum {CONN_PROTO_UNKNOWN = 0, CONN_PROTO_V1, CONN_PROTO_V2} conn_proto_t;
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
+typedef struct {
+    int have_id;
+    sensor_id_t sensorid;
+    conn_proto_t proto;
+} conn_id_t;
 
-    struct timeval tv;
-    tv.tv_sec = timeout_sec;
-    tv.tv_usec = 0;
+static void frames_decode(const unsigned char *p, size_t nframes, sensor_data_t *out) {
+    for (size_t i = 0; i < nframes; i++) {
+        memcpy(&out[i].id, p, sizeof(out[i].id));
+        p += sizeof(out[i].id);
+        memcpy(&out[i].value, p, sizeof(out[i].value));
+        p += sizeof(out[i].value);
+        memcpy(&out[i].ts, p, sizeof(out[i].ts));
+        p += sizeof(out[i].ts);
+    }
+}
 
-    int sel = select(fd + 1, &rfds, NULL, NULL, &tv);
-    if (sel <= 0) {
-        return sel;
+//returns -1 if the sbuffer refused the records
+static int frames_insert(const sensor_data_t *batch, size_t nframes, conn_id_t *id, sbuffer_t *buffer) {
+    if (!id->have_id) {
+        id->have_id = 1;
+        id->sensorid = batch[0].id;
+        log_event("Sensor node %u has opened a new connection", (unsigned)id->sensorid);
     }
-    if (!FD_ISSET(fd, &rfds)) {
+    if (sbuffer_insert_batch(buffer, batch, nframes) != SBUFFER_SUCCESS) {
+        fprintf(stderr, "sbuffer_insert failed\n");
         return -1;
     }
-    return 1;
+    return 0;
 }
 
-static void *client_handler(void *arg) {
-    client_handler_args_t *clientInfo = (client_handler_args_t *)arg;
-    sensor_data_t data;
-    int bytes, result;
-    int have_id = 0;
-    sensor_id_t sensorid = 0;
-    int timed_out = 0;
-
-    do {
-        int wr;
-        wr = wait_readable_with_timeout(clientInfo->client, TIMEOUT);
-        if (wr == 0) { timed_out = 1; break;}
-        if (wr < 0)  { break;}
-        bytes = sizeof(data.id);
-        result = tcp_receive(clientInfo->client, (void *)&data.id, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) {break;}
-
-        wr = wait_readable_with_timeout(clientInfo->client, TIMEOUT);
-        if (wr == 0) { timed_out = 1; break;}
-        if (wr < 0)  { break;}
-        bytes = sizeof(data.value);
-        result = tcp_receive(clientInfo->client, (void *)&data.value, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) {break;}
-
-        wr = wait_readable_with_timeout(clientInfo->client, TIMEOUT);
-        if (wr == 0) { timed_out = 1; break;}
-        if (wr < 0)  { break;}
-        bytes = sizeof(data.ts);
-        result = tcp_receive(clientInfo->client, (void *)&data.ts, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) {break;}
-
-        if (!have_id) {
-            have_id = 1;
-            sensorid = data.id;
-            log_event("Sensor node %u has opened a new connection", (unsigned)sensorid);
-        }
-
-        if (sbuffer_insert(clientInfo->buffer, &data) != SBUFFER_SUCCESS) {
-            fprintf(stderr, "sbuffer_insert failed\n");
-            break;
+//total size of the unit (hello, v1 or v2 frame) starting at 'p', as far as its 'len' first bytes tell; 0 if it is invalid
+static size_t rx_unit_size(const conn_id_t *id, const unsigned char *p, size_t len) {
+    switch (id->proto) {
+        case CONN_PROTO_UNKNOWN:
+            if (!wire_hello_prefix(p, len)) {return CONNMGR_FRAME_SIZE;}
+            return (len < WIRE_MAGIC_SIZE) ? WIRE_MAGIC_SIZE : WIRE_HELLO_SIZE;
+        case CONN_PROTO_V1:
+            return CONNMGR_FRAME_SIZE;
+        default: {
+            size_t const size = wire_v2_frame_size(p, len);
+            if (size == 0) {return 4;}
+            return (size <= WIRE_V2_MAX_FRAME) ? size : 0;
         }
-    } while (1);
+    }
+}
 
-    if (have_id) {
+//v2 hello: answered right away with the version the gateway speaks (8 bytes: always room in the socket buffer)
+static int rx_hello(conn_id_t *id, const unsigned char *p, int fd) {
+    uint8_t version = 0;
+    if (wire_parse_hello(p, &version) != WIRE_SUCCESS || version < WIRE_VERSION) {
+        log_event("Connection refused: unsupported protocol version %u", (unsigned)version);
+        return -1;
+    }
+    unsigned char reply[WIRE_HELLO_SIZE];
+    wire_hello(reply, WIRE_VERSION);
+    if (send(fd, reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)sizeof(reply)) {return -1;}
+    id->proto = CONN_PROTO_V2;
+    return 0;
+}
+
+//decodes and inserts the complete units at the start of 'p' (batched per CONNMGR_RX_FRAMES records)
+//returns the number of bytes used, or -1 if the stream is invalid or the sbuffer refused the records
+static ssize_t rx_parse(conn_id_t *id, const unsigned char *p, size_t len, int fd, sbuffer_t *buffer) {
+    sensor_data_t batch[CONNMGR_RX_FRAMES];
+    size_t nbatch = 0, used = 0;
+    while (used < len) {
+        size_t const unit = rx_unit_size(id, p + used, len - used);
+        if (unit == 0) {
+            log_event("Connection closed: invalid v2 frame length");
+            return -1;
+        }
+        if (id->proto == CONN_PROTO_UNKNOWN) {
+            if (unit == CONNMGR_FRAME_SIZE) {id->proto = CONN_PROTO_V1;continue;}
+            if (len - used < unit) {break;}
+            if (unit == WIRE_HELLO_SIZE) {
+                if (rx_hello(id, p + used, fd) != 0) {return -1;}
+                used += unit;
+            }
+            continue;
+        }
+        if (len - used < unit) {break;}
+
+        if (id->proto == CONN_PROTO_V1) {
+            size_t k = (len - used) / CONNMGR_FRAME_SIZE;
+            if (k > CONNMGR_RX_FRAMES - nbatch) {k = CONNMGR_RX_FRAMES - nbatch;}
+            frames_decode(p + used, k, batch + nbatch);
+            nbatch += k;
+            used += k * CONNMGR_FRAME_SIZE;
+        } else {
+            if (nbatch + WIRE_V2_MAX_READINGS > CONNMGR_RX_FRAMES) {
+                if (frames_insert(batch, nbatch, id, buffer) != 0) {return -1;}
+                nbatch = 0;
+            }
+            size_t n = 0;
+            if (wire_v2_decode(p + used, unit, batch + nbatch, &n) != WIRE_SUCCESS) {
+                log_event("Connection closed: corrupt v2 frame (length, count or CRC)");
+                return -1;
+            }
+            nbatch += n;
+            used += unit;
+        }
+        if (nbatch == CONNMGR_RX_FRAMES) {
+            if (frames_insert(batch, nbatch, id, buffer) != 0) {return -1;}
+            nbatch = 0;
+        }
+    }
+    if (nbatch > 0 && frames_insert(batch, nbatch, id, buffer) != 0) {return -1;}
+    return (ssize_t)used;
+}
+
+#ifndef CONNMGR_URING
+//decodes the complete units of 'rx' and inserts them, keeps the partial one; returns -1 on error (see rx_parse)
+static int rx_deliver(conn_rx_t *rx, conn_id_t *id, int fd, sbuffer_t *buffer) {
+    ssize_t const used = rx_parse(id, rx->buf, rx->len, fd, buffer);
+    if (used < 0) {return -1;}
+    rx->len -= (size_t)used;
+    memmove(rx->buf, rx->buf + used, rx->len);
+    return 0;
+}
+#endif
+
+static void log_closed(const conn_id_t *id, int timed_out) {
+    if (id->have_id) {
         if (timed_out) {
-            log_event("Sensor node %u time out", (unsigned)sensorid);
+            log_event("Sensor node %u time out", (unsigned)id->sensorid);
         }
-        log_event("Sensor node %u has closed the connection", (unsigned)sensorid);
+        log_event("Sensor node %u has closed the connection", (unsigned)id->sensorid);
+    }
+}
+
+typedef struct connmgr connmgr_t;
+static void acceptors_stop(connmgr_t *cm);
+static void connmgr_fail(connmgr_t *cm);
+
+#ifdef CONNMGR_THREADED
+//The client threads block in recv() without a timeout; one timer thread advances a wheel shared by all of them (under a mutex)
+//and shuts the read side of an idle connection down, so its blocked recv() returns 0
+typedef struct backend backend_t;
+
+typedef struct client_handler_args {
+    tcpsock_t client; // embedded: tcp_close_embedded
+    int fd;
+    backend_t *backend;
+    timerwheel_timer_t timer; // under backend->wheel_mtx, like the fields below
+    int timed_out;
+    struct client_handler_args *next, *prev; // backend->clients
+} client_handler_args_t;
+
+struct backend {
+    sbuffer_t *buffer;
+    conn_state_t *state;
+    pthread_mutex_t wheel_mtx;
+    timerwheel_t *wheel;
+    client_handler_args_t *clients; // live clients, under wheel_mtx like draining
+    int draining;
+    pthread_t timer_tid;
+    atomic_bool stop;
+};
+
+static void client_touch(client_handler_args_t *clientInfo) {
+    backend_t *backend = clientInfo->backend;
+    pthread_mutex_lock(&backend->wheel_mtx);
+    timerwheel_schedule(backend->wheel, &clientInfo->timer, now_ms() + (uint64_t)TIMEOUT * 1000u);
+    pthread_mutex_unlock(&backend->wheel_mtx);
+}
+
+//called by timer_main with wheel_mtx held: the client thread only closes its socket after cancelling its timer
+static void client_expired(timerwheel_timer_t *timer, void *arg) {
+    (void)arg;
+    client_handler_args_t *clientInfo = container_of(timer, client_handler_args_t, timer);
+    clientInfo->timed_out = 1;
+    shutdown(clientInfo->fd, SHUT_RD);
+}
+
+static void *timer_main(void *arg) {
+    backend_t *backend = (backend_t *)arg;
+    struct timespec const tick = {.tv_sec = 0, .tv_nsec = CONNMGR_TICK_MS * 1000000L};
+    while (!atomic_load(&backend->stop)) {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&backend->wheel_mtx);
+        timerwheel_advance(backend->wheel, now_ms(), client_expired, NULL);
+        pthread_mutex_unlock(&backend->wheel_mtx);
     }
+    return NULL;
+}
 
-    tcp_close(&clientInfo->client);
+//with wheel_mtx held
+static void client_unlink(client_handler_args_t *clientInfo) {
+    backend_t *backend = clientInfo->backend;
+    if (clientInfo->prev != NULL) {clientInfo->prev->next = clientInfo->next;} else {backend->clients = clientInfo->next;}
+    if (clientInfo->next != NULL) {clientInfo->next->prev = clientInfo->prev;}
+}
 
-    pthread_mutex_lock(&clientInfo->state->mtx);
-    clientInfo->state->active--;
-    pthread_cond_broadcast(&clientInfo->state->condition);
-    pthread_mutex_unlock(&clientInfo->state->mtx);
+//one recv per read, into the connection buffer
+static void *client_handler(void *arg) {
+    client_handler_args_t *clientInfo = (client_handler_args_t *)arg;
+    backend_t *backend = clientInfo->backend;
+    conn_rx_t rx = {.len = 0};
+    conn_id_t id = {.have_id = 0, .sensorid = 0, .proto = CONN_PROTO_UNKNOWN};
 
+    while (1) {
+        int bytes = (int)(sizeof(rx.buf) - rx.len);
+        int result = tcp_receive(&clientInfo->client, rx.buf + rx.len, &bytes);
+        if (result == TCP_SOCKOP_ERROR && errno == EINTR) {continue;}
+        if (result == TCP_NO_ERROR) {
+            rx.len += (size_t)bytes;
+            client_touch(clientInfo);
+        }
+        if (rx_deliver(&rx, &id, clientInfo->fd, backend->buffer) != 0 || result != TCP_NO_ERROR) {break;}
+    }
+
+    pthread_mutex_lock(&backend->wheel_mtx);
+    timerwheel_cancel(backend->wheel, &clientInfo->timer);
+    client_unlink(clientInfo);
+    int const timed_out = clientInfo->timed_out;
+    pthread_mutex_unlock(&backend->wheel_mtx);
+
+    log_closed(&id, timed_out);
+    tcp_close_embedded(&clientInfo->client);
+    conn_state_release(backend->state);
     free(clientInfo);
     return NULL;
 }
 
-static void *connmgr_main(void *arg) {
-    connmgr_args_t const ConnInfo = *(connmgr_args_t *)arg;
-    free(arg);
+static int backend_start(backend_t *backend, const connmgr_args_t *args, conn_state_t *state) {
+    backend->buffer = args->buffer;
+    backend->state = state;
+    backend->clients = NULL;
+    backend->draining = 0;
+    atomic_init(&backend->stop, false);
+    if (timerwheel_init(&backend->wheel, CONNMGR_TICK_MS, now_ms()) != TIMERWHEEL_SUCCESS) {return -1;}
+    pthread_mutex_init(&backend->wheel_mtx, NULL);
+    if (pthread_create(&backend->timer_tid, NULL, timer_main, backend) != 0) {
+        pthread_mutex_destroy(&backend->wheel_mtx);
+        timerwheel_free(&backend->wheel);
+        return -1;
+    }
+    return 0;
+}
 
-    tcpsock_t *server = NULL;
+static int backend_add_client(backend_t *backend, tcpsock_t *client) {
+    client_handler_args_t *clientInfo = malloc(sizeof(*clientInfo));
+    if (!clientInfo) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
 
-    conn_state_t state;
-    conn_state_init(&state);
+    clientInfo->client = *client;
+    clientInfo->backend = backend;
+    clientInfo->timed_out = 0;
+    timerwheel_timer_init(&clientInfo->timer);
+    int flags = -1;
+    if (tcp_get_sd(client, &clientInfo->fd) != TCP_NO_ERROR || (flags = fcntl(clientInfo->fd, F_GETFL, 0)) < 0 ||
+        fcntl(clientInfo->fd, F_SETFL, flags & ~O_NONBLOCK) != 0) { // accepted non-blocking, this thread blocks in recv()
+        free(clientInfo);
+        return -1;
+    }
 
-    if (tcp_passive_open(&server, ConnInfo.port) != TCP_NO_ERROR) {
-        fprintf(stderr, "tcp_passive_open failed\n");
-        sbuffer_close(ConnInfo.buffer);
-        return NULL;
+    //listed before the thread exists, so backend_drain sees every client
+    pthread_mutex_lock(&backend->wheel_mtx);
+    timerwheel_schedule(backend->wheel, &clientInfo->timer, now_ms() + (uint64_t)TIMEOUT * 1000u);
+    clientInfo->prev = NULL;
+    clientInfo->next = backend->clients;
+    if (backend->clients != NULL) {backend->clients->prev = clientInfo;}
+    backend->clients = clientInfo;
+    if (backend->draining) {shutdown(clientInfo->fd, SHUT_RD);}
+    pthread_mutex_unlock(&backend->wheel_mtx);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, client_handler, clientInfo);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create failed, closing client\n");
+        pthread_mutex_lock(&backend->wheel_mtx);
+        timerwheel_cancel(backend->wheel, &clientInfo->timer);
+        client_unlink(clientInfo);
+        pthread_mutex_unlock(&backend->wheel_mtx);
+        free(clientInfo);
+        return -1;
     }
+    pthread_detach(tid);
+    return 0;
+}
+
+//continuous mode shutdown: every client gets the end of its stream, the threads read what is left and leave
+static void backend_drain(backend_t *backend) {
+    pthread_mutex_lock(&backend->wheel_mtx);
+    backend->draining = 1;
+    for (client_handler_args_t *c = backend->clients; c != NULL; c = c->next) {shutdown(c->fd, SHUT_RD);}
+    pthread_mutex_unlock(&backend->wheel_mtx);
+}
 
-    int listen_fd = -1;
-    if (tcp_get_sd(server, &listen_fd) != TCP_NO_ERROR || listen_fd < 0) {
-        fprintf(stderr, "tcp_get_sd failed\n");
-        tcp_close(&server);
-        sbuffer_close(ConnInfo.buffer);
-        conn_state_destroy(&state);
+//the client threads are detached and all gone (state.active == 0), only the timer thread is left
+static void backend_stop(backend_t *backend) {
+    atomic_store(&backend->stop, true);
+    pthread_join(backend->timer_tid, NULL);
+    pthread_mutex_destroy(&backend->wheel_mtx);
+    timerwheel_free(&backend->wheel);
+}
+
+#elif defined(CONNMGR_URING)
+//io_uring (make ... CONNMGR_FLAGS=-DCONNMGR_URING, Linux >= 6.0), raw syscalls as liburing is not available everywhere:
+//https://kernel.dk/io_uring.pdf; https://man7.org/linux/man-pages/man7/io_uring.7.html; https://github.com/axboe/liburing/wiki
+//Every ring thread (args.reactors of them) owns a SO_REUSEPORT listen socket with one multishot accept, and one multishot
+//recv per client that takes its buffer from a ring of buffers registered with the kernel (provided buffers):
+//the frames are decoded straight out of those buffers, the buffer goes back to the kernel right after
+//Only the ring thread touches its SQ/CQ, the other threads set a flag and write the eventfd (polled by the ring)
+#define CONNMGR_BACKEND_ACCEPTS // the rings accept themselves: connmgr_main starts no acceptor threads
+#define URING_ENTRIES 1024      // SQ entries, the CQ gets URING_CQ_ENTRIES (the kernel keeps overflowing CQEs on a list)
+#define URING_CQ_ENTRIES 16384
+#define URING_BUFS 1024         // provided buffers per ring, power of two
+#define URING_BUF_SIZE 4096     // ~227 frames per receive
+#define URING_BGID 0
+enum {UD_ACCEPT = 1, UD_WAKE, UD_CANCEL}; // user_data of the ring's own requests, any other value is a conn_t *
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries, sq_local_tail, sq_submitted;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len, sqes_len;
+} uring_t;
+
+typedef struct conn {
+    int fd;
+    conn_id_t id;
+    timerwheel_timer_t timer; // last activity + TIMEOUT
+    struct conn *next, *prev; // parked list, then the live list of the ring once served (next only while parked)
+    int timed_out;
+    int closing;              // shut down, waiting for the last recv completion
+    unsigned char *carry;     // a unit split over receives: carry_small, or a v2 frame on the heap
+    size_t carry_len, carry_cap;
+    unsigned char carry_small[CONNMGR_FRAME_SIZE];
+} conn_t;
+
+typedef struct backend backend_t;
+
+typedef struct {
+    pthread_t tid;
+    uring_t ring;
+    struct io_uring_buf_ring *br;
+    unsigned char *bufs;
+    uint16_t br_tail;
+    int wake_fd; // eventfd: listen, stop accepting, drain, stop or a place freed for the parked connections
+    sbuffer_t *buffer;
+    conn_state_t *state;
+    int max_conn, continuous;
+    connmgr_t *cm;
+    backend_t *backend;
+    tcpsock_t *server;
+    int listen_fd;
+    atomic_bool listening, stop_accept, drain, stop, has_parked;
+    int accepting;     // multishot accept armed
+    int cancelling;    // async cancel of the accept sent
+    conn_t *parked, *parked_tail; // continuous mode: accepted above the cap, served once a client leaves
+    timerwheel_t *wheel; // owned by the ring thread only, like the fields below
+    conn_t *conns; // served connections, what the drain shuts down
+    timerwheel_timer_t accept_retry; // accept failed (out of fds, ...): wait a tick before arming it again
+    int accept_paused;
+    int nconns;
+    uint64_t now;
+} reactor_t;
+
+struct backend {
+    reactor_t *reactors;
+    int nreactors;
+};
+
+static int uring_setup(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0 && errno == EINVAL) { // COOP_TASKRUN: 5.19
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (u->fd < 0) {return -1;}
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        close(u->fd);
+        return -1;
+    }
+
+    size_t const sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t const cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_len = (sq_len > cq_len) ? sq_len : cq_len;
+    u->ring_ptr = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_ptr == MAP_FAILED) {close(u->fd);return -1;}
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {munmap(u->ring_ptr, u->ring_len);close(u->fd);return -1;}
+
+    char *ring = (char *)u->ring_ptr;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {array[i] = i;} // SQE i always sits in slot i
+    u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_free(uring_t *u) {
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->ring_ptr, u->ring_len);
+    close(u->fd);
+}
+
+//submits the queued SQEs, and waits for at least one CQE when 'wait' (at most timeout_ms, -1 = no limit)
+static int uring_enter(uring_t *u, int wait, int timeout_ms) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned const to_submit = u->sq_local_tail - u->sq_submitted;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {.sigmask = 0, .sigmask_sz = _NSIG / 8, .pad = 0, .ts = (uint64_t)(uintptr_t)&ts};
+    if (wait && timeout_ms >= 0) {flags |= IORING_ENTER_EXT_ARG;}
+    int rc = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, wait ? 1 : 0, flags,
+                          (flags & IORING_ENTER_EXT_ARG) ? (void *)&arg : NULL, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : _NSIG / 8);
+    if (rc >= 0) {u->sq_submitted += (unsigned)rc;}
+    else if (errno == ETIME || errno == EINTR || errno == EBUSY) {rc = 0;} // EBUSY: CQ overflow, reap first
+    return rc;
+}
+
+//next free SQE, zeroed; submits first when the SQ is full
+static struct io_uring_sqe *uring_sqe(uring_t *u) {
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0, 0) < 0) {return NULL;}
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static void buf_recycle(reactor_t *r, unsigned bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = (uint16_t)bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static int bufs_register(reactor_t *r) {
+    r->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {return -1;}
+    r->bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->bufs == MAP_FAILED) {munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));return -1;}
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        fprintf(stderr, "io_uring: provided buffer rings need Linux >= 5.19\n");
+        munmap(r->bufs, (size_t)URING_BUFS * URING_BUF_SIZE);
+        munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+        return -1;
+    }
+    r->br_tail = 0;
+    for (unsigned i = 0; i < URING_BUFS; i++) {buf_recycle(r, i);}
+    return 0;
+}
+
+static void bufs_free(reactor_t *r) {
+    munmap(r->bufs, (size_t)URING_BUFS * URING_BUF_SIZE);
+    munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+}
+
+static void arm_recv(reactor_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (sqe == NULL) {return;}
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t)c;
+}
+
+static void arm_accept(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (sqe == NULL) {return;}
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT;
+    r->accepting = 1;
+}
+
+static void arm_wake(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (sqe == NULL) {return;}
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UD_WAKE;
+}
+
+static void cancel_accept(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (sqe == NULL) {return;}
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD_ACCEPT;
+    sqe->user_data = UD_CANCEL;
+    r->cancelling = 1;
+}
+
+static void reactor_wake(reactor_t *r) {
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0) {fprintf(stderr, "eventfd write failed\n");}
+}
+
+static int conn_carry_reserve(conn_t *c, size_t size) {
+    if (size <= c->carry_cap) {return 0;}
+    unsigned char *big = malloc(WIRE_V2_MAX_FRAME); // only v2 frames outgrow carry_small
+    if (big == NULL) {return -1;}
+    memcpy(big, c->carry, c->carry_len);
+    c->carry = big;
+    c->carry_cap = WIRE_V2_MAX_FRAME;
+    return 0;
+}
+
+//units straight from a receive buffer, a unit split over receives is completed in c->carry first
+static int conn_deliver(conn_t *c, const unsigned char *data, size_t len, sbuffer_t *buffer) {
+    while (c->carry_len > 0 && len > 0) {
+        size_t const need = rx_unit_size(&c->id, c->carry, c->carry_len);
+        if (need == 0 || conn_carry_reserve(c, need) != 0) {return -1;}
+        size_t const take = (need - c->carry_len < len) ? need - c->carry_len : len;
+        memcpy(c->carry + c->carry_len, data, take);
+        c->carry_len += take;
+        data += take;
+        len -= take;
+        ssize_t const used = rx_parse(&c->id, c->carry, c->carry_len, c->fd, buffer);
+        if (used < 0) {return -1;}
+        c->carry_len -= (size_t)used;
+        memmove(c->carry, c->carry + used, c->carry_len);
+    }
+    if (len == 0) {return 0;}
+    ssize_t const used = rx_parse(&c->id, data, len, c->fd, buffer);
+    if (used < 0) {return -1;}
+    size_t const rest = len - (size_t)used;
+    if (conn_carry_reserve(c, rest) != 0) {return -1;}
+    memcpy(c->carry, data + used, rest);
+    c->carry_len = rest;
+    return 0;
+}
+
+static void conn_free(conn_t *c) {
+    if (c->carry != c->carry_small) {free(c->carry);}
+    free(c);
+}
+
+static void conn_touch(reactor_t *r, conn_t *c) {
+    timerwheel_schedule(r->wheel, &c->timer, r->now + (uint64_t)TIMEOUT * 1000u);
+}
+
+static conn_t *conn_new(int fd) {
+    conn_t *c = malloc(sizeof(*c));
+    if (!c) {
+        fprintf(stderr, "malloc failed\n");
         return NULL;
     }
+    c->fd = fd;
+    c->id = (conn_id_t){.have_id = 0, .sensorid = 0, .proto = CONN_PROTO_UNKNOWN};
+    c->next = NULL;
+    c->timed_out = 0;
+    c->closing = 0;
+    c->carry = c->carry_small;
+    c->carry_len = 0;
+    c->carry_cap = sizeof(c->carry_small);
+    timerwheel_timer_init(&c->timer);
+    return c;
+}
+
+//counted in state.active by the caller
+static void conn_serve(reactor_t *r, conn_t *c) {
+    c->prev = NULL;
+    c->next = r->conns;
+    if (r->conns != NULL) {r->conns->prev = c;}
+    r->conns = c;
+    r->nconns++;
+    conn_touch(r, c);
+    arm_recv(r, c);
+}
+
+//the recv completes with 0 (or an error) after a shutdown, the connection is freed then (conn_finish)
+static void conn_shutdown(conn_t *c, int timed_out) {
+    if (c->closing) {return;}
+    c->closing = 1;
+    c->timed_out = timed_out;
+    shutdown(c->fd, SHUT_RD);
+}
+
+static void conn_finish(reactor_t *r, conn_t *c) {
+    log_closed(&c->id, c->timed_out);
+    timerwheel_cancel(r->wheel, &c->timer);
+    if (c->prev != NULL) {c->prev->next = c->next;} else {r->conns = c->next;}
+    if (c->next != NULL) {c->next->prev = c->prev;}
+    r->nconns--;
+    close(c->fd);
+    conn_free(c);
+    conn_state_release(r->state);
+    for (int i = 0; i < r->backend->nreactors; i++) { // a place freed up for the connections parked on any ring
+        reactor_t *other = &r->backend->reactors[i];
+        if (atomic_load(&other->has_parked)) {reactor_wake(other);}
+    }
+}
+
+static void on_recv(reactor_t *r, conn_t *c, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned const bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !c->closing) { // completions queued before a shutdown are dropped with the connection
+            conn_touch(r, c);
+            if (conn_deliver(c, r->bufs + (size_t)bid * URING_BUF_SIZE, (size_t)res, r->buffer) != 0) {conn_shutdown(c, 0);}
+        }
+        buf_recycle(r, bid);
+    }
+    if (flags & IORING_CQE_F_MORE) {return;}
+    //the multishot recv ended: EOF, error, or the kernel stopped it (out of buffers, CQ overflow) and it is armed again
+    if (res > 0 || res == -ENOBUFS) {arm_recv(r, c);}
+    else {conn_finish(r, c);}
+}
+
+static void on_accept(reactor_t *r, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {r->accepting = 0;r->cancelling = 0;}
+    if (res < 0) {
+        if (res != -ECANCELED && !(flags & IORING_CQE_F_MORE)) {
+            fprintf(stderr, "io_uring accept failed: %s\n", strerror(-res));
+            r->accept_paused = 1;
+            timerwheel_schedule(r->wheel, &r->accept_retry, r->now + CONNMGR_TICK_MS);
+        }
+        return;
+    }
+
+    conn_t *c = conn_new(res);
+    if (c == NULL) {close(res);return;}
+    pthread_mutex_lock(&r->state->mtx);
+    if (!r->continuous && r->state->accepted >= r->max_conn) {
+        log_event("Connection refused: Max number of clients (%d) already accepted", r->max_conn);
+        pthread_mutex_unlock(&r->state->mtx);
+        close(c->fd);
+        conn_free(c);
+        return;
+    }
+    //the cancel of the multishot accept is async: what it still accepts after stop_accept would miss the drain
+    if (atomic_load(&r->stop_accept)) {
+        pthread_mutex_unlock(&r->state->mtx);
+        close(c->fd);
+        conn_free(c);
+        return;
+    }
+    if (r->continuous && (r->state->active >= r->max_conn || r->parked != NULL)) {
+        if (r->parked == NULL) {log_event("Connection cap reached: %d clients connected", r->state->active);}
+        pthread_mutex_unlock(&r->state->mtx);
+        if (r->parked == NULL) {r->parked = c;} else {r->parked_tail->next = c;}
+        r->parked_tail = c;
+        atomic_store(&r->has_parked, true);
+        return;
+    }
+    r->state->accepted++;
+    r->state->active++;
+    int const last = (!r->continuous && r->state->accepted >= r->max_conn);
+    pthread_mutex_unlock(&r->state->mtx);
+
+    conn_serve(r, c);
+    if (last) {acceptors_stop(r->cm);}
+}
+
+static void reactor_unpark(reactor_t *r) {
+    if (r->parked == NULL) {return;}
+    pthread_mutex_lock(&r->state->mtx);
+    while (r->parked != NULL && r->state->active < r->max_conn) {
+        conn_t *c = r->parked;
+        r->parked = c->next;
+        c->next = NULL;
+        r->state->accepted++;
+        r->state->active++;
+        pthread_mutex_unlock(&r->state->mtx);
+        conn_serve(r, c);
+        pthread_mutex_lock(&r->state->mtx);
+    }
+    pthread_mutex_unlock(&r->state->mtx);
+    atomic_store(&r->has_parked, r->parked != NULL);
+}
+
+//never served: not counted in state.active
+static void reactor_close_parked(reactor_t *r) {
+    while (r->parked != NULL) {
+        conn_t *c = r->parked;
+        r->parked = c->next;
+        close(c->fd);
+        conn_free(c);
+    }
+    atomic_store(&r->has_parked, false);
+}
+
+//arms or cancels the multishot accept to match what the ring should do now
+static void reactor_sync_accept(reactor_t *r) {
+    if (!atomic_load(&r->listening)) {return;}
+    int const want = !atomic_load(&r->stop_accept) && r->parked == NULL && !r->accept_paused;
+    if (want && !r->accepting) {arm_accept(r);}
+    else if (!want && r->accepting && !r->cancelling) {cancel_accept(r);}
+    else if (!want && !r->accepting && atomic_load(&r->stop_accept) && r->server != NULL) {
+        tcp_close(&r->server); // nothing refers to the listen socket any more
+        r->listen_fd = -1;
+    }
+}
+
+static void conn_expired(timerwheel_timer_t *timer, void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    if (timer == &r->accept_retry) {r->accept_paused = 0;return;}
+    conn_shutdown(container_of(timer, conn_t, timer), 1);
+}
+
+//the ring is unusable: give the connections back so connmgr_main does not wait forever
+//(no completion is reaped any more, the requests still armed go away with the ring in reactor_destroy)
+static void reactor_fail(reactor_t *r) {
+    reactor_close_parked(r);
+    while (r->conns != NULL) {conn_finish(r, r->conns);}
+    r->accepting = 0;
+    if (r->cm != NULL) {connmgr_fail(r->cm);}
+}
+
+static void *reactor_main(void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    arm_wake(r);
 
     while (1) {
-        pthread_mutex_lock(&state.mtx);
-        int const done = (state.accepted >= ConnInfo.max_conn);
-        pthread_mutex_unlock(&state.mtx);
-        if (done) break;
-
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(listen_fd, &rfds);
-
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200 * 1000; //200ms
-
-        int sel = select(listen_fd + 1, &rfds, NULL, NULL, &tv);
-        if (sel < 0) {
-            fprintf(stderr, "select failed\n");
+        if (uring_enter(&r->ring, 1, timerwheel_next_timeout(r->wheel, now_ms())) < 0) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            reactor_fail(r);
             break;
         }
+        r->now = now_ms();
 
-        if (!FD_ISSET(listen_fd, &rfds)) {
-            continue;
+        unsigned head = *r->ring.cq_head;
+        unsigned const tail = __atomic_load_n(r->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe const cqe = r->ring.cqes[head & r->ring.cq_mask];
+            if (cqe.user_data == UD_WAKE) {
+                uint64_t count;
+                if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {fprintf(stderr, "eventfd read failed\n");}
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {arm_wake(r);}
+            } else if (cqe.user_data == UD_ACCEPT) {
+                on_accept(r, cqe.res, cqe.flags);
+            } else if (cqe.user_data != UD_CANCEL) {
+                on_recv(r, (conn_t *)(uintptr_t)cqe.user_data, cqe.res, cqe.flags);
+            }
+        }
+        __atomic_store_n(r->ring.cq_head, head, __ATOMIC_RELEASE);
+
+        timerwheel_advance(r->wheel, r->now, conn_expired, r);
+        if (atomic_load(&r->drain)) {
+            reactor_close_parked(r);
+            for (conn_t *c = r->conns; c != NULL; c = c->next) {conn_shutdown(c, 0);}
+        }
+        if (!atomic_load(&r->stop_accept)) {reactor_unpark(r);}
+        reactor_sync_accept(r);
+        if (atomic_load(&r->stop) && r->nconns == 0 && !r->accepting) {break;}
+    }
+    return NULL;
+}
+
+static int reactor_init(reactor_t *r, backend_t *backend, const connmgr_args_t *args, conn_state_t *state) {
+    memset(r, 0, sizeof(*r));
+    r->backend = backend;
+    r->buffer = args->buffer;
+    r->state = state;
+    r->max_conn = args->max_conn;
+    r->continuous = args->continuous;
+    r->listen_fd = -1;
+    r->now = now_ms();
+    atomic_init(&r->listening, false);
+    atomic_init(&r->stop_accept, false);
+    atomic_init(&r->drain, false);
+    atomic_init(&r->stop, false);
+    atomic_init(&r->has_parked, false);
+    timerwheel_timer_init(&r->accept_retry);
+    if (timerwheel_init(&r->wheel, CONNMGR_TICK_MS, r->now) != TIMERWHEEL_SUCCESS) {return -1;}
+    if (uring_setup(&r->ring, URING_ENTRIES) != 0) {
+        fprintf(stderr, "io_uring_setup failed: %s\n", strerror(errno));
+        timerwheel_free(&r->wheel);
+        return -1;
+    }
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd < 0 || bufs_register(r) != 0) {
+        if (r->wake_fd >= 0) {close(r->wake_fd);}
+        uring_free(&r->ring);
+        timerwheel_free(&r->wheel);
+        return -1;
+    }
+    if (pthread_create(&r->tid, NULL, reactor_main, r) != 0) {
+        bufs_free(r);
+        close(r->wake_fd);
+        uring_free(&r->ring);
+        timerwheel_free(&r->wheel);
+        return -1;
+    }
+    return 0;
+}
+
+static void reactor_destroy(reactor_t *r) {
+    atomic_store(&r->stop_accept, true);
+    atomic_store(&r->stop, true);
+    reactor_wake(r);
+    pthread_join(r->tid, NULL);
+    uring_free(&r->ring); // cancels what is still armed (the eventfd poll)
+    bufs_free(r);
+    close(r->wake_fd);
+    if (r->server != NULL) {tcp_close(&r->server);}
+    timerwheel_free(&r->wheel);
+}
+
+static int backend_start(backend_t *backend, const connmgr_args_t *args, conn_state_t *state) {
+    backend->nreactors = (args->reactors > 0) ? args->reactors : 1;
+    backend->reactors = malloc((size_t)backend->nreactors * sizeof(reactor_t));
+    if (backend->reactors == NULL) {return -1;}
+    for (int i = 0; i < backend->nreactors; i++) {
+        if (reactor_init(&backend->reactors[i], backend, args, state) != 0) {
+            fprintf(stderr, "io_uring ring start failed\n");
+            for (int j = 0; j < i; j++) {reactor_destroy(&backend->reactors[j]);}
+            free(backend->reactors);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//number of listen sockets backend_listen opens
+static int backend_listeners(const backend_t *backend) {return backend->nreactors;}
+
+//one listen socket per ring, SO_REUSEPORT when there are several
+static int backend_listen(backend_t *backend, connmgr_t *cm, int port, int backlog) {
+    for (int i = 0; i < backend->nreactors; i++) {
+        reactor_t *r = &backend->reactors[i];
+        if (tcp_passive_open_opts(&r->server, port, backlog, backend->nreactors > 1) != TCP_NO_ERROR ||
+            tcp_get_sd(r->server, &r->listen_fd) != TCP_NO_ERROR) {
+            fprintf(stderr, "tcp_passive_open failed\n");
+            for (int j = 0; j <= i; j++) {
+                if (backend->reactors[j].server != NULL) {tcp_close(&backend->reactors[j].server);}
+            }
+            return -1;
         }
+        r->cm = cm;
+    }
+    for (int i = 0; i < backend->nreactors; i++) {
+        atomic_store(&backend->reactors[i].listening, true);
+        reactor_wake(&backend->reactors[i]);
+    }
+    return 0;
+}
+
+static void backend_stop_accepting(backend_t *backend) {
+    for (int i = 0; i < backend->nreactors; i++) {
+        atomic_store(&backend->reactors[i].stop_accept, true);
+        reactor_wake(&backend->reactors[i]);
+    }
+}
+
+//continuous mode shutdown, after backend_stop_accepting
+static void backend_drain(backend_t *backend) {
+    for (int i = 0; i < backend->nreactors; i++) {
+        atomic_store(&backend->reactors[i].drain, true);
+        reactor_wake(&backend->reactors[i]);
+    }
+}
 
-        tcpsock_t *client = NULL;
-        if (tcp_wait_for_connection(server, &client) != TCP_NO_ERROR) {
-            fprintf(stderr, "tcp_wait_for_connection failed\n");
+static void backend_stop(backend_t *backend) {
+    for (int i = 0; i < backend->nreactors; i++) {reactor_destroy(&backend->reactors[i]);}
+    free(backend->reactors);
+}
+#else
+//Reactor: https://man7.org/linux/man-pages/man7/epoll.7.html
+//Non-blocking client sockets, level-triggered: one recv per readiness event into the connection buffer
+//Inactivity: every reactor owns a timer wheel, the epoll_wait timeout is the wait until its next tick with a timer
+//A full sbuffer with the BLOCK policy blocks the whole reactor: the kernel socket buffers fill up and TCP pushes back
+#define CONNMGR_MAX_EVENTS 64
+
+typedef struct conn {
+    tcpsock_t client; // embedded: tcp_close_embedded
+    int fd;
+    conn_id_t id;
+    timerwheel_timer_t timer; // last activity + TIMEOUT
+    struct conn *next, *prev; // hand-over list to the reactor, then its live list (next only)
+    conn_rx_t rx;
+} conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    int wake_fd; // eventfd: new connections handed over or stop requested
+    sbuffer_t *buffer;
+    conn_state_t *state;
+    pthread_mutex_t pending_mtx; // connections accepted by connmgr_main, not yet adopted by the reactor
+    conn_t *pending;
+    atomic_bool stop;
+    atomic_bool drain; // continuous mode shutdown: close every client
+    timerwheel_t *wheel; // owned by the reactor thread only, like conns, nconns and now
+    conn_t *conns; // live connections, what the drain closes
+    int nconns;
+    uint64_t now; // read once per epoll_wait
+} reactor_t;
+
+typedef struct {
+    reactor_t *reactors;
+    int nreactors;
+    atomic_uint next; // round-robin hand-over, the acceptor threads (-a) add clients concurrently
+} backend_t;
+
+static void conn_touch(reactor_t *r, conn_t *c) {
+    timerwheel_schedule(r->wheel, &c->timer, r->now + (uint64_t)TIMEOUT * 1000u);
+}
+
+static void conn_close(reactor_t *r, conn_t *c, int timed_out) {
+    log_closed(&c->id, timed_out);
+    timerwheel_cancel(r->wheel, &c->timer);
+    if (c->prev != NULL) {c->prev->next = c->next;} else {r->conns = c->next;}
+    if (c->next != NULL) {c->next->prev = c->prev;}
+    r->nconns--;
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    tcp_close_embedded(&c->client);
+    conn_state_release(r->state);
+    free(c);
+}
+
+static void conn_readable(reactor_t *r, conn_t *c) {
+    ssize_t n = recv(c->fd, c->rx.buf + c->rx.len, sizeof(c->rx.buf) - c->rx.len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {return;}
+    if (n > 0) {
+        c->rx.len += (size_t)n;
+        conn_touch(r, c);
+    }
+    if (rx_deliver(&c->rx, &c->id, c->fd, r->buffer) != 0 || n <= 0) {conn_close(r, c, 0);} // n == 0: peer closed, n < 0: socket error
+}
+
+static void reactor_adopt_pending(reactor_t *r) {
+    pthread_mutex_lock(&r->pending_mtx);
+    conn_t *c = r->pending;
+    r->pending = NULL;
+    pthread_mutex_unlock(&r->pending_mtx);
+
+    while (c != NULL) {
+        conn_t *next = c->next;
+        c->prev = NULL;
+        c->next = r->conns;
+        if (r->conns != NULL) {r->conns->prev = c;}
+        r->conns = c;
+        r->nconns++;
+        conn_touch(r, c);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+            fprintf(stderr, "epoll_ctl failed, closing client\n");
+            conn_close(r, c, 0);
+        }
+        c = next;
+    }
+}
+
+static void conn_expired(timerwheel_timer_t *timer, void *arg) {
+    conn_close((reactor_t *)arg, container_of(timer, conn_t, timer), 1);
+}
+
+//continuous mode shutdown or an epoll error: close every connection, the ones adopted after the drain started too
+static void reactor_drop_all(reactor_t *r) {
+    while (r->conns != NULL) {conn_close(r, r->conns, 0);}
+}
+
+static void *reactor_main(void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    struct epoll_event events[CONNMGR_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(r->epfd, events, CONNMGR_MAX_EVENTS, timerwheel_next_timeout(r->wheel, now_ms()));
+        r->now = now_ms();
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed\n");
             break;
         }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) { // wake_fd
+                uint64_t count;
+                if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {fprintf(stderr, "eventfd read failed\n");}
+                reactor_adopt_pending(r);
+                continue;
+            }
+            conn_readable(r, (conn_t *)events[i].data.ptr);
+        }
+        timerwheel_advance(r->wheel, r->now, conn_expired, r);
+        if (atomic_load(&r->drain)) {reactor_drop_all(r);}
+        if (atomic_load(&r->stop) && r->nconns == 0) {break;}
+    }
 
-        pthread_mutex_lock(&state.mtx);
-        if (state.accepted >= ConnInfo.max_conn) {
-            log_event("Connection refused: Max number of clients (%d) already accepted",ConnInfo.max_conn);
-            pthread_mutex_unlock(&state.mtx);
-            tcp_close(&client);
-            continue;
+    //only on an epoll error: give the remaining connections back so connmgr_main does not wait forever
+    reactor_adopt_pending(r);
+    reactor_drop_all(r);
+    return NULL;
+}
+
+static void reactor_wake(reactor_t *r) {
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0) {fprintf(stderr, "eventfd write failed\n");}
+}
+
+static int reactor_init(reactor_t *r, const connmgr_args_t *args, conn_state_t *state) {
+    r->buffer = args->buffer;
+    r->state = state;
+    r->pending = NULL;
+    r->conns = NULL;
+    r->nconns = 0;
+    r->now = now_ms();
+    atomic_init(&r->stop, false);
+    atomic_init(&r->drain, false);
+    if (timerwheel_init(&r->wheel, CONNMGR_TICK_MS, r->now) != TIMERWHEEL_SUCCESS) {return -1;}
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (r->epfd < 0 || r->wake_fd < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake_fd, &ev) != 0) {
+        if (r->epfd >= 0) {close(r->epfd);}
+        if (r->wake_fd >= 0) {close(r->wake_fd);}
+        timerwheel_free(&r->wheel);
+        return -1;
+    }
+    pthread_mutex_init(&r->pending_mtx, NULL);
+    if (pthread_create(&r->tid, NULL, reactor_main, r) != 0) {
+        pthread_mutex_destroy(&r->pending_mtx);
+        close(r->epfd);
+        close(r->wake_fd);
+        timerwheel_free(&r->wheel);
+        return -1;
+    }
+    return 0;
+}
+
+static void reactor_destroy(reactor_t *r) {
+    atomic_store(&r->stop, true);
+    reactor_wake(r);
+    pthread_join(r->tid, NULL);
+    pthread_mutex_destroy(&r->pending_mtx);
+    close(r->epfd);
+    close(r->wake_fd);
+    timerwheel_free(&r->wheel);
+}
+
+static int backend_start(backend_t *backend, const connmgr_args_t *args, conn_state_t *state) {
+    backend->nreactors = (args->reactors > 0) ? args->reactors : 1;
+    atomic_init(&backend->next, 0);
+    backend->reactors = malloc((size_t)backend->nreactors * sizeof(reactor_t));
+    if (backend->reactors == NULL) {return -1;}
+    for (int i = 0; i < backend->nreactors; i++) {
+        if (reactor_init(&backend->reactors[i], args, state) != 0) {
+            fprintf(stderr, "reactor start failed\n");
+            for (int j = 0; j < i; j++) {reactor_destroy(&backend->reactors[j]);}
+            free(backend->reactors);
+            return -1;
         }
-        state.accepted++;
-        state.active++;
-        pthread_mutex_unlock(&state.mtx);
+    }
+    return 0;
+}
 
+static int backend_add_client(backend_t *backend, tcpsock_t *client) {
+    int fd = -1; // already non-blocking (tcp_wait_for_connection_into)
+    if (tcp_get_sd(client, &fd) != TCP_NO_ERROR || fd < 0) {return -1;}
 
-        client_handler_args_t *clientInfo = malloc(sizeof(*clientInfo));
-        if (!clientInfo) {
-            fprintf(stderr, "malloc failed\n");
-            tcp_close(&client);
+    conn_t *c = malloc(sizeof(*c));
+    if (!c) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    c->client = *client;
+    c->fd = fd;
+    c->id = (conn_id_t){.have_id = 0, .sensorid = 0, .proto = CONN_PROTO_UNKNOWN};
+    c->rx.len = 0;
+    timerwheel_timer_init(&c->timer);
 
-            pthread_mutex_lock(&state.mtx);
-            state.active--;
-            pthread_cond_broadcast(&state.condition);
-            pthread_mutex_unlock(&state.mtx);
-            continue;
+    reactor_t *r = &backend->reactors[atomic_fetch_add_explicit(&backend->next, 1, memory_order_relaxed) %
+                                      (unsigned)backend->nreactors];
+    pthread_mutex_lock(&r->pending_mtx);
+    c->next = r->pending;
+    r->pending = c;
+    pthread_mutex_unlock(&r->pending_mtx);
+    reactor_wake(r);
+    return 0;
+}
+
+//continuous mode shutdown, after the last backend_add_client
+static void backend_drain(backend_t *backend) {
+    for (int i = 0; i < backend->nreactors; i++) {
+        atomic_store(&backend->reactors[i].drain, true);
+        reactor_wake(&backend->reactors[i]);
+    }
+}
+
+static void backend_stop(backend_t *backend) {
+    for (int i = 0; i < backend->nreactors; i++) {reactor_destroy(&backend->reactors[i]);}
+    free(backend->reactors);
+}
+#endif //CONNMGR_THREADED
+
+typedef struct {
+    pthread_t tid;
+    tcpsock_t *server;
+    int listen_fd;
+    connmgr_t *cm;
+} acceptor_t;
+
+struct connmgr {
+    connmgr_args_t args;
+    conn_state_t state;
+    backend_t backend;
+    acceptor_t *acceptors; // acceptor threads running (none when the backend accepts itself)
+    int nacceptors;
+    pthread_t main_tid;    // connmgr_main, woken with SIGTERM when accepting fails in continuous mode
+    int stop_pipe[2];      // readable once acceptors_stop was called
+    atomic_bool stop;
+};
+
+static void acceptors_stop(connmgr_t *cm) {
+    if (atomic_exchange(&cm->stop, true)) {return;}
+    char const byte = 0;
+    if (write(cm->stop_pipe[1], &byte, 1) < 0) {fprintf(stderr, "stop pipe write failed\n");}
+    pthread_mutex_lock(&cm->state.mtx);
+    pthread_cond_broadcast(&cm->state.condition); // acceptors waiting at the cap, connmgr_main
+    pthread_mutex_unlock(&cm->state.mtx);
+}
+
+//accepting is impossible: finite mode ends like after the last client, continuous mode as on a signal
+static void connmgr_fail(connmgr_t *cm) {
+    acceptors_stop(cm);
+    if (cm->args.continuous) {pthread_kill(cm->main_tid, SIGTERM);}
+}
+
+#ifndef CONNMGR_BACKEND_ACCEPTS
+//continuous mode, with state.mtx held: wait for a free place for the connection just accepted, the next connections
+//wait in the backlog meanwhile (the acceptor does not accept again); 0 if stopping instead
+static int acceptor_wait_slot(connmgr_t *cm) {
+    if (cm->state.active >= cm->args.max_conn && !atomic_load(&cm->stop)) {
+        log_event("Connection cap reached: %d clients connected", cm->state.active);
+        while (cm->state.active >= cm->args.max_conn && !atomic_load(&cm->stop)) {
+            pthread_cond_wait(&cm->state.condition, &cm->state.mtx);
         }
+    }
+    return !atomic_load(&cm->stop);
+}
 
-        clientInfo->client = client;
-        clientInfo->buffer = ConnInfo.buffer;
-        clientInfo->state = &state;
+static void *acceptor_main(void *arg) {
+    acceptor_t *a = (acceptor_t *)arg;
+    connmgr_t *cm = a->cm;
+    struct pollfd pfd[2] = {{.fd = a->listen_fd, .events = POLLIN}, {.fd = cm->stop_pipe[0], .events = POLLIN}};
+    int failed = 0;
 
-	pthread_t tid;
-	int rc = pthread_create(&tid, NULL, client_handler, clientInfo);
+    while (!atomic_load(&cm->stop)) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {continue;}
+            fprintf(stderr, "poll failed\n");
+            failed = 1;
+            break;
+        }
+        if (pfd[1].revents != 0) {break;}
+        if (!(pfd[0].revents & POLLIN)) {continue;}
 
-        if (rc != 0) {
-            fprintf(stderr, "pthread_create failed, closing client\n");
-            tcp_close(&client);
-            free(clientInfo);
+        tcpsock_t client; // copied into the backend's connection, no allocation on the accept path
+        if (tcp_wait_for_connection_into(a->server, &client) != TCP_NO_ERROR) {
+            //the listen socket is non-blocking: a connection reset before accept() only costs a retry
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {continue;}
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                fprintf(stderr, "tcp_wait_for_connection_into: out of resources, retrying\n");
+                struct timespec const pause = {.tv_sec = 0, .tv_nsec = CONNMGR_TICK_MS * 1000000L};
+                nanosleep(&pause, NULL);
+                continue;
+            }
+            fprintf(stderr, "tcp_wait_for_connection_into failed\n");
+            failed = 1;
+            break;
+        }
 
-            pthread_mutex_lock(&state.mtx);
-            state.active--;
-            pthread_cond_broadcast(&state.condition);
-            pthread_mutex_unlock(&state.mtx);
+        pthread_mutex_lock(&cm->state.mtx);
+        if (!cm->args.continuous && cm->state.accepted >= cm->args.max_conn) {
+            log_event("Connection refused: Max number of clients (%d) already accepted", cm->args.max_conn);
+            pthread_mutex_unlock(&cm->state.mtx);
+            tcp_close_embedded(&client);
             continue;
         }
-        pthread_detach(tid);
+        if (cm->args.continuous && !acceptor_wait_slot(cm)) {
+            pthread_mutex_unlock(&cm->state.mtx);
+            tcp_close_embedded(&client);
+            break;
+        }
+        cm->state.accepted++;
+        cm->state.active++;
+        int const last = (!cm->args.continuous && cm->state.accepted >= cm->args.max_conn);
+        pthread_mutex_unlock(&cm->state.mtx);
+
+        if (backend_add_client(&cm->backend, &client) != 0) {
+            tcp_close_embedded(&client);
+            conn_state_release(&cm->state);
+        }
+        if (last) {acceptors_stop(cm);}
+    }
+
+    if (failed) {connmgr_fail(cm);}
+    return NULL;
+}
+
+static int listeners_count(const connmgr_t *cm) {return (cm->args.acceptors > 0) ? cm->args.acceptors : 1;}
+
+//N acceptor threads, each one with its own listen socket (SO_REUSEPORT when N > 1)
+static int listeners_start(connmgr_t *cm, int backlog) {
+    int const n = listeners_count(cm);
+    cm->acceptors = calloc((size_t)n, sizeof(acceptor_t));
+    cm->nacceptors = 0;
+    for (int i = 0; cm->acceptors != NULL && i < n; i++) {
+        acceptor_t *a = &cm->acceptors[i];
+        a->cm = cm;
+        if (tcp_passive_open_opts(&a->server, cm->args.port, backlog, n > 1) != TCP_NO_ERROR) {
+            fprintf(stderr, "tcp_passive_open failed\n");
+            break;
+        }
+        int flags = -1;
+        if (tcp_get_sd(a->server, &a->listen_fd) != TCP_NO_ERROR || (flags = fcntl(a->listen_fd, F_GETFL, 0)) < 0 ||
+            fcntl(a->listen_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            fprintf(stderr, "listen socket setup failed\n");
+            tcp_close(&a->server);
+            break;
+        }
+        if (pthread_create(&a->tid, NULL, acceptor_main, a) != 0) {
+            fprintf(stderr, "pthread_create(acceptor) failed\n");
+            tcp_close(&a->server);
+            break;
+        }
+        cm->nacceptors++;
     }
-    tcp_close(&server);
+    return (cm->nacceptors == n) ? 0 : -1;
+}
+
+//after acceptors_stop
+static void listeners_stop(connmgr_t *cm) {
+    for (int i = 0; i < cm->nacceptors; i++) {
+        pthread_join(cm->acceptors[i].tid, NULL);
+        tcp_close(&cm->acceptors[i].server);
+    }
+    free(cm->acceptors);
+    cm->acceptors = NULL;
+    cm->nacceptors = 0;
+}
+#else
+static int listeners_count(const connmgr_t *cm) {return backend_listeners(&cm->backend);}
 
-    pthread_mutex_lock(&state.mtx);
-    while (state.active > 0) {
-        pthread_cond_wait(&state.condition, &state.mtx);
+static int listeners_start(connmgr_t *cm, int backlog) {return backend_listen(&cm->backend, cm, cm->args.port, backlog);}
+
+static void listeners_stop(connmgr_t *cm) {backend_stop_accepting(&cm->backend);}
+#endif //CONNMGR_BACKEND_ACCEPTS
+
+static void *connmgr_main(void *arg) {
+    connmgr_t *cm = (connmgr_t *)arg;
+    int const backlog = (cm->args.backlog > 0) ? cm->args.backlog : (cm->args.continuous ? CONNMGR_SERVICE_BACKLOG : MAX_PENDING);
+
+    cm->main_tid = pthread_self();
+    cm->acceptors = NULL;
+    cm->nacceptors = 0;
+    atomic_init(&cm->stop, false);
+    conn_state_init(&cm->state);
+    if (pipe(cm->stop_pipe) != 0) {
+        fprintf(stderr, "pipe failed\n");
+        sbuffer_close(cm->args.buffer);
+        conn_state_destroy(&cm->state);
+        free(cm);
+        return NULL;
     }
-    pthread_mutex_unlock(&state.mtx);
 
-    sbuffer_close(ConnInfo.buffer);
-    conn_state_destroy(&state);
+    if (backend_start(&cm->backend, &cm->args, &cm->state) != 0) {
+        fprintf(stderr, "connmgr backend start failed\n");
+        sbuffer_close(cm->args.buffer);
+        close(cm->stop_pipe[0]);
+        close(cm->stop_pipe[1]);
+        conn_state_destroy(&cm->state);
+        free(cm);
+        return NULL;
+    }
+
+    udp_listener_t *udp = NULL;
+    int const udp_ok = (cm->args.udp_port == 0 || udp_listener_start(&udp, cm->args.udp_port, cm->args.buffer) == UDP_LISTENER_SUCCESS);
+    if (!udp_ok || listeners_start(cm, backlog) != 0) {
+        acceptors_stop(cm);
+    } else if (cm->args.continuous) {
+        log_event("Connection manager serving continuously: %d acceptor(s), backlog %d, at most %d clients at once",
+                  listeners_count(cm), backlog, cm->args.max_conn);
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        int sig = 0;
+        while (sigwait(&set, &sig) != 0) {}
+        log_event("Connection manager stopping on signal %d", sig);
+        acceptors_stop(cm);
+    } else {
+        pthread_mutex_lock(&cm->state.mtx);
+        while (!atomic_load(&cm->stop)) { // max_conn clients accepted
+            pthread_cond_wait(&cm->state.condition, &cm->state.mtx);
+        }
+        pthread_mutex_unlock(&cm->state.mtx);
+    }
+    listeners_stop(cm);
+    if (cm->args.continuous) {backend_drain(&cm->backend);}
+
+    pthread_mutex_lock(&cm->state.mtx);
+    while (cm->state.active > 0) {
+        pthread_cond_wait(&cm->state.condition, &cm->state.mtx);
+    }
+    pthread_mutex_unlock(&cm->state.mtx);
+
+    backend_stop(&cm->backend);
+    if (udp != NULL) {udp_listener_stop(&udp);}
+    sbuffer_close(cm->args.buffer);
+    close(cm->stop_pipe[0]);
+    close(cm->stop_pipe[1]);
+    conn_state_destroy(&cm->state);
+    free(cm);
     return NULL;
 }
 
 int connmgr_start(pthread_t *tid, const connmgr_args_t *args) {
     if (!tid || !args || !args->buffer) {return -1;}
 
-    connmgr_args_t *heap_args = malloc(sizeof(*heap_args));
-    if (!heap_args) {return -1;}
+    connmgr_t *cm = malloc(sizeof(*cm));
+    if (!cm) {return -1;}
 
-    *heap_args = *args;
-    if (pthread_create(tid, NULL, connmgr_main, heap_args) != 0) {free(heap_args);return -1;}
+    cm->args = *args;
+    if (pthread_create(tid, NULL, connmgr_main, cm) != 0) {free(cm);return -1;}
     return 0;
-}
\ No newline at end of file
+}
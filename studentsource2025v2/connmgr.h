@@ -19,8 +19,26 @@ typedef struct {
     int port;
     int max_conn;
     sbuffer_t *buffer;
+    int reactors; // epoll backend: event loop threads sharing the clients (0 = 1), ignored with CONNMGR_THREADED
+    int continuous; // 0: stop after max_conn accepted clients disconnected; 1: serve until SIGINT/SIGTERM, at most max_conn at once
+    int acceptors;  // threads accepting on their own SO_REUSEPORT listen socket (0 = 1)
+    int backlog;    // listen backlog per socket (0 = MAX_PENDING, or CONNMGR_SERVICE_BACKLOG when continuous)
+    int udp_port;   // > 0: also take sensor datagrams on this UDP port, they do not count as clients (0 = TCP only)
 } connmgr_args_t;
 
+// default listen backlog of the continuous mode: room for a reconnect storm of every sensor at once
+#ifndef CONNMGR_SERVICE_BACKLOG
+#define CONNMGR_SERVICE_BACKLOG 4096
+#endif
+
+/**
+ * Starts the connection manager thread, it closes 'args->buffer' when it is done
+ * Continuous mode: the thread waits for SIGINT/SIGTERM with sigwait, the caller has to block both signals in every thread
+ * (pthread_sigmask before creating any thread); on a signal it stops accepting, disconnects the clients and returns
+ * \param tid filled out with the connection manager thread, to join
+ * \param args copied, see connmgr_args_t
+ * \return 0 on success, -1 if the thread could not be started
+ */
 int connmgr_start(pthread_t *tid, const connmgr_args_t *args);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+/**
+ * \author {Diego Vallés}
+ */
+//Equivalence check and benchmark of csv_format_row (csv_format.c) against snprintf("%u,%f,%ld\n")
+//Usage: ./csv_bench [fuzz rows] [bench rows]   (default: 5000000, 2000000)
+//Fuzz: random bit patterns (every exponent, subnormals, inf, nan), sensor-like values, exact decimal ties (k / 2^n),
+//values next to a carry into the integer part and next to 2^53; every row must be byte-identical to snprintf
+//Bench: sensor-like rows into a 1 MiB buffer as db_writer does, rows/s and MB/s of both on one core
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "csv_format.h"
+
+#define BENCH_BUFFER (1 << 20)
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//xorshift64*: https://en.wikipedia.org/wiki/Xorshift
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+static uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static double from_bits(uint64_t bits) {
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static double fuzz_value(void) {
+    uint64_t const r = rng();
+    double const sign = (r & 1) ? -1.0 : 1.0;
+    switch ((r >> 1) % 8) {
+        case 0: return from_bits(rng()); // anything, nan and inf included
+        case 1: return sign * (double)(rng() % 4000000) / 100000.0; // -40 .. 40, a sensor
+        case 2: return sign * (double)(rng() % 1000000000) / (double)(1ull << (rng() % 40)); // k / 2^n: exact ties
+        case 3: return sign * ((double)(rng() % 100000) + 0.9999995 + (double)(int)(rng() % 64 - 32) * 1e-13); // carries
+        case 4: return sign * from_bits(0x4340000000000000ull - rng() % 4096); // just below 2^53
+        case 5: return sign * from_bits(rng() % 0x0010000000000000ull); // subnormal
+        case 6: return sign * (double)(rng() % 1000000); // integers, and 0 / -0
+        default: return sign * from_bits(0x3c00000000000000ull + rng() % 0x0800000000000000ull); // 2^-63 .. 2^64
+    }
+}
+
+static int fuzz(size_t rows) {
+    char fast[CSV_ROW_MAX], ref[CSV_ROW_MAX + 1];
+    for (size_t i = 0; i < rows; i++) {
+        sensor_id_t const id = (sensor_id_t)rng();
+        sensor_value_t const value = fuzz_value();
+        sensor_ts_t const ts = (i % 16 == 0) ? (sensor_ts_t)rng() : (sensor_ts_t)(1700000000 + rng() % 100000000);
+        size_t const n = csv_format_row(fast, id, value, ts);
+        int const m = snprintf(ref, sizeof(ref), "%u,%f,%ld\n", (unsigned)id, value, (long)ts);
+        if (m < 0 || n != (size_t)m || memcmp(fast, ref, n) != 0) {
+            printf("mismatch for %a: \"%.*s\" instead of \"%s\"\n", value, (int)n, fast, ref);
+            return 1;
+        }
+    }
+    printf("fuzz: %zu rows byte-identical to snprintf\n", rows);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t const fuzz_rows = (argc > 1) ? strtoul(argv[1], NULL, 10) : 5000000;
+    size_t const bench_rows = (argc > 2) ? strtoul(argv[2], NULL, 10) : 2000000;
+    if (fuzz(fuzz_rows) != 0) {return 1;}
+    if (bench_rows == 0) {return 0;}
+
+    sensor_data_t *data = malloc(bench_rows * sizeof(sensor_data_t));
+    char *buf = malloc(BENCH_BUFFER);
+    if (data == NULL || buf == NULL) {fprintf(stderr, "out of memory\n"); return 1;}
+    for (size_t i = 0; i < bench_rows; i++) {
+        data[i] = (sensor_data_t){.id = (sensor_id_t)(rng() % 1000 + 1), .value = 10.0 + (double)(rng() % 2000000) / 1e5,
+                                  .ts = (sensor_ts_t)(1760000000 + i / 1000)};
+    }
+
+    printf("%-9s %12s %10s %9s\n", "formatter", "Mrows/s", "MB/s", "speedup");
+    double base = 0;
+    for (int fast = 0; fast < 2; fast++) {
+        size_t used = 0, bytes = 0;
+        double const start = now_s();
+        for (size_t i = 0; i < bench_rows; i++) {
+            if (BENCH_BUFFER - used < CSV_ROW_MAX) {bytes += used; used = 0;} // a flush
+            if (fast) {
+                used += csv_format_row(buf + used, data[i].id, data[i].value, data[i].ts);
+            } else {
+                used += (size_t)snprintf(buf + used, BENCH_BUFFER - used, "%u,%f,%ld\n", (unsigned)data[i].id,
+                                         data[i].value, (long)data[i].ts);
+            }
+        }
+        bytes += used;
+        double const elapsed = now_s() - start;
+        double const rate = (double)bench_rows / elapsed;
+        if (!fast) {base = rate;}
+        printf("%-9s %12.2f %10.1f %8.2fx\n", fast ? "csv" : "snprintf", rate / 1e6, (double)bytes / elapsed / 1e6,
+               rate / base);
+    }
+    free(data);
+    free(buf);
+    return 0;
+}
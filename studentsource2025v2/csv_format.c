@@ -0,0 +1,79 @@
+/**
+ * \author {Diego Vallés}
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "csv_format.h"
+//A data.csv row without printf: integers two digits at a time from a table, the value in exact integer arithmetic
+//A finite double is m * 2^-s (m < 2^53): its integer part is m >> s, its 6 decimals are (frac * 10^6) / 2^s, rounded half to
+//even on the exact remainder (what glibc does for "%f"), in 128-bit so nothing is rounded on the way
+//https://www.ryanjuckett.com/printing-floating-point-numbers/
+//Values from 2^53 up, inf and nan go through snprintf: never from a sensor, and always the same bytes
+#define CSV_FRAC_SCALE 1000000u
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static size_t format_u64(char *out, uint64_t v) {
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {p -= 2; memcpy(p, digit_pairs + v * 2, 2);}
+    else {*--p = (char)('0' + v);}
+    size_t const n = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(out, p, n);
+    return n;
+}
+
+static size_t format_i64(char *out, int64_t v) {
+    if (v >= 0) {return format_u64(out, (uint64_t)v);}
+    *out = '-';
+    return 1 + format_u64(out + 1, (uint64_t)0 - (uint64_t)v);
+}
+
+size_t csv_format_double(char *out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int const biased = (int)((bits >> 52) & 0x7ff);
+    if (biased > 1075) {return (size_t)snprintf(out, CSV_ROW_MAX, "%f", value);} // >= 2^53, inf, nan
+
+    uint64_t const m = (biased == 0) ? (bits & 0xfffffffffffffull) : (bits & 0xfffffffffffffull) | (1ull << 52);
+    int const s = (biased == 0) ? 1074 : 1075 - biased; // value = m / 2^s, s >= 0
+    uint64_t int_part = (s >= 64) ? 0 : m >> s;
+    uint64_t const frac = (s >= 64) ? m : m & ((1ull << s) - 1); // s == 0: no fraction
+    uint32_t q = 0;
+    if (frac != 0 && s < 128) { // s >= 128: frac * 10^6 < 2^73 is below half of 2^s, the decimals are 0
+        unsigned __int128 const r = (unsigned __int128)frac * CSV_FRAC_SCALE;
+        q = (uint32_t)(r >> s);
+        unsigned __int128 const rem = r - ((unsigned __int128)q << s);
+        unsigned __int128 const half = (unsigned __int128)1 << (s - 1);
+        if (rem > half || (rem == half && (q & 1u))) {q++;}
+        if (q == CSV_FRAC_SCALE) {q = 0; int_part++;}
+    }
+
+    size_t n = 0;
+    if (bits >> 63) {out[n++] = '-';} // also "-0.000000", as printf
+    n += format_u64(out + n, int_part);
+    out[n++] = '.';
+    memcpy(out + n, digit_pairs + (q / 10000) * 2, 2);
+    memcpy(out + n + 2, digit_pairs + (q / 100 % 100) * 2, 2);
+    memcpy(out + n + 4, digit_pairs + (q % 100) * 2, 2);
+    return n + 6;
+}
+
+size_t csv_format_row(char *out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    size_t n = format_u64(out, id);
+    out[n++] = ',';
+    n += csv_format_double(out + n, value);
+    out[n++] = ',';
+    n += format_i64(out + n, (int64_t)ts);
+    out[n++] = '\n';
+    return n;
+}
@@ -0,0 +1,27 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _CSV_FORMAT_H_
+#define _CSV_FORMAT_H_
+
+#include <stddef.h>
+#include "config.h"
+
+// longest row: "65535," + "%f" of -DBL_MAX (317 chars) + ',' + LONG_MIN + '\n'
+#define CSV_ROW_MAX 352
+
+/**
+ * Writes the row "id,value,ts\n" exactly as fprintf(f, "%u,%f,%ld\n", id, value, ts) would, without the locale
+ * \param out room for at least CSV_ROW_MAX bytes, the result is not '\0'-terminated
+ * \return the number of bytes written
+ */
+size_t csv_format_row(char *out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Writes 'value' exactly as printf("%f") would (6 decimals, rounded half to even), without the locale
+ * \param out room for at least CSV_ROW_MAX bytes, the result is not '\0'-terminated
+ * \return the number of bytes written
+ */
+size_t csv_format_double(char *out, double value);
+
+#endif //_CSV_FORMAT_H_
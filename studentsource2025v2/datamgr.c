@@ -3,119 +3,494 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
-#include "lib/dplist.h"
+#include <string.h>
+#include <pthread.h>
 #include "config.h"
 #include "sbuffer.h"
 #include "datamgr.h"
 #include "sensor_db.h"
+#include "runavg.h"
+#include "thresholds.h"
 
-static dplist_t *sensor_list = NULL;
+//One table per worker: worker k only knows the sensors with id % nshards == k, nothing is shared between workers
+//An open addressing hash table (linear probing, at most half full) maps an id to the index of the sensor:
+//a lookup is one multiply and usually one 8-byte probe, instead of walking a dplist for every reading
+//https://en.wikipedia.org/wiki/Open_addressing; Fibonacci hashing: Knuth, TAOCP vol. 3, 6.4
+//The state itself is a structure of arrays (sensor_store_t): one array per field, each one 64-byte aligned
+//(a cache line), so a pass over one field of every sensor (staleness, thresholds) reads only that field
+//https://en.wikipedia.org/wiki/AoS_and_SoA
+//Running averages: O(1) per reading (runavg.h), one window of RUN_AVG_LENGTH samples for the thresholds and one of
+//DATAMGR_LONG_AVG_LENGTH samples, each window array is one field of the store
+//Thresholds: once per batch, not once per reading. The batch gathers the averages of the sensors it touched into a
+//dense array, one SIMD kernel (thresholds.c) compares them all with SET_MIN_TEMP/SET_MAX_TEMP and returns only the
+//sensors whose comment differs from last_com; only those are logged
+//Rooms: the same batch also moves the averages of those sensors into their room (room_table_t below)
+#define DATAMGR_ALIGN 64
 
-static void element_free(void **element) {
-    free(*element);
-    *element = NULL;
+RUNAVG_DEFINE(runavg_short, RUN_AVG_LENGTH, DATAMGR_AVG_RESYNC)
+RUNAVG_DEFINE(runavg_long, DATAMGR_LONG_AVG_LENGTH, DATAMGR_AVG_RESYNC)
+
+typedef struct {
+    sensor_id_t id;
+    uint16_t used;
+    uint32_t index; // into the store
+} sensor_slot_t;
+
+typedef struct {
+    size_t count;
+    sensor_id_t *id;
+    uint16_t *room;
+    uint32_t *member;  // member slot in room_table
+    runavg_short_t *avg_short; // the last RUN_AVG_LENGTH readings and their sum
+    runavg_long_t *avg_long;   // the last DATAMGR_LONG_AVG_LENGTH readings and their sum
+    sensor_value_t *running_avg; // of avg_short, 0 until it is full
+    time_t *last_ts;   // timestamp of the last reading (sensor clock)
+    time_t *last_seen; // when the last reading was processed (gateway clock), 0 = never
+    int8_t *last_com;  // To avoid repeating logs: -1 too cold, +1 too hot
+    uint8_t *stale;    // logged as stale, cleared by the next reading
+    uint8_t *pending;  // already in the threshold list of the current batch
+    void *block;       // every array above lives in this one allocation
+} sensor_store_t;
+
+//the sensors of one batch whose window is full, gathered for the threshold kernel
+typedef struct {
+    size_t count;
+    uint32_t index[SBUFFER_DRAIN_BATCH]; // into the store
+    sensor_value_t avg[SBUFFER_DRAIN_BATCH];
+    int8_t last[SBUFFER_DRAIN_BATCH];
+    uint32_t changed[SBUFFER_DRAIN_BATCH]; // into index[]
+} threshold_batch_t;
+
+typedef struct {
+    sensor_store_t store;
+    sensor_slot_t *slots;
+    unsigned bits; // 2^bits slots
+    time_t next_sweep;
+    threshold_batch_t batch;
+} sensor_table_t;
+
+static sensor_table_t sensor_tables[SBUFFER_MAX_SHARDS];
+
+static size_t sensor_slot_of(sensor_id_t id, unsigned bits) {return (size_t)(((uint32_t)id * 2654435769u) >> (32 - bits));}
+
+//index of the sensor in the store, -1 if it is not in the map
+static long find_sensor(const sensor_table_t *table, sensor_id_t id) {
+    if (table->slots == NULL) {return -1;}
+    size_t const mask = ((size_t)1 << table->bits) - 1;
+    for (size_t k = sensor_slot_of(id, table->bits); table->slots[k].used; k = (k + 1) & mask) {
+        if (table->slots[k].id == id) {return (long)table->slots[k].index;}
+    }
+    return -1;
 }
 
-static datamgr_sensor_t *find_sensor(sensor_id_t id) {
-    if (sensor_list==NULL){ return NULL;}
-    int lsize = dpl_size(sensor_list);
-    for (int i = 0; i < lsize; i++) {
-        datamgr_sensor_t *sensor = dpl_get_element_at_index(sensor_list, i);
-        if (sensor && sensor->id == id) {return sensor;}
+static size_t align_up(size_t n) {return (n + DATAMGR_ALIGN - 1) & ~(size_t)(DATAMGR_ALIGN - 1);}
+
+//carves the arrays of 'count' sensors out of one aligned block, everything zeroed: empty history, no reading yet
+static int sensor_store_init(sensor_store_t *store, size_t count) {
+    size_t const n = (count > 0) ? count : 1;
+    size_t const sizes[] = {n * sizeof(sensor_id_t), n * sizeof(uint16_t), n * sizeof(uint32_t), n * sizeof(runavg_short_t),
+                            n * sizeof(runavg_long_t), n * sizeof(sensor_value_t),
+                            n * sizeof(time_t), n * sizeof(time_t), n * sizeof(int8_t), n * sizeof(uint8_t),
+                            n * sizeof(uint8_t)};
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {total += align_up(sizes[i]);}
+    unsigned char *p = aligned_alloc(DATAMGR_ALIGN, total);
+    if (p == NULL) {return -1;}
+    memset(p, 0, total);
+
+    store->block = p;
+    store->count = count;
+    store->id = (sensor_id_t *)p;                                p += align_up(sizes[0]);
+    store->room = (uint16_t *)p;                                 p += align_up(sizes[1]);
+    store->member = (uint32_t *)p;                               p += align_up(sizes[2]);
+    store->avg_short = (runavg_short_t *)p;                      p += align_up(sizes[3]);
+    store->avg_long = (runavg_long_t *)p;                        p += align_up(sizes[4]);
+    store->running_avg = (sensor_value_t *)p;                    p += align_up(sizes[5]);
+    store->last_ts = (time_t *)p;                                p += align_up(sizes[6]);
+    store->last_seen = (time_t *)p;                              p += align_up(sizes[7]);
+    store->last_com = (int8_t *)p;                               p += align_up(sizes[8]);
+    store->stale = (uint8_t *)p;                                 p += align_up(sizes[9]);
+    store->pending = (uint8_t *)p;
+    return 0;
+}
+
+static void sensor_table_free(sensor_table_t *table) {
+    free(table->store.block);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+typedef struct {
+    uint16_t room;
+    sensor_id_t id;
+} map_entry_t;
+
+//Rooms: one table for all the workers, a room can have sensors in several shards. The first worker that loads the map
+//builds it from every line of the map (room_table_build), the others only look their sensors up in it
+//Every sensor of the map has a member slot and the members of a room are contiguous (first[r] .. first[r] + members[r]),
+//so a room is updated and rescanned from its own members, never from a scan of all the sensors
+//A member counts in its room while it has a full running average and is not stale; the room keeps the Kahan sum of
+//those averages (runavg.h) and their min/max, a min/max that moves inwards is found again by a rescan of the room
+//One mutex per room: two workers only wait for each other on a room they share
+typedef struct {
+    int built;
+    size_t count;
+    uint16_t *id;
+    uint32_t *first;           // first member slot of the room
+    uint32_t *members;         // sensors of the map in the room
+    uint32_t *reporting;       // members counted in the room
+    double *sum;               // of member_avg of the reporting members
+    double *comp;              // Kahan compensation of sum
+    sensor_value_t *min;       // of member_avg of the reporting members, only valid when reporting > 0
+    sensor_value_t *max;
+    int8_t *last_com;          // To avoid repeating logs: -1 too cold, +1 too hot
+    pthread_mutex_t *lock;
+    uint32_t *member_room;     // per member slot: index of its room
+    sensor_value_t *member_avg; // per member slot: the running average it counts with
+    uint8_t *member_on;        // per member slot: counted in its room
+    void *block;               // every array above lives in this one allocation
+    uint32_t room_of[UINT16_MAX + 1];   // room id -> index + 1, 0 = not in the map
+    uint32_t member_of[UINT16_MAX + 1]; // sensor id -> member slot + 1, 0 = not in the map
+} room_table_t;
+
+static room_table_t room_table;
+static pthread_mutex_t room_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//rooms in the order of the map, a duplicate sensor id keeps its first line (as in sensor_table_build)
+static int room_table_build(room_table_t *rt, const map_entry_t *entries, size_t count) {
+    uint8_t *seen = calloc(UINT16_MAX + 1, 1);
+    uint32_t *fill = calloc(count + 1, sizeof(uint32_t)); // members per room, then next free slot per room
+    if (seen == NULL || fill == NULL) {free(seen); free(fill); return -1;}
+    size_t rooms = 0, members = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (seen[entries[i].id]) {continue;}
+        seen[entries[i].id] = 1;
+        if (rt->room_of[entries[i].room] == 0) {rt->room_of[entries[i].room] = (uint32_t)++rooms;}
+        fill[rt->room_of[entries[i].room] - 1]++;
+        members++;
     }
-    return NULL;
+
+    size_t const r = (rooms > 0) ? rooms : 1, m = (members > 0) ? members : 1;
+    size_t const sizes[] = {r * sizeof(uint16_t), r * sizeof(uint32_t), r * sizeof(uint32_t), r * sizeof(uint32_t),
+                            r * sizeof(double), r * sizeof(double), r * sizeof(sensor_value_t),
+                            r * sizeof(sensor_value_t), r * sizeof(int8_t), r * sizeof(pthread_mutex_t),
+                            m * sizeof(uint32_t), m * sizeof(sensor_value_t), m * sizeof(uint8_t)};
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {total += align_up(sizes[i]);}
+    unsigned char *p = aligned_alloc(DATAMGR_ALIGN, total);
+    if (p == NULL) {free(seen); free(fill); return -1;}
+    memset(p, 0, total);
+    rt->block = p;
+    rt->count = rooms;
+    rt->id = (uint16_t *)p;                                      p += align_up(sizes[0]);
+    rt->first = (uint32_t *)p;                                   p += align_up(sizes[1]);
+    rt->members = (uint32_t *)p;                                 p += align_up(sizes[2]);
+    rt->reporting = (uint32_t *)p;                               p += align_up(sizes[3]);
+    rt->sum = (double *)p;                                       p += align_up(sizes[4]);
+    rt->comp = (double *)p;                                      p += align_up(sizes[5]);
+    rt->min = (sensor_value_t *)p;                               p += align_up(sizes[6]);
+    rt->max = (sensor_value_t *)p;                               p += align_up(sizes[7]);
+    rt->last_com = (int8_t *)p;                                  p += align_up(sizes[8]);
+    rt->lock = (pthread_mutex_t *)p;                             p += align_up(sizes[9]);
+    rt->member_room = (uint32_t *)p;                             p += align_up(sizes[10]);
+    rt->member_avg = (sensor_value_t *)p;                        p += align_up(sizes[11]);
+    rt->member_on = (uint8_t *)p;
+
+    uint32_t next = 0;
+    for (size_t k = 0; k < rooms; k++) {
+        rt->first[k] = next;
+        rt->members[k] = fill[k];
+        next += fill[k];
+        fill[k] = rt->first[k];
+        pthread_mutex_init(&rt->lock[k], NULL);
+    }
+    memset(seen, 0, UINT16_MAX + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (seen[entries[i].id]) {continue;}
+        seen[entries[i].id] = 1;
+        uint32_t const k = rt->room_of[entries[i].room] - 1;
+        rt->id[k] = entries[i].room;
+        rt->member_room[fill[k]] = k;
+        rt->member_of[entries[i].id] = ++fill[k]; // slot + 1
+    }
+    free(seen);
+    free(fill);
+    rt->built = 1;
+    return 0;
+}
+
+static void room_table_free(room_table_t *rt) {
+    for (size_t k = 0; rt->built && k < rt->count; k++) {pthread_mutex_destroy(&rt->lock[k]);}
+    free(rt->block);
+    memset(rt, 0, sizeof(*rt));
+}
+
+//sum, min and max again from the reporting members of room r (lock held)
+static void room_rescan(room_table_t *rt, uint32_t r) {
+    double sum = 0.0, comp = 0.0;
+    int any = 0;
+    for (uint32_t m = rt->first[r]; m < rt->first[r] + rt->members[r]; m++) {
+        if (!rt->member_on[m]) {continue;}
+        sensor_value_t const v = rt->member_avg[m];
+        runavg_kahan_add(&sum, &comp, v);
+        if (!any || v < rt->min[r]) {rt->min[r] = v;}
+        if (!any || v > rt->max[r]) {rt->max[r] = v;}
+        any = 1;
+    }
+    rt->sum[r] = sum;
+    rt->comp[r] = comp;
+}
+
+//the room comment from the average of its reporting members, logged when it differs from the last one (lock held)
+static void room_check(room_table_t *rt, uint32_t r) {
+    if (rt->reporting[r] == 0) {return;} // no average, nothing new to say
+    sensor_value_t const avg = (sensor_value_t)(rt->sum[r] / rt->reporting[r]);
+    int8_t comment = 0;
+    if (avg < SET_MIN_TEMP) comment = -1;
+    else if (avg > SET_MAX_TEMP) comment = +1;
+    if (comment == rt->last_com[r]) {return;}
+    rt->last_com[r] = comment;
+    if (comment == -1) {
+        log_event("Room %u reports it’s too cold (avg temp = %g over %u sensors, min %g, max %g)", (unsigned)rt->id[r],
+                  avg, (unsigned)rt->reporting[r], rt->min[r], rt->max[r]);
+    } else if (comment == +1) {
+        log_event("Room %u reports it’s too hot (avg temp = %g over %u sensors, min %g, max %g)", (unsigned)rt->id[r],
+                  avg, (unsigned)rt->reporting[r], rt->min[r], rt->max[r]);
+    }
+}
+
+//member slot m now counts with running average v
+static void room_update(room_table_t *rt, uint32_t m, sensor_value_t v) {
+    uint32_t const r = rt->member_room[m];
+    pthread_mutex_lock(&rt->lock[r]);
+    sensor_value_t const old = rt->member_avg[m];
+    rt->member_avg[m] = v;
+    if (!rt->member_on[m]) {
+        rt->member_on[m] = 1;
+        if (rt->reporting[r]++ == 0) {rt->min[r] = rt->max[r] = v;}
+        runavg_kahan_add(&rt->sum[r], &rt->comp[r], v);
+    } else {
+        runavg_kahan_add(&rt->sum[r], &rt->comp[r], (double)v - (double)old);
+    }
+    if ((old == rt->min[r] && v > old) || (old == rt->max[r] && v < old)) {
+        room_rescan(rt, r); // the old extreme may have been this member
+    } else {
+        if (v < rt->min[r]) {rt->min[r] = v;}
+        if (v > rt->max[r]) {rt->max[r] = v;}
+    }
+    room_check(rt, r);
+    pthread_mutex_unlock(&rt->lock[r]);
 }
 
-static int load_map(const char *map_filename) {
+//member slot m stops counting in its room (stale sensor)
+static void room_leave(room_table_t *rt, uint32_t m) {
+    uint32_t const r = rt->member_room[m];
+    pthread_mutex_lock(&rt->lock[r]);
+    if (rt->member_on[m]) {
+        rt->member_on[m] = 0;
+        rt->reporting[r]--;
+        room_rescan(rt, r);
+        room_check(rt, r);
+    }
+    pthread_mutex_unlock(&rt->lock[r]);
+}
+
+//index and store for the sensors read from the map; a duplicate id keeps its first line
+static int sensor_table_build(sensor_table_t *table, const map_entry_t *entries, size_t count) {
+    unsigned bits = 4;
+    while (((size_t)1 << bits) < 2 * count) {bits++;}
+    table->slots = calloc((size_t)1 << bits, sizeof(sensor_slot_t));
+    if (table->slots == NULL || sensor_store_init(&table->store, count) != 0) {return -1;}
+    table->bits = bits;
+    size_t const mask = ((size_t)1 << bits) - 1;
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        sensor_id_t const id = entries[i].id;
+        size_t k = sensor_slot_of(id, bits);
+        while (table->slots[k].used && table->slots[k].id != id) {k = (k + 1) & mask;}
+        if (table->slots[k].used) {continue;}
+        table->store.id[kept] = id;
+        table->store.room[kept] = entries[i].room;
+        table->store.member[kept] = room_table.member_of[id] - 1;
+        table->slots[k] = (sensor_slot_t){.id = id, .used = 1, .index = (uint32_t)kept};
+        kept++;
+    }
+    table->store.count = kept;
+    return 0;
+}
+
+static int load_map(const char *map_filename, int shard, int nshards) {
     FILE *fp = fopen(map_filename, "r");
     if (fp == NULL) {fprintf(stderr, "Error: could not open map_file\n"); return -1;}
-    if (sensor_list == NULL) {
-        sensor_list = dpl_create(NULL, element_free, NULL);
-        if (sensor_list == NULL){fprintf(stderr, "Error: sensor list null\n");fclose(fp);return -1;}
-    }
+    sensor_table_t *table = &sensor_tables[shard];
+    sensor_table_free(table);
 
+    //the lines first: the store is allocated once, with its final size
+    map_entry_t *entries = NULL;
+    size_t count = 0, cap = 0;
     uint16_t room;
     uint16_t sensor_id;
     while (fscanf(fp, "%hu %hu", &room, &sensor_id) == 2) {
-        datamgr_sensor_t *sensor = malloc(sizeof(datamgr_sensor_t));
-        if (sensor==NULL) {
-            fprintf(stderr, "Error: sensor list null\n");
-            fclose(fp);
-            dpl_free(&sensor_list, true);
-            sensor_list = NULL;
-            return -1;
-        }
-        sensor->id = (sensor_id_t)sensor_id;
-        sensor->room = room;
-        sensor->history_count = 0;
-        sensor->history_index = 0;
-        sensor->running_avg = 0.0;
-        sensor->last_ts = 0;
-        sensor->last_com = 0;
-
-        for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-            sensor->history[i] = 0.0;
+        if (count == cap) {
+            cap = (cap == 0) ? 64 : cap * 2;
+            map_entry_t *grown = realloc(entries, cap * sizeof(map_entry_t));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: sensor table allocation failed\n");
+                fclose(fp);
+                free(entries);
+                return -1;
+            }
+            entries = grown;
         }
-        dpl_insert_at_index(sensor_list, sensor, dpl_size(sensor_list), false);
+        entries[count++] = (map_entry_t){.room = room, .id = (sensor_id_t)sensor_id};
     }
     fclose(fp);
+    //every line for the rooms, then only the sensors of this worker
+    pthread_mutex_lock(&room_table_lock);
+    int rc = room_table.built ? 0 : room_table_build(&room_table, entries, count);
+    if (rc != 0) {room_table_free(&room_table);}
+    pthread_mutex_unlock(&room_table_lock);
+    size_t own = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].id % nshards == shard) {entries[own++] = entries[i];} // others: owned by another worker
+    }
+    if (rc == 0) {rc = sensor_table_build(table, entries, own);}
+    free(entries);
+    if (rc != 0) {
+        fprintf(stderr, "Error: sensor table allocation failed\n");
+        sensor_table_free(table);
+        return -1;
+    }
     return 0;
 }
 
+static void datamgr_process(sensor_table_t *table, const sensor_data_t *data, time_t now) {
+    long const s = find_sensor(table, data->id);
+    if (s < 0) {
+        log_event("Received sensor data with invalid sensor node ID %u", (unsigned)data->id);
+        return;
+    }
+    sensor_store_t *st = &table->store;
+    st->last_ts[s] = data->ts;
+    st->last_seen[s] = now;
+    st->stale[s] = 0;
+    runavg_long_push(&st->avg_long[s], data->value);
+    runavg_short_push(&st->avg_short[s], data->value);
+    if (runavg_short_full(&st->avg_short[s])) {
+        st->running_avg[s] = runavg_short_avg(&st->avg_short[s]);
+        if (!st->pending[s]) { // once per batch, with the average it has at the end of the batch
+            st->pending[s] = 1;
+            table->batch.index[table->batch.count++] = (uint32_t)s;
+        }
+    } else {
+        st->running_avg[s] = 0;
+    }
+}
+
+//the comments of the sensors touched by this batch, in the order they were first touched, then their rooms
+static void datamgr_thresholds(sensor_table_t *table, threshold_kernel_t kernel) {
+    threshold_batch_t *b = &table->batch;
+    sensor_store_t *st = &table->store;
+    for (size_t j = 0; j < b->count; j++) {
+        uint32_t const s = b->index[j];
+        b->avg[j] = st->running_avg[s];
+        b->last[j] = st->last_com[s];
+        st->pending[s] = 0;
+    }
+    size_t const changed = kernel(b->avg, b->last, b->count, SET_MIN_TEMP, SET_MAX_TEMP, b->changed);
+    for (size_t k = 0; k < changed; k++) {
+        uint32_t const j = b->changed[k];
+        uint32_t const s = b->index[j];
+        st->last_com[s] = b->last[j];
+        if (b->last[j] == -1) {
+            log_event("Sensor node %u reports it’s too cold (avg temp = %g)", (unsigned)st->id[s], b->avg[j]);
+        } else if (b->last[j] == +1) {
+            log_event("Sensor node %u reports it’s too hot (avg temp = %g)", (unsigned)st->id[s], b->avg[j]);
+        }
+    }
+    for (size_t j = 0; j < b->count; j++) {room_update(&room_table, st->member[b->index[j]], b->avg[j]);}
+    b->count = 0;
+}
+
+//Staleness: one pass over last_seen[] of every sensor, at most once per DATAMGR_SWEEP_INTERVAL, between two batches
+//A worker waits for records only until its next sweep is due, so the sensors of a shard that went silent are swept too
+//A sensor that reported once and then stayed silent for DATAMGR_STALE_AFTER seconds is logged once
+static void datamgr_sweep(sensor_table_t *table, time_t now) {
+    if (now < table->next_sweep) {return;}
+    table->next_sweep = now + DATAMGR_SWEEP_INTERVAL;
+    sensor_store_t *st = &table->store;
+    time_t const limit = now - DATAMGR_STALE_AFTER;
+    for (size_t s = 0; s < st->count; s++) {
+        if (st->last_seen[s] == 0 || st->last_seen[s] > limit || st->stale[s]) {continue;}
+        st->stale[s] = 1;
+        room_leave(&room_table, st->member[s]);
+        if (runavg_long_full(&st->avg_long[s])) {
+            log_event("Sensor node %u is stale: no data for %ld s (last %d-reading avg temp = %g)", (unsigned)st->id[s],
+                      (long)(now - st->last_seen[s]), DATAMGR_LONG_AVG_LENGTH, runavg_long_avg(&st->avg_long[s]));
+        } else {
+            log_event("Sensor node %u is stale: no data for %ld s", (unsigned)st->id[s], (long)(now - st->last_seen[s]));
+        }
+    }
+}
+
+//milliseconds until the next sweep is due
+static int datamgr_sweep_timeout_ms(const sensor_table_t *table, time_t now) {
+    return (table->next_sweep <= now) ? 0 : (int)(table->next_sweep - now) * 1000;
+}
+
 void *datamgr_thread(void *arg) {
     datamgr_args_t *pargs = (datamgr_args_t *)arg;
     datamgr_args_t args = *pargs;
     free(pargs);
 
-    if (load_map(args.map_filename) != 0) {
+    sensor_data_t batch[SBUFFER_DRAIN_BATCH];
+    size_t got = 0;
+    if (args.shard < 0 || args.shard >= SBUFFER_MAX_SHARDS || args.nshards < 1) {return NULL;}
+    if (load_map(args.map_filename, args.shard, args.nshards) != 0) {
         log_event("Data manager aborted due to map load failure");
+        //still a registered reader: keep draining so the slots get freed for the SM
+        while (sbuffer_remove_batch(args.buffer, batch, SBUFFER_DRAIN_BATCH, args.reader, &got) == SBUFFER_SUCCESS) {}
         return NULL;
     }
 
-    sensor_data_t data;
-    while (1){
-        int rc = sbuffer_remove(args.buffer, &data, SBUFFER_READER_DM);
-        if (rc == SBUFFER_SUCCESS) {
-            datamgr_sensor_t *sensor = find_sensor(data.id);
-            if (sensor == NULL) {
-                log_event("Received sensor data with invalid sensor node ID %u", (unsigned)data.id);
-                continue;
-            }
-            sensor->last_ts = data.ts;
-            sensor->history[sensor->history_index] = data.value;
-            sensor->history_index = (sensor->history_index + 1) % RUN_AVG_LENGTH;
-            if (sensor->history_count < RUN_AVG_LENGTH) sensor->history_count++;
-            if (sensor->history_count == RUN_AVG_LENGTH) {
-                double sum = 0.0;
-                for (int i = 0; i < RUN_AVG_LENGTH; i++) sum += sensor->history[i];
-                sensor->running_avg = (sensor_value_t)(sum / RUN_AVG_LENGTH);
-                int comment = 0;
-                if (sensor->running_avg < SET_MIN_TEMP) comment = -1;
-                else if (sensor->running_avg > SET_MAX_TEMP) comment = +1;
-
-                if (comment != sensor->last_com) {
-                    if (comment == -1) {
-                        log_event("Sensor node %u reports it’s too cold (avg temp = %g)",
-                                  (unsigned)data.id, sensor->running_avg);
-                    } else if (comment == +1) {
-                        log_event("Sensor node %u reports it’s too hot (avg temp = %g)",
-                                  (unsigned)data.id, sensor->running_avg);
-                    }
-                    sensor->last_com = comment;
-                }
-            } else {
-                sensor->running_avg = 0;
-            }
-        } else {
-            break;
+    sensor_table_t *table = &sensor_tables[args.shard];
+    const char *isa = NULL;
+    threshold_kernel_t const kernel = threshold_select(&isa);
+    if (args.shard == 0) {log_event("Data manager thresholds: %s", isa);}
+    time_t now = time(NULL);
+    while (sbuffer_remove_batch_timed(args.buffer, batch, SBUFFER_DRAIN_BATCH, args.reader, &got,
+                                      datamgr_sweep_timeout_ms(table, now)) == SBUFFER_SUCCESS) {
+        now = time(NULL); // once per batch, or per timeout (got == 0)
+        for (size_t i = 0; i < got; i++) {
+            datamgr_process(table, &batch[i], now);
         }
+        datamgr_thresholds(table, kernel);
+        datamgr_sweep(table, now);
     }
-    log_event("Data manager stopped");
+    if (args.nshards == 1) {log_event("Data manager stopped");}
+    else {log_event("Data manager worker %d stopped", args.shard);}
     return NULL;
 }
 
+int datamgr_get_room(uint16_t room, datamgr_room_t *out) {
+    room_table_t *rt = &room_table;
+    if (out == NULL) {return -1;}
+    pthread_mutex_lock(&room_table_lock);
+    uint32_t const k = rt->built ? rt->room_of[room] : 0;
+    pthread_mutex_unlock(&room_table_lock);
+    if (k == 0) {return -1;}
+    uint32_t const r = k - 1;
+    pthread_mutex_lock(&rt->lock[r]);
+    uint32_t const reporting = rt->reporting[r];
+    *out = (datamgr_room_t){.room = room, .sensors = rt->members[r], .reporting = reporting,
+                            .avg = (reporting > 0) ? (sensor_value_t)(rt->sum[r] / reporting) : 0,
+                            .min = (reporting > 0) ? rt->min[r] : 0, .max = (reporting > 0) ? rt->max[r] : 0,
+                            .comment = rt->last_com[r]};
+    pthread_mutex_unlock(&rt->lock[r]);
+    return 0;
+}
+
 void datamgr_free(){
-    if (sensor_list == NULL) return;
-    dpl_free(&sensor_list, true);
-    sensor_list = NULL;
-}
\ No newline at end of file
+    for (int k = 0; k < SBUFFER_MAX_SHARDS; k++) {sensor_table_free(&sensor_tables[k]);}
+    room_table_free(&room_table);
+}
@@ -10,26 +10,54 @@
 #ifndef RUN_AVG_LENGTH
 #define RUN_AVG_LENGTH 5
 #endif
+// second window per sensor: the minute average of a sensor reporting once a second
+#ifndef DATAMGR_LONG_AVG_LENGTH
+#define DATAMGR_LONG_AVG_LENGTH 60
+#endif
+// samples between two exact recomputations of a running sum (runavg.h)
+#ifndef DATAMGR_AVG_RESYNC
+#define DATAMGR_AVG_RESYNC 1024
+#endif
 
-typedef struct {
-    sensor_id_t id;
-    uint16_t room;
-    sensor_value_t history[RUN_AVG_LENGTH];
-    int history_count;
-    int history_index;
-    sensor_value_t running_avg;
-    time_t last_ts;
-    int last_com;//To avoid repeating logs
-} datamgr_sensor_t;
+// a sensor that reported and then stays silent this long (s) is logged as stale, once
+#ifndef DATAMGR_STALE_AFTER
+#define DATAMGR_STALE_AFTER 60
+#endif
+// seconds between two staleness passes over all the sensors of a worker
+#ifndef DATAMGR_SWEEP_INTERVAL
+#define DATAMGR_SWEEP_INTERVAL 1
+#endif
 
 typedef struct {
     sbuffer_t *buffer;
+    sbuffer_reader_t reader; // registered on shard 'shard' of 'buffer' before the producers start
+    int shard;    // this worker owns the sensors with id % nshards == shard
+    int nshards;  // sbuffer_shard_count(buffer), one worker per shard
     const char *map_filename;
 } datamgr_args_t;
 
+// a room, aggregated over its sensors (per-room state is shared by all the workers)
+typedef struct {
+    uint16_t room;
+    uint32_t sensors;   // of the map in this room
+    uint32_t reporting; // with a full running average and not stale
+    sensor_value_t avg; // of the running averages of the reporting sensors, avg/min/max are 0 when none reports
+    sensor_value_t min;
+    sensor_value_t max;
+    int8_t comment;     // last logged state: -1 too cold, 0, +1 too hot
+} datamgr_room_t;
+
 
 void *datamgr_thread(void *arg);
 
+/**
+ * A snapshot of a room, safe to call while the workers run
+ * \param room the room id of the map
+ * \param out filled out with the state of the room
+ * \return 0 on success, -1 if the room is not in the map (or no map was loaded)
+ */
+int datamgr_get_room(uint16_t room, datamgr_room_t *out);
+
 /**
  * This method should be called to clean up the datamgr, and to free all used memory.
  * After this, any call to datamgr_get_room_id, datamgr_get_avg, datamgr_get_last_modified or datamgr_get_total_sensors will not return a valid result
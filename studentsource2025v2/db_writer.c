@@ -0,0 +1,370 @@
+/**
+ * \author {Diego Vallés}
+ */
+#define _GNU_SOURCE // fdatasync, O_CLOEXEC, fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "db_writer.h"
+#include "sensor_db.h"
+#include "csv_format.h"
+#include "segment.h"
+//Group commit: rows are formatted into one large userspace buffer and written with one write() per group,
+//instead of one stdio row and one log message per reading. A group is flushed when the buffer is full or when its
+//oldest row has waited max_delay_ms; with 'sync' every group is also fdatasync'ed, the cost of a sync is shared by
+//every row of the group: https://en.wikipedia.org/wiki/Group_commit
+//One summary log line per flush instead of one per row; the rows come from csv_format.c (the bytes of "%u,%f,%ld\n")
+//DB_FORMAT_SEGMENT: the readings go to the open block of their sensor (segment.c), a closed block goes into the same
+//buffer as rows would; its readings are counted in the flush that writes the block
+//mmap mode (file_size > 0): no buffer and no write(), rows and blocks are copied straight into a file mapped with
+//MAP_SHARED, a 'group' is what was written since the last msync. The file is preallocated with fallocate so a full
+//disk fails at open and not as a SIGBUS in memcpy: https://man7.org/linux/man-pages/man2/fallocate.2.html
+//A copied row is in the page cache at once, it survives a crash of the gateway; msync (on the max_delay_ms cadence)
+//only matters for a power loss. Rotated files are trimmed to their rows on close; a file left by a crash keeps its
+//preallocated zeros after the last row (seg2csv stops there, for csv: tr -d '\000')
+#define DB_WRITER_MIN_BUFFER 4096
+
+struct db_writer {
+    int fd;
+    bool sync;
+    const char *name; // for the log
+    seg_encoder_t *enc; // DB_FORMAT_SEGMENT only
+    char *buf;   // the group buffer, in mmap mode the mapped file
+    size_t size; // of buf
+    size_t used; // bytes in the group
+    bool mapped;
+    _Atomic size_t tail; // mmap mode: end of the written records, published after their memcpy (single writer)
+    const char *base;    // mmap mode: the filename the files are named after
+    unsigned seq;        // mmap mode: files opened so far, part of the name
+    char path[PATH_MAX]; // mmap mode: the current file
+    uint64_t max_delay_ns;
+    uint64_t oldest_ns; // when the first row of the group was buffered, 0 = empty
+    size_t records;     // in the group
+    size_t sensors;     // distinct ids in the group
+    uint64_t seen[(UINT16_MAX + 1) / 64]; // ids in the group, one bit per sensor_id_t
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *data, size_t nbytes) {
+    const char *buf = data;
+    while (nbytes > 0) {
+        ssize_t w = write(fd, buf, nbytes);
+        if (w <= 0) {return -1;}
+        buf += (size_t)w;
+        nbytes -= (size_t)w;
+    }
+    return 0;
+}
+
+//mmap mode: creates the next file "<stem>-<date>-<time>-<seq><ext>", preallocates and maps it;
+//O_EXCL: an existing file (two gateways, two rotations in one second) is never reused, the next seq is tried
+static int map_open(db_writer_t *w) {
+    const char *slash = strrchr(w->base, '/');
+    const char *dot = strrchr((slash != NULL) ? slash : w->base, '.');
+    int const stem = (dot != NULL) ? (int)(dot - w->base) : (int)strlen(w->base);
+    time_t const now = time(NULL);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    do {
+        int const len = snprintf(w->path, sizeof(w->path), "%.*s-%s-%04u%s", stem, w->base, stamp, w->seq++,
+                                 (dot != NULL) ? dot : "");
+        if (len < 0 || (size_t)len >= sizeof(w->path)) {return DB_WRITER_FAILURE;}
+        w->fd = open(w->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (w->fd < 0 && errno == EEXIST);
+    if (w->fd < 0) {
+        fprintf(stderr, "Error: could not create %s\n", w->path);
+        return DB_WRITER_FAILURE;
+    }
+    int err = (fallocate(w->fd, 0, 0, (off_t)w->size) == 0) ? 0 : errno;
+    if (err == EOPNOTSUPP) {err = posix_fallocate(w->fd, 0, (off_t)w->size);} // writes the zeros itself
+    void *map = (err == 0) ? mmap(NULL, w->size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not preallocate and map %s (%s)\n", w->path, strerror(err != 0 ? err : errno));
+        close(w->fd);
+        unlink(w->path);
+        return DB_WRITER_FAILURE;
+    }
+    w->buf = map;
+    w->name = (strrchr(w->path, '/') != NULL) ? strrchr(w->path, '/') + 1 : w->path;
+    size_t tail = 0;
+    if (w->enc != NULL) { // a new segment file starts with its header
+        seg_file_header((unsigned char *)w->buf);
+        tail = SEG_FILE_HEADER_SIZE;
+    }
+    atomic_store_explicit(&w->tail, tail, memory_order_release);
+    log_event("A new %s file has been created", w->name);
+    return DB_WRITER_SUCCESS;
+}
+
+//mmap mode: unmaps, gives the unused preallocated end back and closes; the written records are never cut
+static int map_close(db_writer_t *w) {
+    size_t const tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    int rc = DB_WRITER_SUCCESS;
+    if (munmap(w->buf, w->size) != 0 || ftruncate(w->fd, (off_t)tail) != 0 || (w->sync && fdatasync(w->fd) != 0)) {
+        rc = DB_WRITER_FAILURE;
+    }
+    w->buf = NULL;
+    if (close(w->fd) != 0) {rc = DB_WRITER_FAILURE;}
+    if (rc != DB_WRITER_SUCCESS) {
+        fprintf(stderr, "Failed to close %s\n", w->name);
+    } else {
+        log_event("The %s file has been closed", w->name);
+    }
+    return rc;
+}
+
+//mmap mode: where the next 'n' bytes go, a file without room for them is rotated first
+//NULL: the rotation failed, or 'n' is more than a whole file
+static char *map_reserve(db_writer_t *w, size_t n) {
+    if (w->buf != NULL && w->size - atomic_load_explicit(&w->tail, memory_order_relaxed) >= n) {
+        return w->buf + atomic_load_explicit(&w->tail, memory_order_relaxed);
+    }
+    if (w->buf != NULL) {
+        db_writer_flush(w);
+        map_close(w);
+    }
+    if (map_open(w) != DB_WRITER_SUCCESS) {return NULL;}
+    size_t const tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    return (w->size - tail >= n) ? w->buf + tail : NULL;
+}
+
+//mmap mode: 'n' bytes were copied at the tail, they join the group
+static void map_publish(db_writer_t *w, size_t n) {
+    if (w->used == 0) {w->oldest_ns = now_ns();}
+    atomic_store_explicit(&w->tail, atomic_load_explicit(&w->tail, memory_order_relaxed) + n, memory_order_release);
+    w->used += n;
+}
+
+int db_writer_open(db_writer_t **writer, const char *filename, bool append, const db_writer_config_t *config) {
+    if (writer == NULL || filename == NULL) {return DB_WRITER_FAILURE;}
+    *writer = NULL;
+    db_writer_t *w = calloc(1, sizeof(db_writer_t));
+    if (w == NULL) {return DB_WRITER_FAILURE;}
+    w->size = (config != NULL && config->buffer_size > 0) ? config->buffer_size : DB_WRITER_BUFFER;
+    if (w->size < DB_WRITER_MIN_BUFFER) {w->size = DB_WRITER_MIN_BUFFER;}
+    int const delay_ms = (config != NULL && config->max_delay_ms > 0) ? config->max_delay_ms : DB_WRITER_MAX_DELAY_MS;
+    w->max_delay_ns = (uint64_t)delay_ms * 1000000ull;
+    w->sync = (config != NULL) && config->sync;
+    if (config != NULL && config->format == DB_FORMAT_SEGMENT &&
+        seg_encoder_init(&w->enc, config->block_age_s) != SEG_SUCCESS) {
+        free(w);
+        return DB_WRITER_FAILURE;
+    }
+    if (config != NULL && config->file_size > 0) {
+        size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+        w->size = (config->file_size < DB_WRITER_MIN_FILE) ? DB_WRITER_MIN_FILE : config->file_size;
+        w->size = (w->size + page - 1) / page * page;
+        w->mapped = true;
+        w->base = filename;
+        if (map_open(w) != DB_WRITER_SUCCESS) {
+            seg_encoder_free(&w->enc);
+            free(w);
+            return DB_WRITER_FAILURE;
+        }
+        *writer = w;
+        return DB_WRITER_SUCCESS;
+    }
+    w->buf = malloc(w->size);
+    if (w->buf == NULL) {seg_encoder_free(&w->enc); free(w); return DB_WRITER_FAILURE;}
+    w->name = (strrchr(filename, '/') != NULL) ? strrchr(filename, '/') + 1 : filename;
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, "Error: could not open file in db_writer_open\n");
+        seg_encoder_free(&w->enc);
+        free(w->buf);
+        free(w);
+        return DB_WRITER_FAILURE;
+    }
+    if (w->enc != NULL && lseek(w->fd, 0, SEEK_END) == 0) { // a new segment file starts with its header
+        unsigned char header[SEG_FILE_HEADER_SIZE];
+        seg_file_header(header);
+        if (write_all(w->fd, header, sizeof(header)) != 0) {
+            fprintf(stderr, "Error: could not write the segment header\n");
+            close(w->fd);
+            seg_encoder_free(&w->enc);
+            free(w->buf);
+            free(w);
+            return DB_WRITER_FAILURE;
+        }
+    }
+    if (!append) {log_event("A new %s file has been created", w->name);}
+    *writer = w;
+    return DB_WRITER_SUCCESS;
+}
+
+int db_writer_flush(db_writer_t *w) {
+    if (w == NULL) {return DB_WRITER_FAILURE;}
+    if (w->used == 0) {return DB_WRITER_SUCCESS;}
+    int rc = DB_WRITER_SUCCESS;
+    if (w->mapped) {
+        //msync wants a page aligned start: from the page of the first byte of the group up to the tail
+        size_t const tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        size_t const from = (tail - w->used) / (size_t)sysconf(_SC_PAGESIZE) * (size_t)sysconf(_SC_PAGESIZE);
+        if (msync(w->buf + from, tail - from, w->sync ? MS_SYNC : MS_ASYNC) != 0) {
+            fprintf(stderr, "Error: msync of %s failed\n", w->name);
+            rc = DB_WRITER_FAILURE;
+        }
+    } else if (write_all(w->fd, w->buf, w->used) != 0) {
+        fprintf(stderr, "Error: data insertion into %s failed (%zu records lost)\n", w->name, w->records);
+        rc = DB_WRITER_FAILURE;
+    } else if (w->sync && fdatasync(w->fd) != 0) {
+        fprintf(stderr, "Error: fdatasync of %s failed\n", w->name);
+        rc = DB_WRITER_FAILURE;
+    }
+    if (rc == DB_WRITER_SUCCESS) {
+        log_event("%zu records from %zu sensors flushed%s", w->records, w->sensors, w->sync ? " and synced" : "");
+    }
+    w->used = 0;
+    w->oldest_ns = 0;
+    w->records = 0;
+    w->sensors = 0;
+    memset(w->seen, 0, sizeof(w->seen));
+    return rc;
+}
+
+static void count_records(db_writer_t *w, sensor_id_t id, size_t count) {
+    w->records += count;
+    uint64_t const bit = 1ull << (id % 64);
+    if ((w->seen[id / 64] & bit) == 0) {
+        w->seen[id / 64] |= bit;
+        w->sensors++;
+    }
+}
+
+//seg_emit_t: a closed block goes into the group like rows, one larger than the whole buffer is written at once
+static int emit_block(void *ctx, const unsigned char *block, size_t size, sensor_id_t id, size_t count) {
+    db_writer_t *w = ctx;
+    int rc = DB_WRITER_SUCCESS;
+    if (w->mapped) {
+        char *dst = map_reserve(w, size);
+        if (dst == NULL) {
+            fprintf(stderr, "Error: data insertion into %s failed (%zu records lost)\n", w->name, count);
+            return DB_WRITER_FAILURE;
+        }
+        memcpy(dst, block, size);
+        map_publish(w, size);
+        count_records(w, id, count);
+        return rc;
+    }
+    if (w->size - w->used < size) {rc = db_writer_flush(w);}
+    if (size > w->size) {
+        if (write_all(w->fd, block, size) != 0) {
+            fprintf(stderr, "Error: data insertion into %s failed (%zu records lost)\n", w->name, count);
+            return DB_WRITER_FAILURE;
+        }
+        if (w->sync && fdatasync(w->fd) != 0) {
+            fprintf(stderr, "Error: fdatasync of %s failed\n", w->name);
+            return DB_WRITER_FAILURE;
+        }
+        log_event("%zu records from 1 sensor flushed%s", count, w->sync ? " and synced" : "");
+        return rc;
+    }
+    if (w->used == 0) {w->oldest_ns = now_ns();}
+    memcpy(w->buf + w->used, block, size);
+    w->used += size;
+    count_records(w, id, count);
+    return rc;
+}
+
+int db_writer_insert_batch(db_writer_t *w, const sensor_data_t *data, size_t n) {
+    if (w == NULL || (data == NULL && n > 0)) {return DB_WRITER_FAILURE;}
+    int rc = DB_WRITER_SUCCESS;
+    if (w->enc != NULL) {
+        time_t const now = time(NULL);
+        for (size_t i = 0; i < n; i++) {
+            if (seg_encoder_add(w->enc, &data[i], now, emit_block, w) != SEG_SUCCESS) {rc = DB_WRITER_FAILURE;}
+        }
+        return rc;
+    }
+    if (w->mapped) { // the row is formatted in place, a row has CSV_ROW_MAX bytes at most
+        for (size_t i = 0; i < n; i++) {
+            char *dst = map_reserve(w, CSV_ROW_MAX);
+            if (dst == NULL) {
+                fprintf(stderr, "Error: data insertion into %s failed (%zu records lost)\n", w->name, n - i);
+                return DB_WRITER_FAILURE;
+            }
+            map_publish(w, csv_format_row(dst, data[i].id, data[i].value, data[i].ts));
+            count_records(w, data[i].id, 1);
+        }
+        return rc;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (w->size - w->used < CSV_ROW_MAX) { // the row might not fit: flush the group, the row starts the next one
+            if (db_writer_flush(w) != DB_WRITER_SUCCESS) {rc = DB_WRITER_FAILURE;}
+        }
+        if (w->used == 0) {w->oldest_ns = now_ns();}
+        w->used += csv_format_row(w->buf + w->used, data[i].id, data[i].value, data[i].ts);
+        count_records(w, data[i].id, 1);
+    }
+    return rc;
+}
+
+int db_writer_poll(db_writer_t *w) {
+    if (w == NULL) {return DB_WRITER_FAILURE;}
+    int rc = DB_WRITER_SUCCESS;
+    if (w->enc != NULL && seg_encoder_close_aged(w->enc, time(NULL), emit_block, w) != SEG_SUCCESS) {rc = DB_WRITER_FAILURE;}
+    if (rc != DB_WRITER_SUCCESS) {return rc;}
+    if (w->used == 0 || now_ns() - w->oldest_ns < w->max_delay_ns) {return DB_WRITER_SUCCESS;}
+    return db_writer_flush(w);
+}
+
+//an open block is checked once a second
+#define DB_WRITER_BLOCK_CHECK_MS 1000
+
+int db_writer_timeout_ms(const db_writer_t *w) {
+    if (w == NULL) {return -1;}
+    int timeout = -1;
+    if (w->used > 0) {
+        uint64_t const age = now_ns() - w->oldest_ns;
+        //rounded up: the poll after it finds the group due
+        timeout = (age >= w->max_delay_ns) ? 0 : (int)((w->max_delay_ns - age + 999999) / 1000000);
+    }
+    if (seg_encoder_open_blocks(w->enc) > 0 && (timeout < 0 || timeout > DB_WRITER_BLOCK_CHECK_MS)) {
+        timeout = DB_WRITER_BLOCK_CHECK_MS;
+    }
+    return timeout;
+}
+
+int64_t db_writer_size(const db_writer_t *w) {
+    struct stat st;
+    if (w == NULL || w->mapped || fstat(w->fd, &st) != 0) {return -1;}
+    return (int64_t)st.st_size;
+}
+
+int db_writer_close(db_writer_t **writer) {
+    if (writer == NULL || *writer == NULL) {return DB_WRITER_FAILURE;}
+    db_writer_t *w = *writer;
+    int rc = DB_WRITER_SUCCESS;
+    if (w->enc != NULL && seg_encoder_close_all(w->enc, emit_block, w) != SEG_SUCCESS) {rc = DB_WRITER_FAILURE;}
+    if (db_writer_flush(w) != DB_WRITER_SUCCESS) {rc = DB_WRITER_FAILURE;}
+    if (w->mapped) {
+        if (w->buf != NULL && map_close(w) != DB_WRITER_SUCCESS) {rc = DB_WRITER_FAILURE;}
+    } else if (close(w->fd) != 0) {
+        fprintf(stderr, "Failed to close %s\n", w->name);
+        rc = DB_WRITER_FAILURE;
+    } else {
+        log_event("The %s file has been closed", w->name);
+    }
+    seg_encoder_free(&w->enc);
+    if (!w->mapped) {free(w->buf);}
+    free(w);
+    *writer = NULL;
+    return rc;
+}
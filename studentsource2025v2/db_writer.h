@@ -0,0 +1,92 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _DB_WRITER_H_
+#define _DB_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define DB_WRITER_SUCCESS 0
+#define DB_WRITER_FAILURE -1
+
+// bytes of rows buffered before a flush
+#ifndef DB_WRITER_BUFFER
+#define DB_WRITER_BUFFER (1 << 20)
+#endif
+// a buffered row waits at most this long (ms) for its flush
+#ifndef DB_WRITER_MAX_DELAY_MS
+#define DB_WRITER_MAX_DELAY_MS 100
+#endif
+// smallest mapped file (file_size), a segment block must fit in one
+#define DB_WRITER_MIN_FILE (1 << 16)
+
+typedef struct db_writer db_writer_t;
+
+// what the writer puts in the file
+typedef enum {
+    DB_FORMAT_CSV,    // "id,value,ts" rows
+    DB_FORMAT_SEGMENT // compressed per-sensor blocks (segment.h), a sensor's readings reach the file when its block closes
+} db_format_t;
+
+typedef struct {
+    db_format_t format;
+    size_t buffer_size; // 0 = DB_WRITER_BUFFER, at least 4096
+    int max_delay_ms;   // 0 = DB_WRITER_MAX_DELAY_MS
+    bool sync;          // fdatasync after every flush: a flushed group survives a power loss
+    int block_age_s;    // DB_FORMAT_SEGMENT: an open block is closed this long after its first reading, 0 = SEG_BLOCK_MAX_AGE
+    size_t file_size;   // > 0: mmap mode, records are copied into preallocated files of this size (rounded up to pages),
+                        // named filename + timestamp ("data-20250101-120000-0000.csv"), a full file is rotated, never reused;
+                        // a flush is an msync of what was written since the last one (MS_SYNC with 'sync')
+} db_writer_config_t;
+
+/**
+ * Opens the data file for a group-commit writer
+ * \param writer a double pointer to the writer that is created
+ * \param filename the csv or segment file, in mmap mode the name the rotated files are derived from
+ * \param append false: the file starts empty (mmap mode always starts a new file)
+ * \param config the thresholds and durability, NULL for the defaults
+ * \return DB_WRITER_SUCCESS on success and DB_WRITER_FAILURE if an error occurred
+ */
+int db_writer_open(db_writer_t **writer, const char *filename, bool append, const db_writer_config_t *config);
+
+/**
+ * Formats 'n' records into the buffer (csv) or into the open block of their sensor (segment), flushes whenever the buffer is full
+ * \return DB_WRITER_SUCCESS on success and DB_WRITER_FAILURE if a flush failed (the rows of that flush are lost)
+ */
+int db_writer_insert_batch(db_writer_t *writer, const sensor_data_t *data, size_t n);
+
+/**
+ * Flushes when the oldest buffered row has waited max_delay_ms, closes the segment blocks that are old enough
+ * \return DB_WRITER_SUCCESS on success and DB_WRITER_FAILURE if the flush failed
+ */
+int db_writer_poll(db_writer_t *writer);
+
+/**
+ * How long the caller can wait for new records before db_writer_poll has work to do
+ * \return milliseconds, -1 when nothing is buffered and no block is open (wait as long as needed)
+ */
+int db_writer_timeout_ms(const db_writer_t *writer);
+
+/**
+ * Writes every buffered row or closed block (and fdatasync if configured), logs one summary line
+ * \return DB_WRITER_SUCCESS on success and DB_WRITER_FAILURE if an error occurred
+ */
+int db_writer_flush(db_writer_t *writer);
+
+/**
+ * Size of the file, with what the flushes wrote so far (not what is still buffered)
+ * \return bytes, -1 in mmap mode or if the size could not be read
+ */
+int64_t db_writer_size(const db_writer_t *writer);
+
+/**
+ * Closes the open blocks, flushes, closes the file and frees the writer
+ * \param writer a double pointer to the writer, set to NULL
+ * \return DB_WRITER_SUCCESS on success and DB_WRITER_FAILURE if an error occurred
+ */
+int db_writer_close(db_writer_t **writer);
+
+#endif //_DB_WRITER_H_
@@ -42,25 +42,20 @@
 
 #define MAGIC_COOKIE    (long)(0xA2E1CF37D35)   // used to check if a socket is bounded
 
-#define    CHAR_IP_ADDR_LENGTH  16              // 4 numbers of 3 digits, 3 dots and \0
 #define    PROTOCOLFAMILY       AF_INET         // internet protocol suite
 #define    TYPE                 SOCK_STREAM     // streaming protool type
 #define    PROTOCOL             IPPROTO_TCP     // TCP protocol
 
-/**
- * Structure for holding the TCP socket information
- */
-struct tcpsock {
-    long cookie;        /**< if the socket is bound, cookie should be equal to MAGIC_COOKIE */
-    // remark: the use of magic cookies doesn't guarantee a 'bullet proof' test
-    int sd;             /**< socket descriptor */
-    char *ip_addr;      /**< socket IP address */
-    int port;           /**< socket port number */
-};
+// remark: the use of magic cookies doesn't guarantee a 'bullet proof' test
+// the IP address is stored inline (inet_ntop, reentrant), inet_ntoa returns a static buffer shared by all threads
 
 static tcpsock_t *tcp_sock_create();
 
 int tcp_passive_open(tcpsock_t **sock, int port) {
+    return tcp_passive_open_opts(sock, port, MAX_PENDING, 0);
+}
+
+int tcp_passive_open_opts(tcpsock_t **sock, int port, int backlog, int reuseport) {
     int result;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
@@ -69,6 +64,12 @@ int tcp_passive_open(tcpsock_t **sock, int port) {
     s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd < 0, free(s);return TCP_SOCKOP_ERROR);
+    if (reuseport) {
+        int one = 1;
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd);free(s);return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -77,10 +78,10 @@ int tcp_passive_open(tcpsock_t **sock, int port) {
     result = bind(s->sd, (struct sockaddr *) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(result != 0, free(s);return TCP_SOCKOP_ERROR);
-    result = listen(s->sd, MAX_PENDING);
+    result = listen(s->sd, (backlog > 0) ? backlog : MAX_PENDING);
     TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(result != 0, free(s);return TCP_SOCKOP_ERROR);
-    s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
+    s->ip_addr[0] = '\0'; // address set to INADDR_ANY - not a specific IP address
     s->port = port;
     s->cookie = MAGIC_COOKIE;
     *sock = s;
@@ -91,7 +92,6 @@ int tcp_active_open(tcpsock_t **sock, int remote_port, char *remote_ip) {
     struct sockaddr_in addr;
     tcpsock_t *client;
     int length, result;
-    char *p;
     TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)),
                     return TCP_ADDRESS_ERROR);  // server port between 0 and MIN_PORT is allowed
     TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
@@ -114,10 +114,7 @@ int tcp_active_open(tcpsock_t **sock, int remote_port, char *remote_ip) {
     result = getsockname(client->sd, (struct sockaddr *) &addr, (socklen_t *) &length);
     TCP_DEBUG_PRINTF(result == -1, "getsockname() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(result != 0, free(client);return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr);  //returns addr to statically allocated buffer
-    client->ip_addr = (char *) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(client->ip_addr == NULL, free(client);return TCP_MEMORY_ERROR);
-    client->ip_addr = strncpy(client->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    inet_ntop(PROTOCOLFAMILY, &addr.sin_addr, client->ip_addr, TCP_IP_ADDR_LENGTH);
     client->port = ntohs(addr.sin_port);
     client->cookie = MAGIC_COOKIE;
     *sock = client;
@@ -128,12 +125,9 @@ int tcp_close(tcpsock_t **socket) {
     int result;
     if (socket == NULL) return TCP_SOCKET_ERROR;
     if (*socket == NULL) return TCP_SOCKET_ERROR;
+    if ((*socket)->embedded) return TCP_SOCKET_ERROR; // not ours to free: tcp_close_embedded
     if ((*socket)->cookie == MAGIC_COOKIE) // socket is bound
     {
-        if ((*socket)->ip_addr != NULL) // then assume memory is allocated and must be freed
-        {
-            free((*socket)->ip_addr);
-        }
         if ((*socket)->sd >= 0) {
             // maybe a connection is still open?
             result = shutdown((*socket)->sd, SHUT_RDWR);
@@ -149,7 +143,7 @@ int tcp_close(tcpsock_t **socket) {
     (*socket)->cookie = 0;
     (*socket)->port = -1;
     (*socket)->sd = -1;
-    (*socket)->ip_addr = NULL;
+    (*socket)->ip_addr[0] = '\0';
     free(*socket);
     *socket = NULL;
     return TCP_NO_ERROR;
@@ -159,7 +153,6 @@ int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket) {
     struct sockaddr_in addr;
     tcpsock_t *s;
     unsigned int length = sizeof(struct sockaddr_in);
-    char *p;
 
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -168,16 +161,43 @@ int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket) {
     s->sd = accept(socket->sd, (struct sockaddr *) &addr, &length);
     TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd == -1, free(s);return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr);  //returns addr to statically allocated buffer
-    s->ip_addr = (char *) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s);return TCP_MEMORY_ERROR);
-    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    inet_ntop(PROTOCOLFAMILY, &addr.sin_addr, s->ip_addr, TCP_IP_ADDR_LENGTH);
     s->port = ntohs(addr.sin_port);
     s->cookie = MAGIC_COOKIE;
     *new_socket = s;
     return TCP_NO_ERROR;
 }
 
+int tcp_wait_for_connection_into(tcpsock_t *socket, tcpsock_t *new_socket) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(struct sockaddr_in);
+
+    TCP_ERR_HANDLER(socket == NULL || new_socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int const sd = accept4(socket->sd, (struct sockaddr *) &addr, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    TCP_DEBUG_PRINTF(sd == -1, "Accept4() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(sd == -1, return TCP_SOCKOP_ERROR);
+    new_socket->sd = sd;
+    inet_ntop(PROTOCOLFAMILY, &addr.sin_addr, new_socket->ip_addr, TCP_IP_ADDR_LENGTH);
+    new_socket->port = ntohs(addr.sin_port);
+    new_socket->embedded = 1;
+    new_socket->cookie = MAGIC_COOKIE;
+    return TCP_NO_ERROR;
+}
+
+int tcp_close_embedded(tcpsock_t *socket) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE || !socket->embedded, return TCP_SOCKET_ERROR);
+    // not shared with another process: close() alone sends the FIN, no shutdown() needed
+    int const result = close(socket->sd);
+    TCP_DEBUG_PRINTF(result == -1, "Close() failed with errno = %d [%s]", errno, strerror(errno));
+    socket->cookie = 0;
+    socket->port = -1;
+    socket->sd = -1;
+    socket->ip_addr[0] = '\0';
+    return (result == 0) ? TCP_NO_ERROR : TCP_SOCKOP_ERROR; // the descriptor is released either way
+}
+
 int tcp_send(tcpsock_t *socket, void *buffer, int *buf_size) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -221,7 +241,7 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size) {
 int tcp_get_ip_addr(tcpsock_t *socket, char **ip_addr) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
-    *ip_addr = socket->ip_addr;
+    *ip_addr = (socket->ip_addr[0] != '\0') ? socket->ip_addr : NULL;
     return TCP_NO_ERROR;
 }
 
@@ -245,8 +265,9 @@ static tcpsock_t *tcp_sock_create() {
     {
         s->cookie = 0;  // socket is not yet bound!
         s->port = -1;
-        s->ip_addr = NULL;
+        s->ip_addr[0] = '\0';
         s->sd = -1;
+        s->embedded = 0;
     }
     return s;
 }
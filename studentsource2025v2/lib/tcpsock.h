@@ -17,7 +17,20 @@
 
 #define MAX_PENDING 10
 
-typedef struct tcpsock tcpsock_t;
+#define TCP_IP_ADDR_LENGTH 16 // 4 numbers of 3 digits, 3 dots and \0 (INET_ADDRSTRLEN)
+
+/**
+ * Structure for holding the TCP socket information
+ * Visible so a caller can embed a socket in its own memory (see tcp_wait_for_connection_into), the fields are private:
+ * only use the tcp_ functions on it. It holds no pointers, a copy is the same socket
+ */
+typedef struct tcpsock {
+    long cookie;                      /**< if the socket is bound, cookie should be equal to MAGIC_COOKIE */
+    int sd;                           /**< socket descriptor */
+    int port;                         /**< socket port number */
+    int embedded;                     /**< storage owned by the caller: tcp_close_embedded, not tcp_close */
+    char ip_addr[TCP_IP_ADDR_LENGTH]; /**< socket IP address, "" if not set */
+} tcpsock_t;
 
 /**
  * Creates a new socket and opens this socket in 'passive listening mode' (waiting for an active connection setup request)
@@ -33,6 +46,18 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t **socket, int port);
 
+/**
+ * Same as tcp_passive_open, with the listen backlog and SO_REUSEPORT chosen by the caller
+ * With 'reuseport' several sockets can listen on the same port, the kernel spreads the incoming connections over them
+ * The backlog is capped by the kernel (net.core.somaxconn)
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \param backlog the number of pending connection setup requests, <= 0 gives MAX_PENDING
+ * \param reuseport non-zero to set SO_REUSEPORT before binding
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_opts(tcpsock_t **socket, int port, int backlog, int reuseport);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -54,6 +79,7 @@ int tcp_active_open(tcpsock_t **socket, int remote_port, char *remote_ip);
  * If '*socket' is connected, a TCP shutdown on the connection is executed
  * If 'socket' or '*socket' is NULL, nothing is done and TCP_SOCKET_ERROR is returned
  * If '*socket' is not a valid socket, the result of the function is undefined
+ * If '*socket' was filled out by tcp_wait_for_connection_into, nothing is done and TCP_SOCKET_ERROR is returned
  * \param socket a double pointer, to the socket that needs to be closed
  * \return TCP_NO_ERROR if no error occurs during execution
  */
@@ -72,6 +98,26 @@ int tcp_close(tcpsock_t **socket);
  */
 int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket);
 
+/**
+ * Same as tcp_wait_for_connection without any memory allocation: the new socket is written into the caller's 'new_socket'
+ * The connection is accepted with accept4(SOCK_NONBLOCK | SOCK_CLOEXEC): the new socket is non-blocking
+ * Safe to call from several threads at once (the address is formatted with inet_ntop into 'new_socket')
+ * If a socket operation (accept, ...) fails, TCP_SOCKOP_ERROR is returned and errno tells why (EAGAIN: nothing to accept)
+ * If 'socket' or 'new_socket' is NULL or 'socket' not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the socket that needs to be monitored for a new incoming connection
+ * \param new_socket storage of the caller, filled out with the socket for the connection with the client
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_wait_for_connection_into(tcpsock_t *socket, tcpsock_t *new_socket);
+
+/**
+ * Closes a socket filled out by tcp_wait_for_connection_into: close() only, nothing is freed
+ * The socket is invalid afterwards (until it is filled out again)
+ * \param socket the socket that needs to be closed
+ * \return TCP_NO_ERROR if no error occurs during execution, TCP_SOCKET_ERROR if 'socket' is NULL or not bound
+ */
+int tcp_close_embedded(tcpsock_t *socket);
+
 /**
  * Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
@@ -10,22 +10,34 @@
 //Terminal 4: ./sensor_node 404 1 127.0.0.1 5678 try to add sensor 4 (Blocked bc 3 sensors already connected)
 //Terminal 3: close sensor 2
 //server should close by it-self
+//Service: ./sensor_gateway 5678 1000 -C -a 4 runs until Ctrl-C / SIGTERM with at most 1000 sensors connected at once
+//UDP sensors too: ./sensor_gateway 5678 1000 -C -u 5679
+//Crash safe: ./sensor_gateway 5678 1000 -C -L gateway.wal replays what a crash left in gateway.wal and appends to data.csv
+#define _GNU_SOURCE // sigset_t, pthread_sigmask
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
+#include <string.h>
 #include "config.h"
 #include "sbuffer.h"
 #include "connmgr.h"
 #include "sensor_db.h"
+#include "db_writer.h"
+#include "wal.h"
 #include "datamgr.h"
+#include "lib/tcpsock.h"
 
 typedef struct {
     sbuffer_t *buffer;
+    sbuffer_reader_t reader;
     const char *csv_filename;
+    db_writer_config_t writer; // group commit of data.csv
+    wal_t *wal; // NULL: no write-ahead log, data.csv is started from scratch
 } storagemgr_args_t;
 
 static int read_all(int fd, void *buf, size_t nbytes)
@@ -72,58 +84,181 @@ static void *storagemgr_thread(void *arg) {
     storagemgr_args_t sa = *sa_heap;
     free(sa_heap);
 
-    FILE *f = open_db(sa.csv_filename, false);
-    if (f == NULL) {
-        fprintf(stderr, "SM open_db failed\n");
+    db_writer_t *writer = NULL;
+    if (db_writer_open(&writer, sa.csv_filename, sa.wal != NULL, &sa.writer) != DB_WRITER_SUCCESS) {
+        fprintf(stderr, "SM db_writer_open failed\n");
         return NULL;
     }
+    //write-ahead log: records written to data.csv so far; once nothing is buffered any more they can leave the log
+    uint64_t stored = 0;
+    bool storage_ok = true;
 
-    sensor_data_t data;
+    //waits for records only until the oldest buffered row is due, so an idle gateway still flushes on time
+    sensor_data_t batch[SBUFFER_DRAIN_BATCH];
+    size_t got = 0;
     while(1){
-        int rc = sbuffer_remove(sa.buffer, &data, SBUFFER_READER_SM);
+        int rc = sbuffer_remove_batch_timed(sa.buffer, batch, SBUFFER_DRAIN_BATCH, sa.reader, &got,
+                                            db_writer_timeout_ms(writer));
 
         if (rc == SBUFFER_SUCCESS) {
-            if (insert_sensor(f, data.id, data.value, data.ts) != 0) {
-                fprintf(stderr, "SM insert_sensor failed (id=%u)\n", (unsigned)data.id);
+            if (db_writer_insert_batch(writer, batch, got) != DB_WRITER_SUCCESS) {
+                fprintf(stderr, "SM db_writer_insert_batch failed\n");
+                storage_ok = false; // lost rows: the log keeps them for the next start
+            }
+            if (db_writer_poll(writer) != DB_WRITER_SUCCESS) {
+                fprintf(stderr, "SM db_writer_poll failed\n");
+                storage_ok = false;
+            }
+            stored += got;
+            if (sa.wal != NULL && storage_ok && db_writer_timeout_ms(writer) < 0) {
+                wal_checkpoint(sa.wal, stored, (uint64_t)db_writer_size(writer), false);
             }
         } else if (rc == SBUFFER_NO_DATA) {
             break;
         } else {
-            fprintf(stderr, "SM sbuffer_remove failed\n");
+            fprintf(stderr, "SM sbuffer_remove_batch failed\n");
             break;
         }
     }
-    if (close_db(f) != 0) {
-        fprintf(stderr, "SM close_db failed\n");
+    if (sa.wal != NULL && storage_ok && db_writer_flush(writer) == DB_WRITER_SUCCESS) {
+        wal_checkpoint(sa.wal, stored, (uint64_t)db_writer_size(writer), true);
+    }
+    if (db_writer_close(&writer) != DB_WRITER_SUCCESS) {
+        fprintf(stderr, "SM db_writer_close failed\n");
     }
     return NULL;
 }
 
+//string to long with strtol: https://www.tutorialspoint.com/c_standard_library/c_function_strtol.htm
+static int parse_long(const char *str, long min, long max, long *out) {
+    char *end = NULL;
+    long value = strtol(str, &end, 10);
+    if (*str == '\0' || (end && *end != '\0') || value < min || value > max) {return -1;}
+    *out = value;
+    return 0;
+}
+
+static int parse_policy(const char *str, sbuffer_policy_t *out) {
+    sbuffer_policy_t const policies[] = {SBUFFER_POLICY_BLOCK, SBUFFER_POLICY_DROP_OLDEST,
+                                         SBUFFER_POLICY_DROP_NEWEST, SBUFFER_POLICY_SPILL};
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(str, sbuffer_policy_name(policies[i])) == 0) {*out = policies[i];return 0;}
+    }
+    return -1;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <port> <max_conn> [options]\n", prog);
+    fprintf(stderr, "  -c <records>  sbuffer capacity in records (default %d)\n", SBUFFER_CAPACITY);
+    fprintf(stderr, "  -m <bytes>    sbuffer memory cap in bytes, overrides -c\n");
+    fprintf(stderr, "  -p <policy>   when the sbuffer is full: block (default), drop-oldest, drop-newest, spill\n");
+    fprintf(stderr, "  -r <reactors> connection manager event loop threads (default 1)\n");
+    fprintf(stderr, "  -k <workers>  data manager workers, the sbuffer gets one shard per worker (default 1, max %d)\n", SBUFFER_MAX_SHARDS);
+    fprintf(stderr, "  -C            continuous: run until SIGINT/SIGTERM, max_conn caps the clients connected at once\n");
+    fprintf(stderr, "  -a <threads>  acceptor threads, each one on its own SO_REUSEPORT socket (default 1)\n");
+    fprintf(stderr, "  -b <backlog>  listen backlog per socket (default %d, %d with -C)\n", MAX_PENDING, CONNMGR_SERVICE_BACKLOG);
+    fprintf(stderr, "  -u <port>     also take sensor datagrams (one or more records each) on this UDP port\n");
+    fprintf(stderr, "  -w <ms>       data.csv rows wait at most this long in the storage buffer, with -f: msync cadence (default %d)\n", DB_WRITER_MAX_DELAY_MS);
+    fprintf(stderr, "  -W <bytes>    storage buffer size, a full buffer is flushed at once (default %d)\n", DB_WRITER_BUFFER);
+    fprintf(stderr, "  -s            fdatasync data.csv after every flush (msync MS_SYNC with -f)\n");
+    fprintf(stderr, "  -f <bytes>    write into mmap'ed files of this size (data-<date>-<time>-<seq>.csv), a full one is rotated\n");
+    fprintf(stderr, "  -o <format>   storage format: csv (default, data.csv) or seg (compressed blocks in data.seg, ./seg2csv reads them)\n");
+    fprintf(stderr, "  -L <file>     write-ahead log of every received record, replayed at start-up; data.csv is appended to (csv only)\n");
+    fprintf(stderr, "Example: %s 1234 3\n", prog);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <port> <max_conn>\n", argv[0]);
-    	fprintf(stderr, "Example: %s 1234 3\n", argv[0]);
+    if (argc < 3) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-	//string to long with strtol: https://www.tutorialspoint.com/c_standard_library/c_function_strtol.htm
-    char *end = NULL;
-    long port_l = strtol(argv[1], &end, 10);
-    if (*argv[1] == '\0' || (end && *end != '\0') || port_l <= 0 || port_l > 65535) {
+    long port_l = 0;
+    if (parse_long(argv[1], 1, 65535, &port_l) != 0) {
         fprintf(stderr, "Invalid port: %s\n", argv[1]);
         return EXIT_FAILURE;
     }
 
-    end = NULL;
-    long max_conn_l = strtol(argv[2], &end, 10);
-    if (*argv[2] == '\0' || (end && *end != '\0') || max_conn_l <= 0 || max_conn_l > 1000000) {
+    long max_conn_l = 0;
+    if (parse_long(argv[2], 1, 1000000, &max_conn_l) != 0) {
         fprintf(stderr, "Invalid max_conn: %s\n", argv[2]);
         return EXIT_FAILURE;
     }
 
+    long reactors = 1, acceptors = 1, backlog = 0, udp_port = 0, flush_ms = 0, writer_bytes = 0, file_bytes = 0;
+    bool sync_db = false;
+    db_format_t format = DB_FORMAT_CSV;
+    int continuous = 0;
+    const char *wal_path = NULL;
+    sbuffer_config_t buffer_cfg = {.capacity = 0, .capacity_bytes = 0, .policy = SBUFFER_POLICY_BLOCK, .spill_path = NULL, .shards = 1};
+    for (int i = 3; i < argc; i++) {
+        long value = 0;
+        int bad = -1;
+        if (strcmp(argv[i], "-C") == 0) {continuous = 1;continue;}
+        if (strcmp(argv[i], "-s") == 0) {sync_db = true;continue;}
+        if (i + 1 >= argc) {print_usage(argv[0]);return EXIT_FAILURE;}
+        if (strcmp(argv[i], "-c") == 0) {
+            bad = parse_long(argv[i + 1], 1, 1L << 30, &value);
+            buffer_cfg.capacity = (size_t)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            bad = parse_long(argv[i + 1], 1, 1L << 40, &value);
+            buffer_cfg.capacity_bytes = (size_t)value;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            bad = parse_policy(argv[i + 1], &buffer_cfg.policy);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            bad = parse_long(argv[i + 1], 1, 64, &reactors);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            bad = parse_long(argv[i + 1], 1, SBUFFER_MAX_SHARDS, &value);
+            buffer_cfg.shards = (size_t)value;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            bad = parse_long(argv[i + 1], 1, 64, &acceptors);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            bad = parse_long(argv[i + 1], 1, 1L << 20, &backlog);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            bad = parse_long(argv[i + 1], 1, 65535, &udp_port);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            bad = parse_long(argv[i + 1], 1, 60000, &flush_ms);
+        } else if (strcmp(argv[i], "-W") == 0) {
+            bad = parse_long(argv[i + 1], 4096, 1L << 30, &writer_bytes);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            bad = parse_long(argv[i + 1], DB_WRITER_MIN_FILE, 1L << 40, &file_bytes);
+        } else if (strcmp(argv[i], "-L") == 0) {
+            wal_path = argv[i + 1];
+            bad = 0;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            bad = 0;
+            if (strcmp(argv[i + 1], "seg") == 0) {format = DB_FORMAT_SEGMENT;}
+            else if (strcmp(argv[i + 1], "csv") != 0) {bad = -1;}
+        }
+        if (bad != 0) {
+            fprintf(stderr, "Invalid option: %s %s\n", argv[i], argv[i + 1]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+
+    //the log counts on every record reaching data.csv (see wal.c)
+    if (wal_path != NULL && (format != DB_FORMAT_CSV || file_bytes > 0 ||
+                             buffer_cfg.policy == SBUFFER_POLICY_DROP_OLDEST || buffer_cfg.policy == SBUFFER_POLICY_DROP_NEWEST)) {
+        fprintf(stderr, "-L needs the csv storage without -f and the block or spill policy\n");
+        return EXIT_FAILURE;
+    }
+
     int port = (int)port_l;
     int max_conn = (int)max_conn_l;
     int status = 0;
+
+    //continuous: SIGINT/SIGTERM are blocked in every thread (inherited from here) and the log process,
+    //the connection manager takes them with sigwait and shuts the gateway down in order
+    if (continuous) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+
     int pipefd[2];
     if (pipe(pipefd) < 0) {
         perror("pipe");
@@ -155,38 +290,80 @@ int main(int argc, char **argv) {
 
 	log_event("Sensor gateway started (port=%d, max_conn=%d)", port, max_conn);
 
+    //recovery before any record can arrive, then an empty log in front of the sbuffer
+    wal_t *wal = NULL;
+    uint64_t storage_size = 0;
+    if (wal_path != NULL) {
+        wal_config_t const wal_cfg = {.sync = sync_db};
+        if (wal_recover(wal_path, "data.csv", &storage_size) != WAL_SUCCESS ||
+            wal_open(&wal, wal_path, storage_size, &wal_cfg) != WAL_SUCCESS) {
+            fprintf(stderr, "write-ahead log %s failed\n", wal_path);
+            close(pipefd[1]);
+            waitpid(log_pid, &status, 0);
+            return EXIT_FAILURE;
+        }
+        buffer_cfg.wal = wal;
+    }
+
     sbuffer_t *buffer = NULL;
-    if (sbuffer_init(&buffer) != SBUFFER_SUCCESS) {
-        fprintf(stderr, "sbuffer_init failed\n");
+    if (sbuffer_init_config(&buffer, &buffer_cfg) != SBUFFER_SUCCESS) {
+        fprintf(stderr, "sbuffer_init_config failed\n");
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
     }
 
-    //Start DM
-    pthread_t dm_tid;
-    datamgr_args_t *dm_args = malloc(sizeof(*dm_args));
-    if (!dm_args) {
-        fprintf(stderr, "malloc(dm_args) failed\n");
-        sbuffer_close(buffer);
+    //All readers are registered before any producer exists, so each of them sees every record of its shard(s)
+    //DM: one worker per shard, each one owns a disjoint set of sensors; SM: one reader of every shard
+    int const nworkers = sbuffer_shard_count(buffer);
+    sbuffer_reader_t dm_reader[SBUFFER_MAX_SHARDS], sm_reader;
+    int reg_failed = (sbuffer_register_reader(buffer, &sm_reader) != SBUFFER_SUCCESS);
+    for (int k = 0; k < nworkers && !reg_failed; k++) {
+        reg_failed = (sbuffer_register_shard_reader(buffer, k, &dm_reader[k]) != SBUFFER_SUCCESS);
+    }
+    if (reg_failed) {
+        fprintf(stderr, "sbuffer_register_reader failed\n");
         sbuffer_free(&buffer);
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
     }
-    dm_args->buffer = buffer;
-    dm_args->map_filename = "room_sensor.map";
 
-    if (pthread_create(&dm_tid, NULL, datamgr_thread, dm_args) != 0) {
-        fprintf(stderr, "pthread_create(DM) failed\n");
-        free(dm_args);
+    //Start DM
+    pthread_t dm_tid[SBUFFER_MAX_SHARDS];
+    int dm_started = 0;
+    for (int k = 0; k < nworkers; k++) {
+        datamgr_args_t *dm_args = malloc(sizeof(*dm_args));
+        if (!dm_args) {
+            fprintf(stderr, "malloc(dm_args) failed\n");
+            break;
+        }
+        dm_args->buffer = buffer;
+        dm_args->reader = dm_reader[k];
+        dm_args->shard = k;
+        dm_args->nshards = nworkers;
+        dm_args->map_filename = "room_sensor.map";
+
+        if (pthread_create(&dm_tid[k], NULL, datamgr_thread, dm_args) != 0) {
+            fprintf(stderr, "pthread_create(DM) failed\n");
+            free(dm_args);
+            break;
+        }
+        dm_started++;
+    }
+    if (dm_started < nworkers) {
         sbuffer_close(buffer);
+        for (int k = 0; k < dm_started; k++) {pthread_join(dm_tid[k], NULL);}
         sbuffer_free(&buffer);
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
     }
-	log_event("Data manager thread started");
+    if (nworkers == 1) {log_event("Data manager thread started");}
+    else {log_event("Data manager started with %d workers", nworkers);}
 
 	//Start SM
     pthread_t sm_tid;
@@ -194,21 +371,27 @@ int main(int argc, char **argv) {
     if (!sm_args) {
         fprintf(stderr, "malloc(sm_args) failed\n");
         sbuffer_close(buffer);
-        pthread_join(dm_tid, NULL);
+        for (int k = 0; k < nworkers; k++) {pthread_join(dm_tid[k], NULL);}
         sbuffer_free(&buffer);
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
     }
     sm_args->buffer      = buffer;
-    sm_args->csv_filename = "data.csv";
+    sm_args->reader      = sm_reader;
+    sm_args->csv_filename = (format == DB_FORMAT_SEGMENT) ? "data.seg" : "data.csv";
+    sm_args->writer = (db_writer_config_t){.format = format, .buffer_size = (size_t)writer_bytes, .max_delay_ms = (int)flush_ms, .sync = sync_db,
+                                              .file_size = (size_t)file_bytes};
+    sm_args->wal = wal;
 
     if (pthread_create(&sm_tid, NULL, storagemgr_thread, sm_args) != 0) {
         fprintf(stderr, "pthread_create(SM) failed\n");
         free(sm_args);
         sbuffer_close(buffer);
-        pthread_join(dm_tid, NULL);//if crash
+        for (int k = 0; k < nworkers; k++) {pthread_join(dm_tid[k], NULL);}//if crash
         sbuffer_free(&buffer);
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
@@ -217,13 +400,16 @@ int main(int argc, char **argv) {
 
     //Start CM
     pthread_t conn_tid;
-    connmgr_args_t conn_args = {.port = port, .max_conn = max_conn,.buffer = buffer};
+    connmgr_args_t conn_args = {.port = port, .max_conn = max_conn,.buffer = buffer, .reactors = (int)reactors,
+                                 .continuous = continuous, .acceptors = (int)acceptors, .backlog = (int)backlog,
+                                 .udp_port = (int)udp_port};
     if (connmgr_start(&conn_tid, &conn_args) != 0) {
         fprintf(stderr, "connmgr_start failed\n");
         sbuffer_close(buffer);
-        pthread_join(dm_tid, NULL);
+        for (int k = 0; k < nworkers; k++) {pthread_join(dm_tid[k], NULL);}
         pthread_join(sm_tid, NULL);
         sbuffer_free(&buffer);
+        if (wal != NULL) {wal_close(&wal);}
         close(pipefd[1]);
         waitpid(log_pid, &status, 0);
         return EXIT_FAILURE;
@@ -231,10 +417,21 @@ int main(int argc, char **argv) {
 	log_event("Connection manager thread started");
 
     pthread_join(conn_tid, NULL);
-    pthread_join(dm_tid, NULL);
+    for (int k = 0; k < nworkers; k++) {pthread_join(dm_tid[k], NULL);}
     pthread_join(sm_tid, NULL);
 
     datamgr_free();
+    if (wal != NULL && wal_close(&wal) != WAL_SUCCESS) {
+        fprintf(stderr, "wal_close failed\n");
+    }
+
+    sbuffer_stats_t bs;
+    if (sbuffer_get_stats(buffer, &bs) == SBUFFER_SUCCESS) {
+        log_event("Buffer stats: capacity=%zu high_water=%llu shards=%zu policy=%s inserted=%llu dropped_oldest=%llu dropped_newest=%llu spilled=%llu blocked=%llu (%.3f s)",
+                  bs.capacity, (unsigned long long)bs.high_water, bs.shards, sbuffer_policy_name(bs.policy), (unsigned long long)bs.inserted,
+                  (unsigned long long)bs.dropped_oldest, (unsigned long long)bs.dropped_newest,
+                  (unsigned long long)bs.spilled, (unsigned long long)bs.blocked, bs.blocked_ns / 1e9);
+    }
 	log_event("Sensor gateway shutting down");
     close(pipefd[1]);
     if (waitpid(log_pid, &status, 0) < 0) {
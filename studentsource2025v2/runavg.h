@@ -0,0 +1,59 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _RUNAVG_H_
+#define _RUNAVG_H_
+
+#include <stdint.h>
+#include "config.h"
+
+//Running average over the last N samples in O(1) per sample: the running sum loses the evicted sample and gains the new one
+//Every subtraction leaves a rounding error in the sum, so the sum is Kahan-compensated
+//(https://en.wikipedia.org/wiki/Kahan_summation_algorithm) and recomputed from the ring every RESYNC samples, which bounds
+//the drift however long a sensor runs
+//N is a compile-time constant: RUNAVG_DEFINE(name, N, RESYNC) generates a window type name_t and its functions for
+//exactly that length (the resync loop unrolls), a sensor can hold several windows of different types
+//(e.g. RUNAVG_DEFINE(runavg5, 5, 1024) and RUNAVG_DEFINE(runavg60, 60, 1024))
+//A zeroed window is empty; nothing to free
+
+static inline void runavg_kahan_add(double *sum, double *comp, double x) {
+    double const y = x - *comp;
+    double const t = *sum + y;
+    *comp = (t - *sum) - y;
+    *sum = t;
+}
+
+#define RUNAVG_DEFINE(name, N, RESYNC)                                                          \
+    typedef struct {                                                                            \
+        sensor_value_t ring[N];                                                                 \
+        double sum;            /* of ring */                                                    \
+        double comp;           /* Kahan compensation of sum */                                  \
+        uint32_t index;        /* next slot of ring */                                          \
+        uint32_t count;        /* samples in ring, at most N */                                 \
+        uint32_t since_resync; /* samples since sum was recomputed */                           \
+    } name##_t;                                                                                 \
+                                                                                                \
+    static inline void name##_resync(name##_t *w) {                                             \
+        double sum = 0.0, comp = 0.0;                                                           \
+        for (int i = 0; i < (N); i++) {runavg_kahan_add(&sum, &comp, w->ring[i]);}              \
+        w->sum = sum;                                                                           \
+        w->comp = comp;                                                                         \
+        w->since_resync = 0;                                                                    \
+    }                                                                                           \
+                                                                                                \
+    static inline void name##_push(name##_t *w, sensor_value_t value) {                         \
+        sensor_value_t const evicted = w->ring[w->index]; /* 0 while the ring is filling */     \
+        w->ring[w->index] = value;                                                              \
+        w->index = (w->index + 1 == (N)) ? 0 : w->index + 1;                                    \
+        if (w->count < (N)) {w->count++;}                                                       \
+        if (++w->since_resync >= (RESYNC)) {name##_resync(w);return;}                           \
+        runavg_kahan_add(&w->sum, &w->comp, (double)value - (double)evicted);                   \
+    }                                                                                           \
+                                                                                                \
+    /* 1 once N samples were pushed */                                                          \
+    static inline int name##_full(const name##_t *w) {return w->count == (N);}                  \
+                                                                                                \
+    /* average of the last N samples, only meaningful when full */                              \
+    static inline sensor_value_t name##_avg(const name##_t *w) {return (sensor_value_t)(w->sum / (N));}
+
+#endif //_RUNAVG_H_
@@ -1,185 +1,1016 @@
 /**
  * \author {Bert Lagaisse + Diego Vallés}
  */
+#define _GNU_SOURCE // syscall(), pread/pwrite, clock_gettime
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+#ifdef SBUFFER_LOCKFREE
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include "sbuffer.h"
-//Garbage collection removes fully read nodes: https://learn.microsoft.com/fr-fr/dotnet/standard/garbage-collection/fundamentals; https://maplant.com/2020-04-25-Writing-a-Simple-Garbage-Collector-in-C.html
-//Would be nice to add Inline to make checks faster and avoid slowing the program: https://learn.microsoft.com/fr-fr/cpp/cpp/inline-functions-cpp?view=msvc-170
+//Ring buffer with one cursor per registered reader instead of a linked list with read flags:
+//https://en.wikipedia.org/wiki/Circular_buffer; https://www.kernel.org/doc/html/latest/core-api/circular-buffers.html
+//Sequence numbers only grow (64 bit never wraps in practice), slot index = seq & (capacity - 1)
+//Every slot carries a countdown of the readers that still have to copy it, the last one frees it:
+//reclaim does not depend on how many readers are registered
+//The slots are the record pool: allocated (and touched) once at init, reused in place, so the steady state does no heap allocation
+//sbuffer_t is a set of such rings (shards), see the end of this file
 //Static to avoid use from other files
+_Static_assert((SBUFFER_CAPACITY & (SBUFFER_CAPACITY - 1)) == 0, "SBUFFER_CAPACITY must be a power of two");
+
+#define SBUFFER_SPILL_DEFAULT "sbuffer.spill"
+
+//every publish in a ring also wakes the all-shards readers sleeping on the sbuffer_t that owns it
+static void wake_waiters(sbuffer_t *buffer, bool always);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//Readers wait until a deadline in now_ns() time: SBUFFER_NO_WAIT returns at once, SBUFFER_WAIT_FOREVER blocks
+//The condition variables readers sleep on run on CLOCK_MONOTONIC too, a wall clock change does not move a deadline
+#define SBUFFER_NO_WAIT 0
+#define SBUFFER_WAIT_FOREVER UINT64_MAX
+
+static bool expired(uint64_t deadline) {
+    return deadline != SBUFFER_WAIT_FOREVER && (deadline == SBUFFER_NO_WAIT || now_ns() >= deadline);
+}
+
+static int cond_init_monotonic(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) {return -1;}
+    int rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (rc == 0) {rc = pthread_cond_init(cond, &attr);}
+    pthread_condattr_destroy(&attr);
+    return rc;
+}
+
+static void cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline) {
+    if (deadline == SBUFFER_WAIT_FOREVER) {pthread_cond_wait(cond, mutex);return;}
+    struct timespec const ts = {.tv_sec = (time_t)(deadline / 1000000000ull), .tv_nsec = (long)(deadline % 1000000000ull)};
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+//records: rounded up to a power of two; bytes: rounded down so the slots never exceed the cap
+static uint64_t config_capacity(const sbuffer_config_t *config, size_t slot_size) {
+    uint64_t cap = SBUFFER_CAPACITY;
+    if (config != NULL && config->capacity_bytes > 0) {
+        uint64_t records = config->capacity_bytes / slot_size;
+        cap = 2;
+        while (cap * 2 <= records) {cap *= 2;}
+    } else if (config != NULL && config->capacity > 0) {
+        cap = 2;
+        while (cap < config->capacity) {cap *= 2;}
+    }
+    return cap;
+}
+
+#ifdef SBUFFER_LOCKFREE
+//Lock-free mode (make ... SBUFFER_FLAGS=-DSBUFFER_LOCKFREE): no mutex on the hot path, C11 atomics only
+//Sequence-numbered slots (Vyukov bounded queue): https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//slot.seq == pos       -> free, the producer holding ticket 'pos' may write it
+//slot.seq == pos + 1   -> published, readers at cursor 'pos' may copy it
+//the last reader to copy a slot hands it to the next lap: slot.seq = pos + capacity
+//Parked threads sleep on a futex word, which is only woken when somebody is parked: https://man7.org/linux/man-pages/man2/futex.2.html
+//Only the BLOCK and DROP_NEWEST policies: dropping the oldest or spilling would need to move the readers' cursors
+#define SBUFFER_SPIN 64 // cheap re-checks before parking on the futex
+#define CACHE_LINE 64
+
+typedef struct {
+    _Atomic uint64_t seq;
+    atomic_int pending; // readers that still have to copy this slot
+    sensor_data_t data;
+} sbuffer_slot_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t pos; // only written by its own reader thread
+} sbuffer_cursor_t;
+
 /**
- * basic node for the buffer, these nodes are linked together to create the buffer
+ * a structure to keep track of the ring
+ * hot counters on their own cache line to avoid false sharing between producers and readers
  */
-typedef struct sbuffer_node {
-    struct sbuffer_node *next;
+typedef struct sbuffer_ring {
+    sbuffer_slot_t *slots;
+    uint64_t capacity;
+    sbuffer_policy_t policy;
+    sbuffer_t *owner;
+    _Alignas(CACHE_LINE) _Atomic uint64_t tail; // next ticket for a producer
+    sbuffer_cursor_t cursor[SBUFFER_MAX_READERS]; // one cache line per reader
+    atomic_int nreaders;
+    _Alignas(CACHE_LINE) _Atomic uint32_t data_seq; // futex word: bumped on every publish
+    atomic_int readers_parked;
+    _Alignas(CACHE_LINE) _Atomic uint32_t space_seq; // futex word: bumped when a slot is handed back
+    atomic_int producers_parked;
+    _Alignas(CACHE_LINE) atomic_int inflight; // producers between the closed check and their publish
+    atomic_bool closed;
+    _Alignas(CACHE_LINE) _Atomic uint64_t inserted; // counters for sbuffer_get_stats
+    _Atomic uint64_t dropped_newest;
+    _Atomic uint64_t blocked;
+    _Atomic uint64_t blocked_ns;
+    _Atomic uint64_t high_water;
+} sbuffer_ring_t;
+
+//FUTEX_WAIT takes a relative timeout on CLOCK_MONOTONIC
+static void futex_wait(_Atomic uint32_t *word, uint32_t expected, uint64_t deadline) {
+    struct timespec rel, *timeout = NULL;
+    if (deadline != SBUFFER_WAIT_FOREVER) {
+        uint64_t const now = now_ns();
+        if (now >= deadline) {return;}
+        rel = (struct timespec){.tv_sec = (time_t)((deadline - now) / 1000000000ull), .tv_nsec = (long)((deadline - now) % 1000000000ull)};
+        timeout = &rel;
+    }
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline sbuffer_slot_t *slot_at(sbuffer_ring_t *ring, uint64_t seq) {
+    return &ring->slots[seq & (ring->capacity - 1)];
+}
+
+//Readers only return NO_DATA once closed and no producer can still publish: claimed tickets are always published
+static bool drained(sbuffer_ring_t *ring, sbuffer_slot_t *slot, uint64_t pos) {
+    return atomic_load(&ring->closed) && atomic_load(&ring->inflight) == 0
+           && atomic_load(&slot->seq) != pos + 1;
+}
+
+static int ring_init(sbuffer_ring_t **ring, const sbuffer_config_t *config) {
+    if (ring == NULL) {return SBUFFER_FAILURE;}
+    sbuffer_policy_t policy = (config != NULL) ? config->policy : SBUFFER_POLICY_BLOCK;
+    if (policy != SBUFFER_POLICY_BLOCK && policy != SBUFFER_POLICY_DROP_NEWEST) {
+        fprintf(stderr, "sbuffer: overflow policy not available in lock-free mode\n");
+        return SBUFFER_FAILURE;
+    }
+
+    *ring = aligned_alloc(CACHE_LINE, sizeof(sbuffer_ring_t));
+    if (*ring == NULL) {return SBUFFER_FAILURE;}
+    (*ring)->capacity = config_capacity(config, sizeof(sbuffer_slot_t));
+    (*ring)->policy = policy;
+    (*ring)->slots = malloc((*ring)->capacity * sizeof(sbuffer_slot_t));
+    if ((*ring)->slots == NULL) {free(*ring);*ring = NULL;return SBUFFER_FAILURE;}
+    for (uint64_t i = 0; i < (*ring)->capacity; i++) {
+        atomic_init(&(*ring)->slots[i].seq, i);
+        atomic_init(&(*ring)->slots[i].pending, 0);
+    }
+    atomic_init(&(*ring)->tail, 0);
+    for (int r = 0; r < SBUFFER_MAX_READERS; r++) {atomic_init(&(*ring)->cursor[r].pos, 0);}
+    atomic_init(&(*ring)->nreaders, 0);
+    atomic_init(&(*ring)->data_seq, 0);
+    atomic_init(&(*ring)->readers_parked, 0);
+    atomic_init(&(*ring)->space_seq, 0);
+    atomic_init(&(*ring)->producers_parked, 0);
+    atomic_init(&(*ring)->inflight, 0);
+    atomic_init(&(*ring)->closed, false);
+    atomic_init(&(*ring)->inserted, 0);
+    atomic_init(&(*ring)->dropped_newest, 0);
+    atomic_init(&(*ring)->blocked, 0);
+    atomic_init(&(*ring)->blocked_ns, 0);
+    atomic_init(&(*ring)->high_water, 0);
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_register_reader(sbuffer_ring_t *ring, sbuffer_reader_t *reader) {
+    if (ring == NULL || reader == NULL) {return SBUFFER_FAILURE;}
+    if (atomic_load(&ring->tail) != 0) {return SBUFFER_FAILURE;} // published slots already counted the old readers
+
+    int id = atomic_fetch_add(&ring->nreaders, 1);
+    if (id >= SBUFFER_MAX_READERS) {
+        atomic_fetch_sub(&ring->nreaders, 1);
+        return SBUFFER_FAILURE;
+    }
+    *reader = id;
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_free(sbuffer_ring_t **ring) {
+    if ((ring == NULL) || (*ring == NULL)) {return SBUFFER_FAILURE;}
+    free((*ring)->slots);
+    free(*ring);
+    *ring = NULL;
+    return SBUFFER_SUCCESS;
+}
+
+static void wake_readers(sbuffer_ring_t *ring) {
+    atomic_fetch_add(&ring->data_seq, 1);
+    if (atomic_load(&ring->readers_parked) > 0) {futex_wake_all(&ring->data_seq);}
+    wake_waiters(ring->owner, false);
+}
+
+//returns SBUFFER_SUCCESS with *got == 0 instead of waiting on an empty ring past 'deadline'
+static int ring_remove_batch(sbuffer_ring_t *ring, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got, uint64_t deadline) {
+    if (ring == NULL || out == NULL || got == NULL || max == 0) return SBUFFER_FAILURE;
+    if (reader < 0 || reader >= atomic_load(&ring->nreaders)) return SBUFFER_FAILURE;
+    *got = 0;
+
+    uint64_t pos = atomic_load_explicit(&ring->cursor[reader].pos, memory_order_relaxed);
+    sbuffer_slot_t *slot = slot_at(ring, pos);
+
+    int spin = 0;
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        if (drained(ring, slot, pos)) {return SBUFFER_NO_DATA;}
+        if (deadline == SBUFFER_NO_WAIT) {return SBUFFER_SUCCESS;}
+        if (spin++ < SBUFFER_SPIN) {continue;}
+        if (expired(deadline)) {return SBUFFER_SUCCESS;}
+
+        uint32_t seen = atomic_load(&ring->data_seq);
+        atomic_fetch_add(&ring->readers_parked, 1);
+        if (atomic_load(&slot->seq) != pos + 1 && !drained(ring, slot, pos)) {
+            futex_wait(&ring->data_seq, seen, deadline);
+        }
+        atomic_fetch_sub(&ring->readers_parked, 1);
+    }
+
+    //take every consecutive published slot, not only the first one
+    size_t n = 0;
+    do {
+        out[n] = slot->data;
+        n++;
+        slot = slot_at(ring, pos + n);
+    } while (n < max && atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + n + 1);
+    atomic_store_explicit(&ring->cursor[reader].pos, pos + n, memory_order_relaxed);
+
+    //last reader hands the slot to the producer of the next lap
+    bool freed = false;
+    for (size_t i = 0; i < n; i++) {
+        slot = slot_at(ring, pos + i);
+        if (atomic_fetch_sub_explicit(&slot->pending, 1, memory_order_acq_rel) == 1) {
+            atomic_store_explicit(&slot->seq, pos + i + ring->capacity, memory_order_release);
+            freed = true;
+        }
+    }
+    if (freed) {
+        atomic_fetch_add(&ring->space_seq, 1);
+        if (atomic_load(&ring->producers_parked) > 0) {futex_wake_all(&ring->space_seq);}
+    }
+    *got = n;
+    return SBUFFER_SUCCESS;
+}
+
+static void publish(sbuffer_ring_t *ring, sbuffer_slot_t *slot, uint64_t pos, const sensor_data_t *data, int nreaders) {
+    if (nreaders == 0) { // nobody to deliver to: hand the slot straight to the next lap
+        atomic_store_explicit(&slot->seq, pos + ring->capacity, memory_order_release);
+        return;
+    }
+    slot->data = *data;
+    atomic_store_explicit(&slot->pending, nreaders, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+//High-water mark: slots between the slowest cursor and 'end', once per batch (a few relaxed loads, CAS only on a new peak)
+static void note_high_water(sbuffer_ring_t *ring, uint64_t end, int nreaders) {
+    if (nreaders == 0) {return;}
+    uint64_t slowest = end;
+    for (int r = 0; r < nreaders; r++) {
+        uint64_t pos = atomic_load_explicit(&ring->cursor[r].pos, memory_order_relaxed);
+        if (pos < slowest) {slowest = pos;}
+    }
+    uint64_t used = end - slowest;
+    if (used > ring->capacity) {used = ring->capacity;} // 'end' may still wait for a free slot
+    uint64_t peak = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    while (used > peak && !atomic_compare_exchange_weak_explicit(&ring->high_water, &peak, used,
+                                                                  memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+//DROP_NEWEST: only take a ticket when its slot is already free (CAS instead of fetch_add), otherwise drop the record
+static size_t insert_or_drop(sbuffer_ring_t *ring, const sensor_data_t *arr, size_t n, int nreaders) {
+    size_t inserted = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        sbuffer_slot_t *slot;
+        bool full = false;
+        while (1) {
+            slot = slot_at(ring, pos);
+            int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak(&ring->tail, &pos, pos + 1)) {break;}
+            } else if (diff < 0) {
+                full = true; // still owned by a reader of the previous lap
+                break;
+            } else {
+                pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            }
+        }
+        if (full) {
+            atomic_fetch_add_explicit(&ring->dropped_newest, 1, memory_order_relaxed);
+            continue;
+        }
+        publish(ring, slot, pos, &arr[i], nreaders);
+        inserted++;
+    }
+    return inserted;
+}
+
+static int ring_insert_batch(sbuffer_ring_t *ring, const sensor_data_t *arr, size_t n) {
+    if (ring == NULL || arr == NULL) return SBUFFER_FAILURE;
+    if (n == 0) return SBUFFER_SUCCESS;
+
+    atomic_fetch_add(&ring->inflight, 1);
+    if (atomic_load(&ring->closed)) {
+        atomic_fetch_sub(&ring->inflight, 1);
+        wake_readers(ring); // a reader that saw our inflight after the close parked on it, it has to recheck drained()
+        return SBUFFER_FAILURE;
+    }
+
+    int const nreaders = atomic_load(&ring->nreaders);
+    if (ring->policy == SBUFFER_POLICY_DROP_NEWEST) {
+        size_t inserted = insert_or_drop(ring, arr, n, nreaders);
+        atomic_fetch_sub(&ring->inflight, 1);
+        atomic_fetch_add_explicit(&ring->inserted, inserted, memory_order_relaxed);
+        if (inserted > 0) {note_high_water(ring, atomic_load_explicit(&ring->tail, memory_order_relaxed), nreaders);}
+        wake_readers(ring); // also with nothing inserted: the inflight drop may be what a closing reader waits for
+        return SBUFFER_SUCCESS;
+    }
+
+    //one ticket range for the whole batch: the records stay contiguous in the ring
+    uint64_t first = atomic_fetch_add(&ring->tail, (uint64_t)n);
+    size_t woken = 0;
+    uint64_t blocked_since = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t pos = first + i;
+        sbuffer_slot_t *slot = slot_at(ring, pos);
+
+        //Full ring: wait until every reader handed this slot back, even after close (the readers keep draining)
+        int spin = 0;
+        while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+            if (spin++ < SBUFFER_SPIN) {continue;}
+            if (blocked_since == 0) {blocked_since = now_ns();}
+            //readers must see what is already published, they are the ones that free the slot we wait for
+            if (woken < i) {wake_readers(ring);woken = i;}
+
+            uint32_t seen = atomic_load(&ring->space_seq);
+            atomic_fetch_add(&ring->producers_parked, 1);
+            if (atomic_load(&slot->seq) != pos) {futex_wait(&ring->space_seq, seen, SBUFFER_WAIT_FOREVER);}
+            atomic_fetch_sub(&ring->producers_parked, 1);
+        }
+        publish(ring, slot, pos, &arr[i], nreaders);
+    }
+    atomic_fetch_sub(&ring->inflight, 1);
+
+    atomic_fetch_add_explicit(&ring->inserted, n, memory_order_relaxed);
+    note_high_water(ring, first + n, nreaders);
+    if (blocked_since != 0) {
+        atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ring->blocked_ns, now_ns() - blocked_since, memory_order_relaxed);
+    }
+    wake_readers(ring);
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_close(sbuffer_ring_t *ring) {
+    if (ring == NULL) {return SBUFFER_FAILURE;}
+
+    atomic_store(&ring->closed, true);
+    atomic_fetch_add(&ring->data_seq, 1);
+    futex_wake_all(&ring->data_seq);
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_get_stats(sbuffer_ring_t *ring, sbuffer_stats_t *stats) {
+    if (ring == NULL || stats == NULL) {return SBUFFER_FAILURE;}
+    stats->capacity = ring->capacity;
+    stats->policy = ring->policy;
+    stats->inserted = atomic_load_explicit(&ring->inserted, memory_order_relaxed);
+    stats->dropped_oldest = 0;
+    stats->dropped_newest = atomic_load_explicit(&ring->dropped_newest, memory_order_relaxed);
+    stats->spilled = 0;
+    stats->blocked = atomic_load_explicit(&ring->blocked, memory_order_relaxed);
+    stats->blocked_ns = atomic_load_explicit(&ring->blocked_ns, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    return SBUFFER_SUCCESS;
+}
+
+#else
+typedef struct {
     sensor_data_t data;
-    bool read_by_dm;//condition: both dm and sm should have read the value for it to be removed
-    bool read_by_sm;
-} sbuffer_node_t;
+    int pending; // readers that still have to copy this slot
+} sbuffer_slot_t;
 
 /**
- * a structure to keep track of the buffer
+ * a structure to keep track of the ring
  */
-struct sbuffer {
-    sbuffer_node_t *head;
-    sbuffer_node_t *tail;
+typedef struct sbuffer_ring {
+    sbuffer_slot_t *slots; // 'capacity' slots allocated once in ring_init
+    uint64_t capacity; // power of two
+    uint64_t head; // oldest slot not yet read by every reader
+    uint64_t tail; // next slot to write
+    uint64_t cursor[SBUFFER_MAX_READERS]; // next slot to read, one per registered reader
+    int nreaders;
+    sbuffer_policy_t policy;
+    sbuffer_t *owner;
+    int spill_fd; // SBUFFER_POLICY_SPILL: overflow segment, records between spill_rd and spill_wr (byte offsets)
+    off_t spill_rd;
+    off_t spill_wr;
+    bool spill_busy; // a refill is reading the segment with the mutex released
+    char *spill_path;
+    sbuffer_stats_t stats;
     pthread_mutex_t mutex;
-    bool closed; // condition: threads wait for sensor values while the buffer is not closed
+    bool closed; // condition: threads wait for sensor values while the ring is not closed
     pthread_cond_t cond_nempty;
-};
+    pthread_cond_t cond_nfull; // producers wait here while the ring is full
+} sbuffer_ring_t;
 
-//Check if already read by a given reader
-static bool node_read_by(const sbuffer_node_t *n, sbuffer_reader_t reader) {
-    if (reader == SBUFFER_READER_DM) {
-        return n->read_by_dm;
-    } else {
-        return n->read_by_sm;
-    }
+static inline sbuffer_slot_t *slot_at(sbuffer_ring_t *ring, uint64_t seq) {
+    return &ring->slots[seq & (ring->capacity - 1)];
 }
 
-//check if node read by DM
-static void node_mark_read(sbuffer_node_t *n, sbuffer_reader_t reader) {
-    if (reader == SBUFFER_READER_DM) {
-        n->read_by_dm = true;
-    }
-    else {
-        n->read_by_sm = true;
+static inline void note_high_water(sbuffer_ring_t *ring) {
+    if (ring->tail - ring->head > ring->stats.high_water) {ring->stats.high_water = ring->tail - ring->head;}
+}
+
+static bool spill_pending(const sbuffer_ring_t *ring) {
+    return ring->spill_wr > ring->spill_rd;
+}
+
+//Spill: append the overflow to the segment, in order; on error the caller falls back to blocking
+static bool spill_write(sbuffer_ring_t *ring, const sensor_data_t *arr, size_t n) {
+    size_t bytes = n * sizeof(sensor_data_t);
+    if (pwrite(ring->spill_fd, arr, bytes, ring->spill_wr) != (ssize_t)bytes) {
+        fprintf(stderr, "sbuffer: spill write failed\n");
+        return false;
     }
+    ring->spill_wr += (off_t)bytes;
+    ring->stats.inserted += n;
+    ring->stats.spilled += n;
+    return true;
 }
 
-//Node read by both dm and sm => ready to be removed
-static bool node_fully_read(const sbuffer_node_t *n) {
-    return n->read_by_dm && n->read_by_sm;
+//Unspill: refill the free part of the ring from the segment so the readers see the records in insertion order
+//Called with ring->mutex held; the segment is read with one pread per chunk while the mutex is released, spill_busy
+//keeps a second refill (or the truncate) off the range being read. Producers only append after spill_wr meanwhile
+static void spill_refill(sbuffer_ring_t *ring) {
+    sensor_data_t chunk[SBUFFER_DRAIN_BATCH];
+    bool refilled = false;
+    if (ring->spill_busy) {return;}
+    ring->spill_busy = true;
+    while (spill_pending(ring) && ring->tail - ring->head < ring->capacity) {
+        uint64_t space = ring->capacity - (ring->tail - ring->head);
+        uint64_t pending = (uint64_t)(ring->spill_wr - ring->spill_rd) / sizeof(sensor_data_t);
+        size_t want = (space < pending) ? (size_t)space : (size_t)pending;
+        if (want > SBUFFER_DRAIN_BATCH) {want = SBUFFER_DRAIN_BATCH;}
+        off_t offset = ring->spill_rd;
+
+        pthread_mutex_unlock(&ring->mutex);
+        ssize_t rc = pread(ring->spill_fd, chunk, want * sizeof(sensor_data_t), offset);
+        pthread_mutex_lock(&ring->mutex);
+
+        if (rc < (ssize_t)sizeof(sensor_data_t)) {
+            fprintf(stderr, "sbuffer: spill read failed, dropping the segment\n");
+            ring->spill_rd = ring->spill_wr;
+            break;
+        }
+        //a short read or slots taken while unlocked: the rest is read again next time
+        size_t n = (size_t)rc / sizeof(sensor_data_t);
+        space = ring->capacity - (ring->tail - ring->head);
+        if (n > space) {n = (size_t)space;}
+        for (size_t i = 0; i < n; i++) {
+            sbuffer_slot_t *slot = slot_at(ring, ring->tail + i);
+            slot->data = chunk[i];
+            slot->pending = ring->nreaders;
+        }
+        ring->tail += n;
+        ring->spill_rd += (off_t)(n * sizeof(sensor_data_t));
+        if (n > 0) {refilled = true;}
+    }
+    note_high_water(ring);
+    if (!spill_pending(ring) && ring->spill_wr > 0) { // segment drained: start it over
+        ring->spill_rd = 0;
+        ring->spill_wr = 0;
+        if (ftruncate(ring->spill_fd, 0) != 0) {fprintf(stderr, "sbuffer: spill truncate failed\n");}
+    }
+    ring->spill_busy = false;
+    if (ring->nreaders == 0) {ring->head = ring->tail;}
+    pthread_cond_broadcast(&ring->cond_nempty); // also the readers that waited for this refill to finish
+    if (refilled) {wake_waiters(ring->owner, false);}
 }
 
-//Garbage collection:
-static void garbageCollectionFullyRead(sbuffer_t *buffer) {
-    while (buffer->head && node_fully_read(buffer->head)) {
-        sbuffer_node_t *dummy = buffer->head;
-        buffer->head = buffer->head->next;
-        free(dummy);
+//Reclaim: head moves over the slots whose countdown reached 0, each slot is passed once (amortised O(1) per record)
+static void reclaim_read_slots(sbuffer_ring_t *ring) {
+    uint64_t const old_head = ring->head;
+    while (ring->head != ring->tail && slot_at(ring, ring->head)->pending == 0) {
+        ring->head++;
     }
-    if (buffer->head == NULL) {
-        buffer->tail = NULL;
+    if (ring->head != old_head) {
+        if (spill_pending(ring)) {spill_refill(ring);}
+        pthread_cond_broadcast(&ring->cond_nfull);
     }
 }
 
-//Finds the oldest unread node by reader:
-static sbuffer_node_t* find_oldest_unread(sbuffer_t *buffer, sbuffer_reader_t reader) {
-    sbuffer_node_t *dummy = buffer->head;
-    while (dummy) {
-        if (!node_read_by(dummy, reader)) {return dummy;}
-        dummy = dummy->next;
+//DROP_OLDEST: the readers that did not copy the head slot yet skip it
+static void drop_oldest(sbuffer_ring_t *ring) {
+    for (int r = 0; r < ring->nreaders; r++) {
+        if (ring->cursor[r] == ring->head) {ring->cursor[r]++;}
     }
-    return NULL;
+    slot_at(ring, ring->head)->pending = 0;
+    ring->stats.dropped_oldest++;
+    reclaim_read_slots(ring);
 }
 
-int sbuffer_init(sbuffer_t **buffer) {
-    if (buffer == NULL) {return SBUFFER_FAILURE;}
+static int ring_init(sbuffer_ring_t **ring, const sbuffer_config_t *config) {
+    if (ring == NULL) {return SBUFFER_FAILURE;}
 
-    *buffer = malloc(sizeof(sbuffer_t));
-    if (*buffer == NULL) {return SBUFFER_FAILURE;}
-    (*buffer)->head = NULL;
-    (*buffer)->tail = NULL;
-    (*buffer)->closed = false;
+    *ring = malloc(sizeof(sbuffer_ring_t));
+    if (*ring == NULL) {return SBUFFER_FAILURE;}
+    (*ring)->capacity = config_capacity(config, sizeof(sbuffer_slot_t));
+    (*ring)->policy = (config != NULL) ? config->policy : SBUFFER_POLICY_BLOCK;
+    (*ring)->slots = malloc((*ring)->capacity * sizeof(sbuffer_slot_t));
+    if ((*ring)->slots == NULL) {free(*ring);*ring = NULL;return SBUFFER_FAILURE;}
+    //touch every slot now: no page faults on the first lap of the producers either
+    for (uint64_t i = 0; i < (*ring)->capacity; i++) {(*ring)->slots[i].pending = 0;}
+    (*ring)->head = 0;
+    (*ring)->tail = 0;
+    for (int r = 0; r < SBUFFER_MAX_READERS; r++) {(*ring)->cursor[r] = 0;}
+    (*ring)->nreaders = 0;
+    (*ring)->closed = false;
+    (*ring)->spill_fd = -1;
+    (*ring)->spill_rd = 0;
+    (*ring)->spill_wr = 0;
+    (*ring)->spill_busy = false;
+    (*ring)->spill_path = NULL;
+    (*ring)->stats = (sbuffer_stats_t){.capacity = (*ring)->capacity, .policy = (*ring)->policy};
 
-	if (pthread_mutex_init(&(*buffer)->mutex, NULL) != 0) {free(*buffer);*buffer = NULL;return SBUFFER_FAILURE;}
-    if (pthread_cond_init(&(*buffer)->cond_nempty, NULL) != 0) {pthread_mutex_destroy(&(*buffer)->mutex);free(*buffer);*buffer = NULL;return SBUFFER_FAILURE;}
+    if ((*ring)->policy == SBUFFER_POLICY_SPILL) {
+        const char *path = (config->spill_path != NULL) ? config->spill_path : SBUFFER_SPILL_DEFAULT;
+        (*ring)->spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if ((*ring)->spill_fd < 0) {
+            fprintf(stderr, "sbuffer: could not open spill segment %s\n", path);
+            free((*ring)->slots);free(*ring);*ring = NULL;
+            return SBUFFER_FAILURE;
+        }
+        (*ring)->spill_path = realpath(path, NULL); // unlinked again in ring_free
+    }
+
+    if (pthread_mutex_init(&(*ring)->mutex, NULL) != 0 ||
+        cond_init_monotonic(&(*ring)->cond_nempty) != 0 ||
+        pthread_cond_init(&(*ring)->cond_nfull, NULL) != 0) {
+        if ((*ring)->spill_fd >= 0) {close((*ring)->spill_fd);}
+        free((*ring)->spill_path);free((*ring)->slots);free(*ring);*ring = NULL;
+        return SBUFFER_FAILURE;
+    }
 
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_free(sbuffer_t **buffer) {
-    sbuffer_node_t *dummy;
-    if ((buffer == NULL) || (*buffer == NULL)) {return SBUFFER_FAILURE;}
+static int ring_register_reader(sbuffer_ring_t *ring, sbuffer_reader_t *reader) {
+    if (ring == NULL || reader == NULL) {return SBUFFER_FAILURE;}
 
-	pthread_mutex_lock(&(*buffer)->mutex); // locks for critical operation
+    pthread_mutex_lock(&ring->mutex);
+    if (ring->tail != 0 || ring->nreaders >= SBUFFER_MAX_READERS) {
+        pthread_mutex_unlock(&ring->mutex);
+        return SBUFFER_FAILURE;
+    }
+    *reader = ring->nreaders++;
+    pthread_mutex_unlock(&ring->mutex);
+    return SBUFFER_SUCCESS;
+}
 
-    dummy = (*buffer)->head;
-    while (dummy) {
-        sbuffer_node_t *next = dummy->next;
-        free(dummy);
-        dummy = next;
+static int ring_free(sbuffer_ring_t **ring) {
+    if ((ring == NULL) || (*ring == NULL)) {return SBUFFER_FAILURE;}
+
+    pthread_mutex_lock(&(*ring)->mutex); // locks for critical operation
+    free((*ring)->slots);
+    (*ring)->slots = NULL;
+    (*ring)->head = (*ring)->tail;
+    if ((*ring)->spill_fd >= 0) {
+        close((*ring)->spill_fd);
+        if ((*ring)->spill_path != NULL) {unlink((*ring)->spill_path);}
     }
-    (*buffer)->head = NULL;
-    (*buffer)->tail = NULL;
-    pthread_mutex_unlock(&(*buffer)->mutex);
+    free((*ring)->spill_path);
+    pthread_mutex_unlock(&(*ring)->mutex);
 
-    pthread_mutex_destroy(&(*buffer)->mutex);
-    pthread_cond_destroy(&(*buffer)->cond_nempty);
-    free(*buffer);
-    *buffer = NULL;
+    pthread_mutex_destroy(&(*ring)->mutex);
+    pthread_cond_destroy(&(*ring)->cond_nempty);
+    pthread_cond_destroy(&(*ring)->cond_nfull);
+    free(*ring);
+    *ring = NULL;
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, sbuffer_reader_t reader) {
-    if (buffer == NULL || data == NULL) return SBUFFER_FAILURE;
+//returns SBUFFER_SUCCESS with *got == 0 instead of waiting on an empty ring past 'deadline'
+static int ring_remove_batch(sbuffer_ring_t *ring, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got, uint64_t deadline) {
+    if (ring == NULL || out == NULL || got == NULL || max == 0) return SBUFFER_FAILURE;
+    if (reader < 0 || reader >= SBUFFER_MAX_READERS) return SBUFFER_FAILURE;
+    *got = 0;
 
-    pthread_mutex_lock(&buffer->mutex);
+    pthread_mutex_lock(&ring->mutex);
+    if (reader >= ring->nreaders) {
+        pthread_mutex_unlock(&ring->mutex);
+        return SBUFFER_FAILURE;
+    }
 
-    while (1) {
+    while (ring->cursor[reader] == ring->tail) {
+        if (spill_pending(ring) && !ring->spill_busy && ring->tail - ring->head < ring->capacity) {spill_refill(ring);continue;}
+        if (ring->closed==true && !spill_pending(ring)) {
+            pthread_mutex_unlock(&ring->mutex);
+            return SBUFFER_NO_DATA;
+        }
+        if (expired(deadline)) {
+            pthread_mutex_unlock(&ring->mutex);
+            return SBUFFER_SUCCESS;
+        }
+        cond_wait_until(&ring->cond_nempty, &ring->mutex, deadline);
+    }
 
-        garbageCollectionFullyRead(buffer);
+    uint64_t avail = ring->tail - ring->cursor[reader];
+    size_t n = (avail < max) ? (size_t)avail : max;
+    for (size_t i = 0; i < n; i++) {
+        sbuffer_slot_t *slot = slot_at(ring, ring->cursor[reader] + i);
+        out[i] = slot->data;
+        slot->pending--;
+    }
+    ring->cursor[reader] += n;
+    reclaim_read_slots(ring);
 
-        sbuffer_node_t *dummy = find_oldest_unread(buffer, reader);
-        if (dummy != NULL) {
-            *data = dummy->data;
-            node_mark_read(dummy, reader);
-            garbageCollectionFullyRead(buffer);
-            pthread_mutex_unlock(&buffer->mutex);
-            return SBUFFER_SUCCESS;
+    pthread_mutex_unlock(&ring->mutex);
+    *got = n;
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_insert_batch(sbuffer_ring_t *ring, const sensor_data_t *arr, size_t n) {
+    if (ring == NULL || arr == NULL) return SBUFFER_FAILURE;
+    if (n == 0) return SBUFFER_SUCCESS;
+
+    pthread_mutex_lock(&ring->mutex);
+
+    size_t done = 0;
+    while (done < n) {
+        if (ring->closed) {
+            if (done > 0) {pthread_cond_broadcast(&ring->cond_nempty);}
+            pthread_mutex_unlock(&ring->mutex);
+            if (done > 0) {wake_waiters(ring->owner, false);}
+            return SBUFFER_FAILURE;
         }
 
-        if (buffer->closed==true) {
-            pthread_mutex_unlock(&buffer->mutex);
-            return SBUFFER_NO_DATA;
+        //older records still on disk: newer ones go after them to keep the order
+        if (spill_pending(ring) && spill_write(ring, arr + done, n - done)) {
+            done = n;
+            break;
+        }
+
+        if (ring->tail - ring->head == ring->capacity) {
+            sbuffer_policy_t policy = ring->policy;
+            if (policy == SBUFFER_POLICY_DROP_NEWEST) {
+                ring->stats.dropped_newest += n - done;
+                break;
+            }
+            if (policy == SBUFFER_POLICY_DROP_OLDEST && ring->nreaders > 0) {
+                drop_oldest(ring);
+                continue;
+            }
+            if (policy == SBUFFER_POLICY_SPILL && spill_write(ring, arr + done, n - done)) {
+                done = n;
+                break;
+            }
+
+            //BLOCK: the producer (and so its socket) waits until the slowest reader frees a slot
+            uint64_t blocked_since = now_ns();
+            while (!ring->closed && ring->tail - ring->head == ring->capacity) {
+                pthread_cond_broadcast(&ring->cond_nempty); // readers may still be asleep on what we already copied
+                wake_waiters(ring->owner, false);
+                pthread_cond_wait(&ring->cond_nfull, &ring->mutex);
+            }
+            ring->stats.blocked++;
+            ring->stats.blocked_ns += now_ns() - blocked_since;
+            continue;
         }
 
-        pthread_cond_wait(&buffer->cond_nempty, &buffer->mutex);
+        uint64_t space = ring->capacity - (ring->tail - ring->head);
+        size_t k = (n - done < space) ? n - done : (size_t)space;
+        for (size_t i = 0; i < k; i++) {
+            sbuffer_slot_t *slot = slot_at(ring, ring->tail + i);
+            slot->data = arr[done + i];
+            slot->pending = ring->nreaders;
+        }
+        ring->tail += k;
+        ring->stats.inserted += k;
+        done += k;
+        note_high_water(ring);
+        if (ring->nreaders == 0) {ring->head = ring->tail;} // nobody to deliver to
     }
+
+    pthread_cond_broadcast(&ring->cond_nempty);
+    pthread_mutex_unlock(&ring->mutex);
+    wake_waiters(ring->owner, false);
+    return SBUFFER_SUCCESS;
 }
 
-int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data) {
-    if (buffer == NULL || data == NULL) return SBUFFER_FAILURE;
+static int ring_close(sbuffer_ring_t *ring) {
+    if (ring == NULL) {return SBUFFER_FAILURE;}
+
+    pthread_mutex_lock(&ring->mutex);
+    ring->closed = true;
+    pthread_cond_broadcast(&ring->cond_nempty);
+    pthread_cond_broadcast(&ring->cond_nfull);
+    pthread_mutex_unlock(&ring->mutex);
+
+    return SBUFFER_SUCCESS;
+}
+
+static int ring_get_stats(sbuffer_ring_t *ring, sbuffer_stats_t *stats) {
+    if (ring == NULL || stats == NULL) {return SBUFFER_FAILURE;}
 
-    sbuffer_node_t *dummy = malloc(sizeof(sbuffer_node_t));
-    if (dummy == NULL) return SBUFFER_FAILURE;
+    pthread_mutex_lock(&ring->mutex);
+    *stats = ring->stats;
+    pthread_mutex_unlock(&ring->mutex);
+    return SBUFFER_SUCCESS;
+}
 
-    dummy->data = *data;
-    dummy->next = NULL;
-    dummy->read_by_dm = false;
-    dummy->read_by_sm = false;
+#endif //SBUFFER_LOCKFREE
 
-    pthread_mutex_lock(&buffer->mutex);
+//Shards: records go to ring sensor_id % nshards, so all records of one sensor stay in one ring, in order
+//A shard reader (one DM worker) only reads its own ring, an all-shards reader (SM) reads every ring round-robin
+//An all-shards reader with every ring empty sleeps on an event count, producers only pay an atomic load while nobody sleeps:
+//https://github.com/facebook/folly/blob/main/folly/experimental/EventCount.h
+#define SBUFFER_ALL_SHARDS -1
+#define SBUFFER_MAX_HANDLES (SBUFFER_MAX_READERS + SBUFFER_MAX_SHARDS) // every ring is still limited to SBUFFER_MAX_READERS
 
-    if (buffer->closed) {
-        pthread_mutex_unlock(&buffer->mutex);
-        free(dummy);
+typedef struct {
+    int shard; // SBUFFER_ALL_SHARDS or the only ring this reader reads
+    sbuffer_reader_t ring_reader[SBUFFER_MAX_SHARDS]; // handle inside every ring it reads
+    int next; // round-robin start, only touched by the reader thread
+} sbuffer_reader_info_t;
+
+/**
+ * a structure to keep track of the shards
+ */
+struct sbuffer {
+    int nshards;
+    sbuffer_ring_t *rings[SBUFFER_MAX_SHARDS];
+    sbuffer_reader_info_t readers[SBUFFER_MAX_HANDLES];
+    int nreaders;
+    pthread_mutex_t reg_mtx;  // serialises the registrations, taken before the ring mutexes and never inside them
+    pthread_mutex_t wait_mtx; // taken inside a ring mutex by wake_waiters: nothing takes a ring mutex while holding it
+    pthread_cond_t wait_cond;
+    uint64_t wait_gen; // bumped under wait_mtx every time a sleeping reader has to rescan
+    atomic_int waiters;
+    wal_t *wal; // NULL: no write-ahead log
+};
+
+static inline int shard_of(const sbuffer_t *buffer, const sensor_data_t *data) {
+    return (int)(data->id % (sensor_id_t)buffer->nshards);
+}
+
+static void wake_waiters(sbuffer_t *buffer, bool always) {
+    if (buffer->nshards == 1) {return;} // a single ring: every reader sleeps in the ring itself
+    atomic_thread_fence(memory_order_seq_cst); // the publish in the ring before the load of 'waiters'
+    if (!always && atomic_load(&buffer->waiters) == 0) {return;}
+    pthread_mutex_lock(&buffer->wait_mtx);
+    buffer->wait_gen++;
+    pthread_cond_broadcast(&buffer->wait_cond);
+    pthread_mutex_unlock(&buffer->wait_mtx);
+}
+
+int sbuffer_init_config(sbuffer_t **buffer, const sbuffer_config_t *config) {
+    if (buffer == NULL) {return SBUFFER_FAILURE;}
+    size_t nshards = (config != NULL && config->shards > 0) ? config->shards : 1;
+    if (nshards > SBUFFER_MAX_SHARDS) {return SBUFFER_FAILURE;}
+
+    *buffer = malloc(sizeof(sbuffer_t));
+    if (*buffer == NULL) {return SBUFFER_FAILURE;}
+    (*buffer)->nshards = (int)nshards;
+    (*buffer)->nreaders = 0;
+    (*buffer)->wait_gen = 0;
+    (*buffer)->wal = (config != NULL) ? config->wal : NULL;
+    atomic_init(&(*buffer)->waiters, 0);
+    if (pthread_mutex_init(&(*buffer)->reg_mtx, NULL) != 0 || pthread_mutex_init(&(*buffer)->wait_mtx, NULL) != 0 ||
+        cond_init_monotonic(&(*buffer)->wait_cond) != 0) {
+        free(*buffer);*buffer = NULL;
         return SBUFFER_FAILURE;
     }
 
-    if (buffer->tail == NULL) {
-        buffer->head = dummy;
-        buffer->tail = dummy;
+    //the configured capacity is for the whole buffer, split over the rings
+    sbuffer_config_t ring_config = {.capacity = SBUFFER_CAPACITY, .policy = SBUFFER_POLICY_BLOCK};
+    if (config != NULL) {ring_config = *config;}
+    if (ring_config.capacity == 0) {ring_config.capacity = SBUFFER_CAPACITY;}
+    ring_config.capacity = (ring_config.capacity + nshards - 1) / nshards;
+    ring_config.capacity_bytes /= nshards;
+    const char *spill_path = (ring_config.spill_path != NULL) ? ring_config.spill_path : SBUFFER_SPILL_DEFAULT;
+    char path[PATH_MAX];
+
+    for (int k = 0; k < (int)nshards; k++) {
+        if (nshards > 1) { // one segment per ring: "sbuffer.spill.0", "sbuffer.spill.1", ...
+            snprintf(path, sizeof(path), "%s.%d", spill_path, k);
+            ring_config.spill_path = path;
+        }
+        if (ring_init(&(*buffer)->rings[k], &ring_config) != SBUFFER_SUCCESS) {
+            (*buffer)->nshards = k;
+            sbuffer_free(buffer);
+            return SBUFFER_FAILURE;
+        }
+        (*buffer)->rings[k]->owner = *buffer;
+    }
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_init(sbuffer_t **buffer) {
+    return sbuffer_init_config(buffer, NULL);
+}
+
+//Single record calls are batches of one
+int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, sbuffer_reader_t reader) {
+    size_t got;
+    return sbuffer_remove_batch(buffer, data, 1, reader, &got);
+}
+
+int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data) {
+    return sbuffer_insert_batch(buffer, data, 1);
+}
+
+static int register_reader(sbuffer_t *buffer, int shard, sbuffer_reader_t *reader) {
+    if (buffer == NULL || reader == NULL) {return SBUFFER_FAILURE;}
+    if (shard != SBUFFER_ALL_SHARDS && (shard < 0 || shard >= buffer->nshards)) {return SBUFFER_FAILURE;}
+
+    pthread_mutex_lock(&buffer->reg_mtx);
+    if (buffer->nreaders >= SBUFFER_MAX_HANDLES) {
+        pthread_mutex_unlock(&buffer->reg_mtx);
+        return SBUFFER_FAILURE;
     }
-    else{
-        buffer->tail->next = dummy;
-        buffer->tail = dummy;
+    sbuffer_reader_info_t *info = &buffer->readers[buffer->nreaders];
+    info->shard = shard;
+    info->next = 0;
+    for (int k = 0; k < buffer->nshards; k++) {
+        if (shard != SBUFFER_ALL_SHARDS && k != shard) {continue;}
+        //a failure half way leaves extra readers in the first rings: only an error path (records already inserted)
+        if (ring_register_reader(buffer->rings[k], &info->ring_reader[k]) != SBUFFER_SUCCESS) {
+            pthread_mutex_unlock(&buffer->reg_mtx);
+            return SBUFFER_FAILURE;
+        }
     }
+    *reader = buffer->nreaders++;
+    pthread_mutex_unlock(&buffer->reg_mtx);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_register_reader(sbuffer_t *buffer, sbuffer_reader_t *reader) {
+    return register_reader(buffer, SBUFFER_ALL_SHARDS, reader);
+}
+
+int sbuffer_register_shard_reader(sbuffer_t *buffer, int shard, sbuffer_reader_t *reader) {
+    return register_reader(buffer, shard, reader);
+}
+
+int sbuffer_shard_count(const sbuffer_t *buffer) {
+    return (buffer == NULL) ? 0 : buffer->nshards;
+}
 
-    pthread_cond_broadcast(&buffer->cond_nempty);
-    pthread_mutex_unlock(&buffer->mutex);
+int sbuffer_free(sbuffer_t **buffer) {
+    if ((buffer == NULL) || (*buffer == NULL)) {return SBUFFER_FAILURE;}
+    for (int k = 0; k < (*buffer)->nshards; k++) {ring_free(&(*buffer)->rings[k]);}
+    pthread_mutex_destroy(&(*buffer)->reg_mtx);
+    pthread_mutex_destroy(&(*buffer)->wait_mtx);
+    pthread_cond_destroy(&(*buffer)->wait_cond);
+    free(*buffer);
+    *buffer = NULL;
     return SBUFFER_SUCCESS;
 }
+
+//One pass over every ring without blocking, starting after the ring served last time
+//SBUFFER_NO_DATA only when every ring is closed and drained for this reader
+static int scan_shards(sbuffer_t *buffer, sbuffer_reader_info_t *info, sensor_data_t *out, size_t max, size_t *got) {
+    bool drained = true;
+    for (int i = 0; i < buffer->nshards; i++) {
+        int k = (info->next + i) % buffer->nshards;
+        int rc = ring_remove_batch(buffer->rings[k], out, max, info->ring_reader[k], got, SBUFFER_NO_WAIT);
+        if (rc == SBUFFER_FAILURE) {return SBUFFER_FAILURE;}
+        if (rc == SBUFFER_NO_DATA) {continue;}
+        if (*got > 0) {
+            info->next = k + 1; // the other rings go first next time
+            return SBUFFER_SUCCESS;
+        }
+        drained = false;
+    }
+    return drained ? SBUFFER_NO_DATA : SBUFFER_SUCCESS;
+}
+
+static int remove_batch_until(sbuffer_t *buffer, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got,
+                              uint64_t deadline) {
+    if (buffer == NULL || got == NULL) {return SBUFFER_FAILURE;}
+    if (reader < 0 || reader >= buffer->nreaders) {return SBUFFER_FAILURE;}
+    sbuffer_reader_info_t *info = &buffer->readers[reader];
+
+    if (info->shard != SBUFFER_ALL_SHARDS) {
+        return ring_remove_batch(buffer->rings[info->shard], out, max, info->ring_reader[info->shard], got, deadline);
+    }
+    if (buffer->nshards == 1) {
+        return ring_remove_batch(buffer->rings[0], out, max, info->ring_reader[0], got, deadline);
+    }
+
+    while (1) {
+        int rc = scan_shards(buffer, info, out, max, got);
+        if (rc != SBUFFER_SUCCESS || *got > 0 || expired(deadline)) {return rc;}
+
+        //announce the wait before the last rescan: a producer either sees us or published before that rescan
+        atomic_fetch_add(&buffer->waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        pthread_mutex_lock(&buffer->wait_mtx);
+        uint64_t gen = buffer->wait_gen;
+        pthread_mutex_unlock(&buffer->wait_mtx);
+
+        rc = scan_shards(buffer, info, out, max, got);
+        if (rc == SBUFFER_SUCCESS && *got == 0) {
+            pthread_mutex_lock(&buffer->wait_mtx);
+            while (buffer->wait_gen == gen && !expired(deadline)) {
+                cond_wait_until(&buffer->wait_cond, &buffer->wait_mtx, deadline);
+            }
+            pthread_mutex_unlock(&buffer->wait_mtx);
+        }
+        atomic_fetch_sub(&buffer->waiters, 1);
+        if (rc != SBUFFER_SUCCESS || *got > 0) {return rc;}
+    }
+}
+
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got) {
+    return remove_batch_until(buffer, out, max, reader, got, SBUFFER_WAIT_FOREVER);
+}
+
+int sbuffer_remove_batch_timed(sbuffer_t *buffer, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got,
+                               int timeout_ms) {
+    if (timeout_ms < 0) {return remove_batch_until(buffer, out, max, reader, got, SBUFFER_WAIT_FOREVER);}
+    uint64_t const deadline = (timeout_ms == 0) ? SBUFFER_NO_WAIT : now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    return remove_batch_until(buffer, out, max, reader, got, deadline);
+}
+
+int sbuffer_insert_batch(sbuffer_t *buffer, const sensor_data_t *arr, size_t n) {
+    if (buffer == NULL || arr == NULL) {return SBUFFER_FAILURE;}
+    if (n == 0) {return SBUFFER_SUCCESS;}
+    //logged before any reader can see the records: a record in the storage is always in the log too
+    if (buffer->wal != NULL && wal_append(buffer->wal, arr, n) != WAL_SUCCESS) {return SBUFFER_FAILURE;}
+
+    //one connection = one sensor: the whole batch usually goes to one ring
+    int first = shard_of(buffer, &arr[0]);
+    size_t same = 1;
+    while (same < n && shard_of(buffer, &arr[same]) == first) {same++;}
+    if (same == n) {
+        return ring_insert_batch(buffer->rings[first], arr, n);
+    }
+
+    //mixed batch: regroup per ring, keeping the order of the records within every ring
+    int rc = SBUFFER_SUCCESS;
+    sensor_data_t chunk[SBUFFER_DRAIN_BATCH];
+    for (int k = 0; k < buffer->nshards && rc == SBUFFER_SUCCESS; k++) {
+        size_t len = 0;
+        for (size_t i = 0; i < n && rc == SBUFFER_SUCCESS; i++) {
+            if (shard_of(buffer, &arr[i]) != k) {continue;}
+            chunk[len++] = arr[i];
+            if (len == SBUFFER_DRAIN_BATCH) {
+                rc = ring_insert_batch(buffer->rings[k], chunk, len);
+                len = 0;
+            }
+        }
+        if (len > 0 && rc == SBUFFER_SUCCESS) {rc = ring_insert_batch(buffer->rings[k], chunk, len);}
+    }
+    return rc;
+}
+
 int sbuffer_close(sbuffer_t *buffer) {
     if (buffer == NULL) {return SBUFFER_FAILURE;}
+    for (int k = 0; k < buffer->nshards; k++) {ring_close(buffer->rings[k]);}
+    wake_waiters(buffer, true);
+    return SBUFFER_SUCCESS;
+}
 
-    pthread_mutex_lock(&buffer->mutex);
-    buffer->closed = true;
-    pthread_cond_broadcast(&buffer->cond_nempty);
-    pthread_mutex_unlock(&buffer->mutex);
-
+//Sum over the rings
+int sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats) {
+    if (buffer == NULL || stats == NULL) {return SBUFFER_FAILURE;}
+    sbuffer_stats_t total = {0};
+    for (int k = 0; k < buffer->nshards; k++) {
+        sbuffer_stats_t ring_stats;
+        if (ring_get_stats(buffer->rings[k], &ring_stats) != SBUFFER_SUCCESS) {return SBUFFER_FAILURE;}
+        total.capacity += ring_stats.capacity;
+        total.policy = ring_stats.policy;
+        total.inserted += ring_stats.inserted;
+        total.dropped_oldest += ring_stats.dropped_oldest;
+        total.dropped_newest += ring_stats.dropped_newest;
+        total.spilled += ring_stats.spilled;
+        total.blocked += ring_stats.blocked;
+        total.blocked_ns += ring_stats.blocked_ns;
+        total.high_water += ring_stats.high_water;
+    }
+    total.shards = (size_t)buffer->nshards;
+    *stats = total;
     return SBUFFER_SUCCESS;
 }
+
+const char *sbuffer_policy_name(sbuffer_policy_t policy) {
+    switch (policy) {
+        case SBUFFER_POLICY_BLOCK: return "block";
+        case SBUFFER_POLICY_DROP_OLDEST: return "drop-oldest";
+        case SBUFFER_POLICY_DROP_NEWEST: return "drop-newest";
+        case SBUFFER_POLICY_SPILL: return "spill";
+    }
+    return "unknown";
+}
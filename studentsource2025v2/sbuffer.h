@@ -7,19 +7,70 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "config.h"
+#include "wal.h"
 
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
 
+// default number of sensor_data_t slots in the ring, must be a power of two (override with -DSBUFFER_CAPACITY=... or sbuffer_config_t)
+#ifndef SBUFFER_CAPACITY
+#define SBUFFER_CAPACITY 4096
+#endif
+
+// records a consumer (DM, SM) asks for per sbuffer_remove_batch call
+#ifndef SBUFFER_DRAIN_BATCH
+#define SBUFFER_DRAIN_BATCH 256
+#endif
+
+// maximum number of readers (DM, SM, ...) that can register on one buffer
+#ifndef SBUFFER_MAX_READERS
+#define SBUFFER_MAX_READERS 8
+#endif
+
+// maximum number of shards (rings) in one buffer, see sbuffer_config_t.shards
+#ifndef SBUFFER_MAX_SHARDS
+#define SBUFFER_MAX_SHARDS 64
+#endif
+
 typedef struct sbuffer sbuffer_t;
 
-// syntax of enum:https://learn.microsoft.com/fr-fr/cpp/c-language/c-enumeration-declarations?view=msvc-170
-typedef enum readConditions {
-  SBUFFER_READER_DM = 0,
-  SBUFFER_READER_SM = 1
-} sbuffer_reader_t;
+// handle of a registered reader, see sbuffer_register_reader
+typedef int sbuffer_reader_t;
+
+// what sbuffer_insert does when the ring is full
+typedef enum {
+  SBUFFER_POLICY_BLOCK = 0,   // producer waits for a free slot (it stops reading its socket: TCP flow control pushes back)
+  SBUFFER_POLICY_DROP_OLDEST, // the oldest record is discarded for the readers that did not read it yet
+  SBUFFER_POLICY_DROP_NEWEST, // the record being inserted is discarded
+  SBUFFER_POLICY_SPILL        // overflow is appended to a disk segment and read back in order (mutex ring only)
+} sbuffer_policy_t;
+
+typedef struct {
+  size_t capacity;        // in records, rounded up to a power of two (0 = SBUFFER_CAPACITY)
+  size_t capacity_bytes;  // memory cap for the slots, overrides 'capacity' when > 0 (rounded down to a power of two)
+  sbuffer_policy_t policy;
+  const char *spill_path; // SBUFFER_POLICY_SPILL segment file, NULL = "sbuffer.spill" in the working directory
+  size_t shards;          // rings keyed by sensor_id % shards (0 = 1), capacity and capacity_bytes are split over them
+  wal_t *wal;             // every inserted record is appended to this write-ahead log first (wal.h), NULL = none
+} sbuffer_config_t;
+
+// counters to size the buffer from data
+typedef struct {
+  size_t capacity;          // slots actually allocated, over all shards
+  size_t shards;
+  sbuffer_policy_t policy;
+  uint64_t inserted;        // records accepted (in the ring or spilled)
+  uint64_t dropped_oldest;
+  uint64_t dropped_newest;
+  uint64_t spilled;         // records that went through the disk segment
+  uint64_t blocked;         // inserts that had to wait for a free slot
+  uint64_t blocked_ns;      // total time producers spent waiting
+  uint64_t high_water;      // most slots in use at once (sum of the peaks of the shards), compare with 'capacity'
+} sbuffer_stats_t;
 
 /**
  * Allocates and initializes a new shared buffer
@@ -28,6 +79,38 @@ typedef enum readConditions {
  */
 int sbuffer_init(sbuffer_t **buffer);
 
+/**
+ * Allocates and initializes a new shared buffer with a given capacity and overflow policy
+ * In the lock-free mode only SBUFFER_POLICY_BLOCK and SBUFFER_POLICY_DROP_NEWEST are available
+ * \param buffer a double pointer to the buffer that needs to be initialized
+ * \param config the capacity and policy, NULL gives the same buffer as sbuffer_init
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_init_config(sbuffer_t **buffer, const sbuffer_config_t *config);
+
+/**
+ * Registers a new reader of every shard: every record inserted afterwards is delivered to every registered reader
+ * Readers have to be registered before the first insert, a slot is only freed once all of them copied it
+ * A registered reader must keep removing until SBUFFER_NO_DATA, otherwise the producers block once the ring is full
+ * \param buffer a pointer to the buffer that is used
+ * \param reader filled out with the handle to pass to sbuffer_remove/sbuffer_remove_batch
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if SBUFFER_MAX_READERS is reached or records were already inserted
+ */
+int sbuffer_register_reader(sbuffer_t *buffer, sbuffer_reader_t *reader);
+
+/**
+ * Registers a reader of one shard only: it gets the records of the sensors with sensor_id % shards == 'shard', in order
+ * Same rules as sbuffer_register_reader
+ * \param buffer a pointer to the buffer that is used
+ * \param shard the shard to read, 0 <= shard < sbuffer_shard_count(buffer)
+ * \param reader filled out with the handle to pass to sbuffer_remove/sbuffer_remove_batch
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_register_shard_reader(sbuffer_t *buffer, int shard, sbuffer_reader_t *reader);
+
+//number of shards the records are spread over (1 unless sbuffer_config_t.shards was set)
+int sbuffer_shard_count(const sbuffer_t *buffer);
+
 /**
  * All allocated resources are freed and cleaned up
  * \param buffer a double pointer to the buffer that needs to be freed
@@ -40,7 +123,7 @@ int sbuffer_free(sbuffer_t **buffer);
  * \param data a pointer to pre-allocated sensor_data_t space, the data will be copied into this structure. No new memory is allocated for 'data' in this function.
  * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
  */
-// NEW: sbuffer_reader_t reader condition
+// NEW: sbuffer_reader_t reader handle from sbuffer_register_reader
 //Blocks if empty and not closed
 //Returns SBUFFER_NO_DATA only if closed and drained for that reader * \param buffer a pointer to the buffer that is used
 
@@ -48,14 +131,55 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, sbuffer_reader_t read
 
 /**
  * Inserts the sensor data in 'data' at the end of 'buffer' (at the 'tail')
+ * When the ring is full the buffer policy applies: block until the slowest reader frees a slot (default), drop or spill
+ * A dropped record still counts as a successful insert
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be copied into the buffer
  * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
 */
 int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data);
 
+/**
+ * Removes up to 'max' sensor data for 'reader' in one call: takes the lock and signals once for the whole batch
+ * Blocks while nothing is available for 'reader' and the buffer is not closed, then returns everything available (at most 'max')
+ * \param buffer a pointer to the buffer that is used
+ * \param out pre-allocated space for at least 'max' sensor_data_t, the data will be copied into it
+ * \param max the maximum number of records to copy (> 0)
+ * \param reader the reader that consumes the records
+ * \param got set to the number of records copied into 'out'
+ * \return SBUFFER_SUCCESS on success, SBUFFER_NO_DATA only if closed and drained for that reader, SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got);
+
+/**
+ * Like sbuffer_remove_batch, but waits at most 'timeout_ms' for the first record
+ * \param timeout_ms 0 = do not wait at all, < 0 = wait like sbuffer_remove_batch
+ * \return as sbuffer_remove_batch; SBUFFER_SUCCESS with *got == 0 when the timeout expired first
+ */
+int sbuffer_remove_batch_timed(sbuffer_t *buffer, sensor_data_t *out, size_t max, sbuffer_reader_t reader, size_t *got,
+                               int timeout_ms);
+
+/**
+ * Inserts the 'n' sensor data in 'arr' at the tail of 'buffer', in order, taking the lock and signalling once per batch
+ * Applies the buffer policy when the ring is full like sbuffer_insert
+ * \param buffer a pointer to the buffer that is used
+ * \param arr the records to copy into the buffer
+ * \param n the number of records in 'arr'
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred or the buffer was closed before every record was inserted
+ */
+int sbuffer_insert_batch(sbuffer_t *buffer, const sensor_data_t *arr, size_t n);
+
 
 //broadcast to all threads waiting forever
 int sbuffer_close(sbuffer_t *buffer);
 
+/**
+ * Copies the overflow/backpressure counters of 'buffer' into '*stats'
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats);
+
+//"block", "drop-oldest", ... as used on the command line and in the log
+const char *sbuffer_policy_name(sbuffer_policy_t policy);
+
 #endif  //_SBUFFER_H_
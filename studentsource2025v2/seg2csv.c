@@ -0,0 +1,66 @@
+/**
+ * \author {Diego Vallés}
+ */
+//Converts segment files (gateway -o seg, segment.h) back to data.csv rows, block after block
+//Usage: ./seg2csv [-s] <segment file>...
+//  rows go to stdout, the same bytes the csv writer would have written (only grouped per sensor block instead of arrival order)
+//  -s: one line per block from its header and footer only, nothing decoded: sensor,count,min,max,first_ts,last_ts
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "config.h"
+#include "segment.h"
+#include "csv_format.h"
+
+static int convert(const char *path, bool summary, FILE *out) {
+    seg_reader_t *reader = NULL;
+    if (seg_reader_open(&reader, path) != SEG_SUCCESS) {fprintf(stderr, "%s: not a segment file\n", path); return -1;}
+    sensor_data_t *records = NULL;
+    size_t cap = 0, blocks = 0, total = 0;
+    char row[CSV_ROW_MAX];
+    seg_block_t block;
+    int rc;
+    while ((rc = seg_reader_next(reader, &block, !summary)) == SEG_SUCCESS) {
+        blocks++;
+        total += block.count;
+        if (summary) {
+            fprintf(out, "%u,%u,%f,%f,%ld,%ld\n", (unsigned)block.id, (unsigned)block.count, block.min, block.max,
+                    (long)block.first_ts, (long)block.last_ts);
+            continue;
+        }
+        if (block.count > cap) {
+            sensor_data_t *grown = realloc(records, block.count * sizeof(sensor_data_t));
+            if (grown == NULL) {rc = SEG_FAILURE; break;}
+            records = grown;
+            cap = block.count;
+        }
+        if (seg_block_decode(&block, records) != SEG_SUCCESS) {rc = SEG_FAILURE; break;}
+        for (uint32_t i = 0; i < block.count; i++) {
+            fwrite(row, 1, csv_format_row(row, records[i].id, records[i].value, records[i].ts), out);
+        }
+    }
+    free(records);
+    seg_reader_close(&reader);
+    if (rc != SEG_END) {
+        fprintf(stderr, "%s: corrupt or truncated block after %zu blocks (%zu records)\n", path, blocks, total);
+        return -1;
+    }
+    fprintf(stderr, "%s: %zu blocks, %zu records\n", path, blocks, total);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bool summary = false;
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {summary = true; first = 2;}
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [-s] <segment file>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (int i = first; i < argc; i++) {
+        if (convert(argv[i], summary, stdout) != 0) {status = EXIT_FAILURE;}
+    }
+    return status;
+}
@@ -0,0 +1,376 @@
+/**
+ * \author {Diego Vallés}
+ */
+#define _GNU_SOURCE // fseeko
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "segment.h"
+#include "wire.h"
+//Gorilla: Pelkonen et al., "Gorilla: A Fast, Scalable, In-Memory Time Series Database", VLDB 2015, section 4.1
+//https://www.vldb.org/pvldb/vol8/p1816-teller.pdf
+//A sensor reporting at a fixed rate has a delta of delta of 0 (one bit per timestamp), and two close temperatures share
+//sign, exponent and the top of the mantissa, so their XOR only has a few meaningful bits in the middle
+//Every sensor has its own open block (readings of one sensor next to each other: that is what makes the deltas small)
+//An encoder holds the open blocks of every sensor it saw; a closed block is handed to 'emit' and its buffer reused
+static const unsigned char seg_magic[5] = {'S', 'G', 'S', 'E', 'G'};
+static const unsigned char block_magic[4] = {'B', 'L', 'K', '1'};
+
+static void put_u16(unsigned char *p, uint16_t v) {p[0] = (unsigned char)v;p[1] = (unsigned char)(v >> 8);}
+
+static void put_u32(unsigned char *p, uint32_t v) {for (int i = 0; i < 4; i++) {p[i] = (unsigned char)(v >> (8 * i));}}
+
+static void put_u64(unsigned char *p, uint64_t v) {for (int i = 0; i < 8; i++) {p[i] = (unsigned char)(v >> (8 * i));}}
+
+static uint16_t get_u16(const unsigned char *p) {return (uint16_t)(p[0] | (p[1] << 8));}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {v = (v << 8) | p[i];}
+    return v;
+}
+
+static uint64_t value_bits(sensor_value_t value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static sensor_value_t bits_value(uint64_t bits) {
+    sensor_value_t value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void seg_file_header(unsigned char *out) {
+    memcpy(out, seg_magic, sizeof(seg_magic));
+    out[5] = SEG_VERSION;
+    put_u16(out + 6, 0);
+}
+
+//---------------------------------------------------------------- encoder
+
+typedef struct {
+    unsigned char *buf; // header, then the payload
+    size_t len;
+    size_t cap;
+    uint64_t acc; // bits not yet in buf (at most 7 + 32)
+    unsigned nacc;
+    uint32_t count;
+    sensor_ts_t first_ts;
+    sensor_ts_t last_ts;
+    uint64_t last_delta;
+    uint64_t last_value;
+    unsigned lead; // XOR window of the last value written with '11'
+    unsigned trail;
+    int window;    // 0 until the first '11' of the block
+    sensor_value_t min;
+    sensor_value_t max;
+    time_t opened;
+    size_t pos; // in open_ids, while count > 0
+} open_block_t;
+
+struct seg_encoder {
+    open_block_t *blocks[UINT16_MAX + 1]; // by sensor id, allocated at the first reading of the sensor
+    sensor_id_t open_ids[UINT16_MAX + 1];
+    size_t nopen;
+    time_t max_age;
+    time_t next_check;
+};
+
+//room for 'extra' more bytes
+static int block_reserve(open_block_t *b, size_t extra) {
+    if (b->len + extra <= b->cap) {return SEG_SUCCESS;}
+    size_t cap = (b->cap == 0) ? 256 : b->cap;
+    while (cap < b->len + extra) {cap *= 2;}
+    unsigned char *grown = realloc(b->buf, cap);
+    if (grown == NULL) {return SEG_FAILURE;}
+    b->buf = grown;
+    b->cap = cap;
+    return SEG_SUCCESS;
+}
+
+//the 'width' (<= 64) low bits of v, most significant first; the caller reserved room for them
+static void put_bits(open_block_t *b, uint64_t v, unsigned width) {
+    if (width > 32) {
+        put_bits(b, v >> 32, width - 32);
+        width = 32;
+    }
+    b->acc = (b->acc << width) | (v & (width == 32 ? 0xffffffffull : ((1ull << width) - 1)));
+    b->nacc += width;
+    while (b->nacc >= 8) {
+        b->nacc -= 8;
+        b->buf[b->len++] = (unsigned char)(b->acc >> b->nacc);
+    }
+}
+
+static void put_ts(open_block_t *b, sensor_ts_t ts) {
+    uint64_t const delta = (uint64_t)ts - (uint64_t)b->last_ts; // wraps like the decoder
+    uint64_t const dod = delta - b->last_delta;
+    int64_t const d = (int64_t)dod;
+    if (dod == 0) {put_bits(b, 0, 1);}
+    else if (d >= -63 && d <= 64) {put_bits(b, 0x2, 2); put_bits(b, (uint64_t)(d + 63), 7);}
+    else if (d >= -255 && d <= 256) {put_bits(b, 0x6, 3); put_bits(b, (uint64_t)(d + 255), 9);}
+    else if (d >= -2047 && d <= 2048) {put_bits(b, 0xe, 4); put_bits(b, (uint64_t)(d + 2047), 12);}
+    else {put_bits(b, 0xf, 4); put_bits(b, dod, 64);}
+    b->last_delta = delta;
+    b->last_ts = ts;
+}
+
+static void put_value(open_block_t *b, uint64_t bits) {
+    uint64_t const x = bits ^ b->last_value;
+    b->last_value = bits;
+    if (x == 0) {put_bits(b, 0, 1); return;}
+    unsigned lead = (unsigned)__builtin_clzll(x);
+    unsigned const trail = (unsigned)__builtin_ctzll(x);
+    if (lead > 31) {lead = 31;} // 5 bits
+    if (b->window && lead >= b->lead && trail >= b->trail) { // inside the window of the last '11'
+        put_bits(b, 0x2, 2);
+        put_bits(b, x >> b->trail, 64 - b->lead - b->trail);
+        return;
+    }
+    unsigned const len = 64 - lead - trail;
+    put_bits(b, 0x3, 2);
+    put_bits(b, lead, 5);
+    put_bits(b, len - 1, 6);
+    put_bits(b, x >> trail, len);
+    b->lead = lead;
+    b->trail = trail;
+    b->window = 1;
+}
+
+int seg_encoder_init(seg_encoder_t **enc, int max_age_s) {
+    if (enc == NULL) {return SEG_FAILURE;}
+    *enc = calloc(1, sizeof(seg_encoder_t));
+    if (*enc == NULL) {return SEG_FAILURE;}
+    (*enc)->max_age = (max_age_s > 0) ? max_age_s : SEG_BLOCK_MAX_AGE;
+    return SEG_SUCCESS;
+}
+
+static int close_block(seg_encoder_t *enc, sensor_id_t id, seg_emit_t emit, void *ctx) {
+    open_block_t *b = enc->blocks[id];
+    if (block_reserve(b, 1 + SEG_BLOCK_FOOTER_SIZE) != SEG_SUCCESS) {return SEG_FAILURE;}
+    if (b->nacc > 0) {put_bits(b, 0, 8 - b->nacc);} // pad the last byte with zeros
+    memcpy(b->buf, block_magic, sizeof(block_magic));
+    put_u16(b->buf + 4, id);
+    put_u32(b->buf + 6, (uint32_t)(b->len - SEG_BLOCK_HEADER_SIZE));
+    unsigned char *f = b->buf + b->len;
+    put_u32(f, b->count);
+    put_u64(f + 4, value_bits(b->min));
+    put_u64(f + 12, value_bits(b->max));
+    put_u64(f + 20, (uint64_t)b->first_ts);
+    put_u64(f + 28, (uint64_t)b->last_ts);
+    size_t const size = b->len + SEG_BLOCK_FOOTER_SIZE;
+    put_u32(f + 36, wire_crc32c(0, b->buf, size - 4));
+    size_t const count = b->count;
+
+    //the block is empty again (its buffer is kept), out of the open list
+    b->count = 0;
+    b->len = SEG_BLOCK_HEADER_SIZE;
+    b->acc = 0;
+    b->nacc = 0;
+    sensor_id_t const moved = enc->open_ids[--enc->nopen];
+    enc->open_ids[b->pos] = moved;
+    enc->blocks[moved]->pos = b->pos;
+    return emit(ctx, b->buf, size, id, count);
+}
+
+int seg_encoder_add(seg_encoder_t *enc, const sensor_data_t *data, time_t now, seg_emit_t emit, void *ctx) {
+    if (enc == NULL || data == NULL || emit == NULL) {return SEG_FAILURE;}
+    open_block_t *b = enc->blocks[data->id];
+    if (b == NULL) {
+        b = calloc(1, sizeof(open_block_t));
+        if (b == NULL) {return SEG_FAILURE;}
+        b->len = SEG_BLOCK_HEADER_SIZE;
+        enc->blocks[data->id] = b;
+    }
+    if (block_reserve(b, 20) != SEG_SUCCESS) {return SEG_FAILURE;} // one reading: 68 + 77 bits at most
+    uint64_t const bits = value_bits(data->value);
+    if (b->count == 0) {
+        b->pos = enc->nopen;
+        enc->open_ids[enc->nopen++] = data->id;
+        b->opened = now;
+        b->first_ts = b->last_ts = data->ts;
+        b->last_delta = 0;
+        b->last_value = bits;
+        b->window = 0;
+        b->min = b->max = data->value;
+        put_bits(b, (uint64_t)data->ts, 64);
+        put_bits(b, bits, 64);
+    } else {
+        put_ts(b, data->ts);
+        put_value(b, bits);
+        if (data->value < b->min || b->min != b->min) {b->min = data->value;}
+        if (data->value > b->max || b->max != b->max) {b->max = data->value;}
+    }
+    if (++b->count < SEG_BLOCK_RECORDS) {return SEG_SUCCESS;}
+    return close_block(enc, data->id, emit, ctx);
+}
+
+int seg_encoder_close_aged(seg_encoder_t *enc, time_t now, seg_emit_t emit, void *ctx) {
+    if (enc == NULL || emit == NULL) {return SEG_FAILURE;}
+    if (now < enc->next_check) {return SEG_SUCCESS;}
+    enc->next_check = now + 1;
+    for (size_t i = 0; i < enc->nopen;) {
+        sensor_id_t const id = enc->open_ids[i];
+        if (now - enc->blocks[id]->opened < enc->max_age) {i++; continue;}
+        int const rc = close_block(enc, id, emit, ctx); // moves the last open id to i
+        if (rc != SEG_SUCCESS) {return rc;}
+    }
+    return SEG_SUCCESS;
+}
+
+int seg_encoder_close_all(seg_encoder_t *enc, seg_emit_t emit, void *ctx) {
+    if (enc == NULL || emit == NULL) {return SEG_FAILURE;}
+    while (enc->nopen > 0) {
+        int const rc = close_block(enc, enc->open_ids[enc->nopen - 1], emit, ctx);
+        if (rc != SEG_SUCCESS) {return rc;}
+    }
+    return SEG_SUCCESS;
+}
+
+size_t seg_encoder_open_blocks(const seg_encoder_t *enc) {return (enc == NULL) ? 0 : enc->nopen;}
+
+void seg_encoder_free(seg_encoder_t **enc) {
+    if (enc == NULL || *enc == NULL) {return;}
+    for (size_t id = 0; id <= UINT16_MAX; id++) {
+        if ((*enc)->blocks[id] != NULL) {free((*enc)->blocks[id]->buf);}
+        free((*enc)->blocks[id]);
+    }
+    free(*enc);
+    *enc = NULL;
+}
+
+//---------------------------------------------------------------- reader
+
+struct seg_reader {
+    FILE *f;
+    unsigned char *buf; // payload of the last block
+    size_t cap;
+};
+
+int seg_reader_open(seg_reader_t **reader, const char *path) {
+    if (reader == NULL || path == NULL) {return SEG_FAILURE;}
+    *reader = NULL;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {return SEG_FAILURE;}
+    unsigned char header[SEG_FILE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, seg_magic, sizeof(seg_magic)) != 0 ||
+        header[5] != SEG_VERSION) {
+        fclose(f);
+        return SEG_FAILURE;
+    }
+    *reader = calloc(1, sizeof(seg_reader_t));
+    if (*reader == NULL) {fclose(f); return SEG_FAILURE;}
+    (*reader)->f = f;
+    return SEG_SUCCESS;
+}
+
+int seg_reader_next(seg_reader_t *r, seg_block_t *block, bool with_payload) {
+    if (r == NULL || block == NULL) {return SEG_FAILURE;}
+    unsigned char header[SEG_BLOCK_HEADER_SIZE], footer[SEG_BLOCK_FOOTER_SIZE];
+    size_t const got = fread(header, 1, sizeof(header), r->f);
+    if (got == 0 && feof(r->f)) {return SEG_END;}
+    //zeros instead of a block: the preallocated end of a mapped file (db_writer file_size) that a crash left untrimmed
+    if (got > 0 && header[0] == 0 && memcmp(header, header + 1, got - 1) == 0) {return SEG_END;}
+    if (got != sizeof(header) || memcmp(header, block_magic, sizeof(block_magic)) != 0) {return SEG_FAILURE;}
+    size_t const len = get_u32(header + 6);
+
+    block->payload = NULL;
+    block->payload_len = len;
+    if (with_payload) {
+        if (len > r->cap) {
+            unsigned char *grown = realloc(r->buf, len);
+            if (grown == NULL) {return SEG_FAILURE;}
+            r->buf = grown;
+            r->cap = len;
+        }
+        if (fread(r->buf, 1, len, r->f) != len) {return SEG_FAILURE;}
+        block->payload = r->buf;
+    } else if (fseeko(r->f, (off_t)len, SEEK_CUR) != 0) {
+        return SEG_FAILURE;
+    }
+    if (fread(footer, 1, sizeof(footer), r->f) != sizeof(footer)) {return SEG_FAILURE;}
+    if (with_payload) {
+        uint32_t crc = wire_crc32c(0, header, sizeof(header));
+        crc = wire_crc32c(crc, r->buf, len);
+        crc = wire_crc32c(crc, footer, sizeof(footer) - 4);
+        if (crc != get_u32(footer + 36)) {return SEG_FAILURE;}
+    }
+    block->id = get_u16(header + 4);
+    block->count = get_u32(footer);
+    block->min = bits_value(get_u64(footer + 4));
+    block->max = bits_value(get_u64(footer + 12));
+    block->first_ts = (sensor_ts_t)get_u64(footer + 20);
+    block->last_ts = (sensor_ts_t)get_u64(footer + 28);
+    if (block->count == 0) {return SEG_FAILURE;}
+    return SEG_SUCCESS;
+}
+
+void seg_reader_close(seg_reader_t **reader) {
+    if (reader == NULL || *reader == NULL) {return;}
+    fclose((*reader)->f);
+    free((*reader)->buf);
+    free(*reader);
+    *reader = NULL;
+}
+
+typedef struct {
+    const unsigned char *p;
+    size_t len;  // bytes
+    size_t bit;  // next bit to read
+} bit_reader_t;
+
+//'width' (<= 64) bits, most significant first; *ok = 0 past the end of the payload
+static uint64_t get_bits(bit_reader_t *br, unsigned width, int *ok) {
+    if (br->bit + width > br->len * 8) {*ok = 0; return 0;}
+    uint64_t v = 0;
+    for (unsigned i = 0; i < width;) {
+        size_t const byte = br->bit / 8;
+        unsigned const used = (unsigned)(br->bit % 8);
+        unsigned take = 8 - used;
+        if (take > width - i) {take = width - i;}
+        unsigned const chunk = (unsigned)(br->p[byte] >> (8 - used - take)) & ((1u << take) - 1);
+        v = (v << take) | chunk;
+        br->bit += take;
+        i += take;
+    }
+    return v;
+}
+
+int seg_block_decode(const seg_block_t *block, sensor_data_t *out) {
+    if (block == NULL || out == NULL || block->payload == NULL || block->count == 0) {return SEG_FAILURE;}
+    bit_reader_t br = {.p = block->payload, .len = block->payload_len, .bit = 0};
+    int ok = 1;
+    uint64_t ts = get_bits(&br, 64, &ok);
+    uint64_t value = get_bits(&br, 64, &ok);
+    uint64_t delta = 0;
+    unsigned lead = 0, trail = 0;
+    out[0] = (sensor_data_t){.id = block->id, .value = bits_value(value), .ts = (sensor_ts_t)ts};
+    for (uint32_t i = 1; ok && i < block->count; i++) {
+        uint64_t dod = 0;
+        if (get_bits(&br, 1, &ok) == 1) {
+            if (get_bits(&br, 1, &ok) == 0) {dod = get_bits(&br, 7, &ok) - 63;}
+            else if (get_bits(&br, 1, &ok) == 0) {dod = get_bits(&br, 9, &ok) - 255;}
+            else if (get_bits(&br, 1, &ok) == 0) {dod = get_bits(&br, 12, &ok) - 2047;}
+            else {dod = get_bits(&br, 64, &ok);}
+        }
+        delta += dod;
+        ts += delta;
+        if (get_bits(&br, 1, &ok) == 1) {
+            if (get_bits(&br, 1, &ok) == 1) {
+                lead = (unsigned)get_bits(&br, 5, &ok);
+                unsigned const len = (unsigned)get_bits(&br, 6, &ok) + 1;
+                if (lead + len > 64) {return SEG_FAILURE;}
+                trail = 64 - lead - len;
+            }
+            value ^= get_bits(&br, 64 - lead - trail, &ok) << trail;
+        }
+        out[i] = (sensor_data_t){.id = block->id, .value = bits_value(value), .ts = (sensor_ts_t)ts};
+    }
+    return ok ? SEG_SUCCESS : SEG_FAILURE;
+}
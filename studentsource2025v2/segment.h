@@ -0,0 +1,117 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+
+//Columnar segment files, the compact alternative to data.csv (db_writer with DB_FORMAT_SEGMENT, seg2csv reads them back)
+//  file:   'S' 'G' 'S' 'E' 'G' | version u8 | reserved u16 (0), then blocks until the end of the file
+//  block:  readings of one sensor, all integers little endian
+//    magic u32 ("BLK1") | sensor_id u16 | payload_len u32 |
+//    payload: bit stream (most significant bit first), Gorilla encoding:
+//      first reading: ts 64 bits | value 64 bits (IEEE 754)
+//      next readings: delta of delta of ts ('0' | '10' 7 bits | '110' 9 bits | '1110' 12 bits | '1111' 64 bits) |
+//                     value XOR previous value ('0' same | '10' bits inside the last window | '11' leading u5, length-1 u6, bits)
+//    footer: count u32 | min f64 | max f64 | first ts i64 | last ts i64 | crc32c u32 of everything before it in the block
+//A block can be summarised from its header and footer only (payload_len says how much to skip)
+
+#define SEG_SUCCESS 0
+#define SEG_FAILURE -1
+#define SEG_END 1
+
+#define SEG_VERSION 1
+#define SEG_FILE_HEADER_SIZE 8
+#define SEG_BLOCK_HEADER_SIZE 10
+#define SEG_BLOCK_FOOTER_SIZE 40
+
+// readings per block: a full block is closed at once
+#ifndef SEG_BLOCK_RECORDS
+#define SEG_BLOCK_RECORDS 1024
+#endif
+// an open block is closed this long (s) after its first reading, whatever its size
+#ifndef SEG_BLOCK_MAX_AGE
+#define SEG_BLOCK_MAX_AGE 60
+#endif
+
+typedef struct seg_encoder seg_encoder_t;
+
+// called with every closed block, 'size' bytes ready to be written; anything but SEG_SUCCESS is passed on to the caller
+typedef int (*seg_emit_t)(void *ctx, const unsigned char *block, size_t size, sensor_id_t id, size_t count);
+
+typedef struct {
+    sensor_id_t id;
+    uint32_t count;
+    sensor_value_t min; // NaN readings are left out of min/max
+    sensor_value_t max;
+    sensor_ts_t first_ts;
+    sensor_ts_t last_ts;
+    const unsigned char *payload; // NULL when the reader skipped it
+    size_t payload_len;
+} seg_block_t;
+
+typedef struct seg_reader seg_reader_t;
+
+// fills 'out' (SEG_FILE_HEADER_SIZE bytes) with the header of a new segment file
+void seg_file_header(unsigned char *out);
+
+/**
+ * Creates an encoder with no open block
+ * \param max_age_s seconds after which an open block is closed, 0 = SEG_BLOCK_MAX_AGE
+ * \return SEG_SUCCESS on success and SEG_FAILURE if an error occurred
+ */
+int seg_encoder_init(seg_encoder_t **enc, int max_age_s);
+
+/**
+ * Appends one reading to the open block of its sensor, emits the block when it is full
+ * \param now the gateway clock, the age of a block counts from the 'now' of its first reading
+ * \return SEG_SUCCESS, or SEG_FAILURE (out of memory, or what 'emit' returned)
+ */
+int seg_encoder_add(seg_encoder_t *enc, const sensor_data_t *data, time_t now, seg_emit_t emit, void *ctx);
+
+/**
+ * Emits the open blocks older than max_age_s; checks at most once a second
+ * \return SEG_SUCCESS, or what 'emit' returned
+ */
+int seg_encoder_close_aged(seg_encoder_t *enc, time_t now, seg_emit_t emit, void *ctx);
+
+/**
+ * Emits every open block
+ * \return SEG_SUCCESS, or what 'emit' returned
+ */
+int seg_encoder_close_all(seg_encoder_t *enc, seg_emit_t emit, void *ctx);
+
+// number of open blocks
+size_t seg_encoder_open_blocks(const seg_encoder_t *enc);
+
+void seg_encoder_free(seg_encoder_t **enc);
+
+/**
+ * Opens a segment file and checks its header
+ * \return SEG_SUCCESS on success and SEG_FAILURE if the file cannot be read or is not a segment
+ */
+int seg_reader_open(seg_reader_t **reader, const char *path);
+
+/**
+ * Reads the next block
+ * \param with_payload false: only header and footer are read, the payload is skipped (and its CRC not checked)
+ * \param block filled out, its payload stays valid until the next call
+ * \return SEG_SUCCESS, SEG_END at the end of the file or of its written part, SEG_FAILURE for a truncated or corrupt block
+ */
+int seg_reader_next(seg_reader_t *reader, seg_block_t *block, bool with_payload);
+
+void seg_reader_close(seg_reader_t **reader);
+
+/**
+ * Decodes the readings of a block read with its payload
+ * \param out room for block->count readings
+ * \return SEG_SUCCESS, or SEG_FAILURE if the payload does not hold block->count readings
+ */
+int seg_block_decode(const seg_block_t *block, sensor_data_t *out);
+
+#endif //_SEGMENT_H_
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include "sensor_db.h"
+#include "csv_format.h"
 
 // Logger states
 static int pipe_ready = -1;
@@ -99,8 +100,9 @@ FILE * open_db(const char * filename, bool append) {
 int insert_sensor(FILE * f, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
     if( f == NULL ) {return -1;}
 
-    int success = fprintf(f,"%u,%f,%ld\n",id,value,ts);
-    if(success < 0){fprintf(stderr, "Error: data insertion into data.csv failed\n");return -1;}
+    char row[CSV_ROW_MAX];
+    size_t const len = csv_format_row(row, id, value, ts); // the bytes of "%u,%f,%ld\n", without printf
+    if(fwrite(row, 1, len, f) != len){fprintf(stderr, "Error: data insertion into data.csv failed\n");return -1;}
     log_event("Data insertion from sensor %u succeeded", (unsigned)id);
     return 0;
 }
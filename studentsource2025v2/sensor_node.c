@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include "config.h"
 #include "lib/tcpsock.h"
+#include "wire.h"
 
 // conditional compilation option to control the number of measurements this sensor node wil generate
 #if (LOOPS > 1)
@@ -53,8 +54,27 @@
 #define TEMP_DEV        5    // max afwijking vorige temperatuur in 0.1 celsius
 
 
+#define FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t)) // v1 frame
+
 void print_help(void);
 
+//v2 handshake: our hello, then the gateway answers with its own (see wire.h)
+static int v2_handshake(tcpsock_t *client) {
+    unsigned char hello[WIRE_HELLO_SIZE];
+    wire_hello(hello, WIRE_VERSION);
+    int bytes = sizeof(hello);
+    if (tcp_send(client, hello, &bytes) != TCP_NO_ERROR) return -1;
+    int got = 0;
+    while (got < WIRE_HELLO_SIZE) {
+        bytes = WIRE_HELLO_SIZE - got;
+        if (tcp_receive(client, hello + got, &bytes) != TCP_NO_ERROR) return -1;
+        got += bytes;
+    }
+    uint8_t version = 0;
+    if (wire_parse_hello(hello, &version) != WIRE_SUCCESS || version < WIRE_VERSION) return -1;
+    return 0;
+}
+
 /**
  * For starting the sensor node 4 command line arguments are needed. These should be given in the order below
  * and can then be used through the argv[] variable
@@ -63,6 +83,7 @@ void print_help(void);
  * argv[2] = sleep time
  * argv[3] = server IP
  * argv[4] = server port
+ * argv[5] = batch (optional): > 0 switches to protocol v2 and sends one frame per 'batch' measurements
  */
 
 int main(int argc, char *argv[]) {
@@ -70,11 +91,14 @@ int main(int argc, char *argv[]) {
     int server_port;
     char server_ip[] = "000.000.000.000";
     tcpsock_t *client;
-    int i, bytes, sleep_time;
+    int i, bytes, sleep_time, batch = 0;
+    sensor_data_t *pending = NULL;
+    int npending = 0;
+    unsigned char *frame = NULL;
 
     LOG_OPEN();
 
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         print_help();
         exit(EXIT_SUCCESS);
     } else {
@@ -83,30 +107,56 @@ int main(int argc, char *argv[]) {
         sleep_time = atoi(argv[2]);
         strncpy(server_ip, argv[3], strlen(server_ip));
         server_port = atoi(argv[4]);
+        if (argc == 6) batch = atoi(argv[5]);
+        if (batch < 0 || batch > WIRE_V2_MAX_READINGS) {
+            printf("batch must be between 0 and %d\n", WIRE_V2_MAX_READINGS);
+            exit(EXIT_FAILURE);
+        }
     }
 
     srand48(time(NULL));
 
     // open TCP connection to the server; server is listening to SERVER_IP and PORT
     if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+    if (batch > 0) {
+        pending = malloc(batch * sizeof(sensor_data_t));
+        frame = malloc(WIRE_V2_MAX_FRAME);
+        if (pending == NULL || frame == NULL || v2_handshake(client) != 0) exit(EXIT_FAILURE);
+    }
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
         data.value = data.value + TEMP_DEV * ((drand48() - 0.5) / 10);
         time(&data.ts);
-        // send data to server in this order (!!): <sensor_id><temperature><timestamp>
-        // remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void *) &data.id, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void *) &data.value, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void *) &data.ts, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        if (batch > 0) {
+            // v2: readings wait until a frame is full
+            pending[npending++] = data;
+            if (npending == batch) {
+                bytes = (int) wire_v2_encode(frame, pending, npending);
+                if (tcp_send(client, frame, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+                npending = 0;
+            }
+        } else {
+            // v1: send data to server in this order (!!): <sensor_id><temperature><timestamp>
+            // remark: don't send as a struct! one send per frame, not one per field (one segment instead of three)
+            unsigned char v1[FRAME_SIZE];
+            memcpy(v1, &data.id, sizeof(data.id));
+            memcpy(v1 + sizeof(data.id), &data.value, sizeof(data.value));
+            memcpy(v1 + sizeof(data.id) + sizeof(data.value), &data.ts, sizeof(data.ts));
+            bytes = FRAME_SIZE;
+            if (tcp_send(client, v1, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        }
         LOG_PRINTF(data.id, data.value, data.ts);
         sleep(sleep_time);
         UPDATE(i);
     }
 
+    if (npending > 0) { // last, partial frame
+        bytes = (int) wire_v2_encode(frame, pending, npending);
+        if (tcp_send(client, frame, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+    }
+    free(pending);
+    free(frame);
     if (tcp_close(&client) != TCP_NO_ERROR) exit(EXIT_FAILURE);
 
     LOG_CLOSE();
@@ -118,9 +168,10 @@ int main(int argc, char *argv[]) {
  * Helper method to print a message on how to use this application
  */
 void print_help(void) {
-    printf("Use this program with 4 command line options: \n");
+    printf("Use this program with 4 or 5 command line options: \n");
     printf("\t%-15s : a unique sensor node ID\n", "\'ID\'");
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
     printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
     printf("\t%-15s : TCP server port number\n", "\'server port\'");
+    printf("\t%-15s : (optional) measurements per frame, > 0 uses protocol v2\n", "\'batch\'");
 }
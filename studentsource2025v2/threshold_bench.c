@@ -0,0 +1,104 @@
+/**
+ * \author {Diego Vallés}
+ */
+//Microbenchmark of the threshold kernels (thresholds.c) on one core: the per-sensor scalar loop the data manager had
+//against the SSE2 and AVX2 kernels, same data, same results (checked before timing)
+//Usage: ./threshold_bench [averages per call] [changed %] [seconds per kernel]   (default: 256 = one sbuffer batch, 5 %, 1)
+//Every call alternates between two sets of averages that give a different comment to 'changed %' of the sensors
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "config.h"
+#include "thresholds.h"
+
+#define BENCH_MIN 10.0
+#define BENCH_MAX 20.0
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//an average in the band of 'comment', or NaN now and then (never a comment)
+static sensor_value_t in_band(int comment) {
+    double const r = (double)rand() / RAND_MAX;
+    if (comment == -1) {return BENCH_MIN - 5.0 * r - 0.001;}
+    if (comment == +1) {return BENCH_MAX + 5.0 * r + 0.001;}
+    return (rand() % 64 == 0) ? NAN : BENCH_MIN + (BENCH_MAX - BENCH_MIN) * r;
+}
+
+//1 if 'kernel' gives the same comments and changed indices as the scalar kernel on both sets, from the same state
+static int same_as_scalar(threshold_kernel_t kernel, sensor_value_t *const sets[2], size_t n) {
+    threshold_kernel_t const scalar = threshold_kernel("scalar");
+    int8_t *last_a = calloc(n, 1), *last_b = calloc(n, 1);
+    uint32_t *changed_a = malloc(n * sizeof(uint32_t)), *changed_b = malloc(n * sizeof(uint32_t));
+    int same = (last_a != NULL && last_b != NULL && changed_a != NULL && changed_b != NULL);
+    for (int round = 0; same && round < 4; round++) {
+        size_t const count_a = scalar(sets[round & 1], last_a, n, BENCH_MIN, BENCH_MAX, changed_a);
+        size_t const count_b = kernel(sets[round & 1], last_b, n, BENCH_MIN, BENCH_MAX, changed_b);
+        same = count_a == count_b && memcmp(last_a, last_b, n) == 0 &&
+               memcmp(changed_a, changed_b, count_a * sizeof(uint32_t)) == 0;
+    }
+    free(last_a);
+    free(last_b);
+    free(changed_a);
+    free(changed_b);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    size_t const n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 256;
+    int const changed_pct = (argc > 2) ? atoi(argv[2]) : 5;
+    double const seconds = (argc > 3) ? atof(argv[3]) : 1.0;
+    if (n == 0 || changed_pct < 0 || changed_pct > 100 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [averages per call] [changed %%] [seconds per kernel]\n", argv[0]);
+        return 1;
+    }
+
+    sensor_value_t *sets[2] = {malloc(n * sizeof(sensor_value_t)), malloc(n * sizeof(sensor_value_t))};
+    int8_t *last = calloc(n, 1);
+    uint32_t *changed = malloc(n * sizeof(uint32_t));
+    if (sets[0] == NULL || sets[1] == NULL || last == NULL || changed == NULL) {fprintf(stderr, "out of memory\n"); return 1;}
+    srand(1);
+    for (size_t i = 0; i < n; i++) {
+        int const comment = rand() % 3 - 1;
+        sets[0][i] = in_band(comment);
+        sets[1][i] = (rand() % 100 < changed_pct) ? in_band(comment == 1 ? -1 : comment + 1) : in_band(comment);
+    }
+
+    const char *best = NULL;
+    threshold_select(&best);
+    printf("%zu averages per call, %d %% changed, dispatch picks %s\n", n, changed_pct, best);
+    printf("%-7s %12s %10s %9s\n", "kernel", "Mavg/s", "ns/call", "speedup");
+    const char *const names[] = {"scalar", "sse2", "avx2"};
+    double scalar_rate = 0;
+    for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+        threshold_kernel_t const kernel = threshold_kernel(names[k]);
+        if (kernel == NULL) {printf("%-7s %12s\n", names[k], "n/a"); continue;}
+        if (!same_as_scalar(kernel, sets, n)) {printf("%-7s differs from scalar\n", names[k]); return 1;}
+
+        memset(last, 0, n);
+        size_t calls = 0, reported = 0;
+        double const start = now_s();
+        double elapsed = 0;
+        do {
+            for (int i = 0; i < 256; i++, calls++) {
+                reported += kernel(sets[calls & 1], last, n, BENCH_MIN, BENCH_MAX, changed);
+            }
+            elapsed = now_s() - start;
+        } while (elapsed < seconds);
+        double const rate = (double)calls * (double)n / elapsed;
+        if (k == 0) {scalar_rate = rate;}
+        printf("%-7s %12.1f %10.1f %8.2fx   (%zu changes)\n", names[k], rate / 1e6, elapsed * 1e9 / (double)calls,
+               rate / scalar_rate, reported);
+    }
+    free(sets[0]);
+    free(sets[1]);
+    free(last);
+    free(changed);
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * \author {Diego Vallés}
+ */
+#include <string.h>
+#include "thresholds.h"
+//Batch threshold evaluation: 16 averages per step, compared with min/max as 16-bit masks (one bit per average)
+//The previous comments are compared as masks too, only the bits that differ go through the scalar path
+//SSE2 is part of x86-64, AVX2 is checked at run time and compiled with a target attribute: one binary for every CPU
+//https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define THRESHOLDS_X86
+#endif
+
+#define THRESHOLDS_STEP 16
+
+//the original per-reading comparison, and the tail of the vector kernels
+static size_t eval_range(const sensor_value_t *avg, int8_t *last, size_t from, size_t n, double min, double max,
+                         uint32_t *changed) {
+    size_t count = 0;
+    for (size_t i = from; i < n; i++) {
+        int8_t comment = 0;
+        if (avg[i] < min) comment = -1;
+        else if (avg[i] > max) comment = +1;
+        if (comment != last[i]) {
+            last[i] = comment;
+            changed[count++] = (uint32_t)i;
+        }
+    }
+    return count;
+}
+
+static size_t eval_scalar(const sensor_value_t *avg, int8_t *last, size_t n, double min, double max, uint32_t *changed) {
+    return eval_range(avg, last, 0, n, min, max, changed);
+}
+
+#ifdef THRESHOLDS_X86
+//bit k set: last[i + k] == value, for the 16 comments at 'last + i'
+static unsigned last_mask(const int8_t *last, int8_t value) {
+    __m128i const v = _mm_loadu_si128((const __m128i *)last);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(value)));
+}
+
+//new comments from the masks, for the bits of 'diff'
+static size_t emit_changes(int8_t *last, size_t i, unsigned lo, unsigned hi, unsigned diff, uint32_t *changed) {
+    size_t count = 0;
+    while (diff != 0) {
+        unsigned const k = (unsigned)__builtin_ctz(diff);
+        diff &= diff - 1;
+        last[i + k] = (int8_t)(((lo >> k) & 1u) ? -1 : ((hi >> k) & 1u) ? 1 : 0);
+        changed[count++] = (uint32_t)(i + k);
+    }
+    return count;
+}
+
+static size_t eval_sse2(const sensor_value_t *avg, int8_t *last, size_t n, double min, double max, uint32_t *changed) {
+    __m128d const vmin = _mm_set1_pd(min), vmax = _mm_set1_pd(max);
+    size_t count = 0, i = 0;
+    for (; i + THRESHOLDS_STEP <= n; i += THRESHOLDS_STEP) {
+        unsigned lo = 0, hi = 0;
+        for (unsigned k = 0; k < THRESHOLDS_STEP; k += 2) {
+            __m128d const v = _mm_loadu_pd(avg + i + k);
+            lo |= (unsigned)_mm_movemask_pd(_mm_cmplt_pd(v, vmin)) << k;
+            hi |= (unsigned)_mm_movemask_pd(_mm_cmpgt_pd(v, vmax)) << k;
+        }
+        unsigned const diff = (lo ^ last_mask(last + i, -1)) | (hi ^ last_mask(last + i, 1));
+        if (diff != 0) {count += emit_changes(last, i, lo, hi, diff, changed + count);}
+    }
+    return count + eval_range(avg, last, i, n, min, max, changed + count);
+}
+
+__attribute__((target("avx2")))
+static size_t eval_avx2(const sensor_value_t *avg, int8_t *last, size_t n, double min, double max, uint32_t *changed) {
+    __m256d const vmin = _mm256_set1_pd(min), vmax = _mm256_set1_pd(max);
+    size_t count = 0, i = 0;
+    for (; i + THRESHOLDS_STEP <= n; i += THRESHOLDS_STEP) {
+        unsigned lo = 0, hi = 0;
+        for (unsigned k = 0; k < THRESHOLDS_STEP; k += 4) {
+            __m256d const v = _mm256_loadu_pd(avg + i + k);
+            lo |= (unsigned)_mm256_movemask_pd(_mm256_cmp_pd(v, vmin, _CMP_LT_OQ)) << k;
+            hi |= (unsigned)_mm256_movemask_pd(_mm256_cmp_pd(v, vmax, _CMP_GT_OQ)) << k;
+        }
+        unsigned const diff = (lo ^ last_mask(last + i, -1)) | (hi ^ last_mask(last + i, 1));
+        if (diff != 0) {count += emit_changes(last, i, lo, hi, diff, changed + count);}
+    }
+    return count + eval_range(avg, last, i, n, min, max, changed + count);
+}
+#endif
+
+threshold_kernel_t threshold_kernel(const char *name) {
+    if (name == NULL) {return NULL;}
+    if (strcmp(name, "scalar") == 0) {return eval_scalar;}
+#ifdef THRESHOLDS_X86
+    if (strcmp(name, "sse2") == 0) {return eval_sse2;}
+    if (strcmp(name, "avx2") == 0) {return __builtin_cpu_supports("avx2") ? eval_avx2 : NULL;}
+#endif
+    return NULL;
+}
+
+threshold_kernel_t threshold_select(const char **name) {
+    const char *const order[] = {"avx2", "sse2", "scalar"};
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        threshold_kernel_t const kernel = threshold_kernel(order[i]);
+        if (kernel == NULL) {continue;}
+        if (name != NULL) {*name = order[i];}
+        return kernel;
+    }
+    if (name != NULL) {*name = "scalar";}
+    return eval_scalar;
+}
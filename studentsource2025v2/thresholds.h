@@ -0,0 +1,38 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _THRESHOLDS_H_
+#define _THRESHOLDS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * Threshold kernel: compares every avg[i] with [min, max] and gives it a comment, -1 below min, +1 above max, 0 otherwise
+ * (a NaN is 0); only the entries whose comment differs from last[i] are reported
+ * \param avg the running averages
+ * \param last the comments of the previous evaluation, updated in place for the entries that changed
+ * \param n the number of entries of 'avg' and 'last'
+ * \param min the lowest value that is not too cold
+ * \param max the highest value that is not too hot
+ * \param changed filled out with the indices that changed, in increasing order (room for 'n' indices)
+ * \return the number of indices written to 'changed'
+ */
+typedef size_t (*threshold_kernel_t)(const sensor_value_t *avg, int8_t *last, size_t n, double min, double max, uint32_t *changed);
+
+/**
+ * The kernel of the widest instruction set this CPU has: avx2, sse2 or scalar (checked at run time)
+ * \param name if not NULL, set to the name of the instruction set
+ * \return the kernel, never NULL
+ */
+threshold_kernel_t threshold_select(const char **name);
+
+/**
+ * A kernel by instruction set name, for tests and benchmarks
+ * \param name "scalar", "sse2" or "avx2"
+ * \return the kernel, or NULL if the name is unknown or this CPU (or build) does not have it
+ */
+threshold_kernel_t threshold_kernel(const char *name);
+
+#endif //_THRESHOLDS_H_
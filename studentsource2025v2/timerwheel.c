@@ -0,0 +1,150 @@
+/**
+ * \author {Diego Vallés}
+ */
+#include <stdlib.h>
+#include "timerwheel.h"
+//Hierarchical timer wheel (Varghese & Lauck), the cascading scheme of the classic Linux timers:
+//http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf; https://lwn.net/Articles/646950/
+//Level 0 has one slot per tick for the next 64 ticks, level 1 one slot per 64 ticks, ...
+//When level 0 wraps around, the next slot of level 1 is spread over level 0 again (and so on for the levels above)
+//schedule/cancel are O(1), every timer is moved at most once per level: O(1) amortised per expiry
+//Timers are intrusive lists (pprev: pointer to the pointer that points to us), nothing is allocated after init
+#define TW_BITS 6
+#define TW_SLOTS (1u << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4 // 64^4 ticks ahead: about 19 days with 100 ms ticks, later timers are clamped to that
+
+struct timerwheel {
+    uint64_t tick_ms;
+    uint64_t next_tick; // first tick not processed yet
+    size_t count;
+    timerwheel_timer_t *slots[TW_LEVELS][TW_SLOTS];
+};
+
+static void list_push(timerwheel_timer_t **head, timerwheel_timer_t *timer) {
+    timer->next = *head;
+    if (*head != NULL) {(*head)->pprev = &timer->next;}
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void list_unlink(timerwheel_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {timer->next->pprev = timer->pprev;}
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+//the level is picked from the distance to next_tick, the slot from the absolute expiry tick
+static void wheel_add(timerwheel_t *wheel, timerwheel_timer_t *timer) {
+    int64_t const delta = (int64_t)(timer->expires - wheel->next_tick);
+    if (delta < 0) { // already due: first slot that will be processed
+        list_push(&wheel->slots[0][wheel->next_tick & TW_MASK], timer);
+        return;
+    }
+    uint64_t const horizon = 1ull << (TW_BITS * TW_LEVELS);
+    if ((uint64_t)delta >= horizon) {timer->expires = wheel->next_tick + horizon - 1;}
+
+    int level = 0;
+    while (level < TW_LEVELS - 1 && timer->expires - wheel->next_tick >= (1ull << (TW_BITS * (level + 1)))) {
+        level++;
+    }
+    list_push(&wheel->slots[level][(timer->expires >> (TW_BITS * level)) & TW_MASK], timer);
+}
+
+static void cascade(timerwheel_t *wheel, int level, unsigned idx) {
+    timerwheel_timer_t *list = wheel->slots[level][idx];
+    wheel->slots[level][idx] = NULL;
+    while (list != NULL) {
+        timerwheel_timer_t *timer = list;
+        list = timer->next;
+        wheel_add(wheel, timer);
+    }
+}
+
+int timerwheel_init(timerwheel_t **wheel, uint64_t tick_ms, uint64_t now_ms) {
+    if (wheel == NULL || tick_ms == 0) {return TIMERWHEEL_FAILURE;}
+    *wheel = calloc(1, sizeof(timerwheel_t));
+    if (*wheel == NULL) {return TIMERWHEEL_FAILURE;}
+    (*wheel)->tick_ms = tick_ms;
+    (*wheel)->next_tick = now_ms / tick_ms + 1;
+    (*wheel)->count = 0;
+    return TIMERWHEEL_SUCCESS;
+}
+
+int timerwheel_free(timerwheel_t **wheel) {
+    if (wheel == NULL || *wheel == NULL) {return TIMERWHEEL_FAILURE;}
+    free(*wheel);
+    *wheel = NULL;
+    return TIMERWHEEL_SUCCESS;
+}
+
+void timerwheel_timer_init(timerwheel_timer_t *timer) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+void timerwheel_schedule(timerwheel_t *wheel, timerwheel_timer_t *timer, uint64_t expires_ms) {
+    if (timer->pprev != NULL) {list_unlink(timer);}
+    else {wheel->count++;}
+    timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms; // rounded up: never early
+    wheel_add(wheel, timer);
+}
+
+void timerwheel_cancel(timerwheel_t *wheel, timerwheel_timer_t *timer) {
+    if (timer->pprev == NULL) {return;}
+    list_unlink(timer);
+    wheel->count--;
+}
+
+int timerwheel_pending(const timerwheel_timer_t *timer) {return timer->pprev != NULL;}
+
+size_t timerwheel_count(const timerwheel_t *wheel) {return wheel->count;}
+
+size_t timerwheel_advance(timerwheel_t *wheel, uint64_t now_ms, timerwheel_callback_t callback, void *arg) {
+    uint64_t const now_tick = now_ms / wheel->tick_ms;
+    size_t expired = 0;
+
+    while (wheel->next_tick <= now_tick) {
+        if (wheel->count == 0) { // nothing to cascade or expire: jump
+            wheel->next_tick = now_tick + 1;
+            break;
+        }
+        unsigned const idx = wheel->next_tick & TW_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < TW_LEVELS; level++) {
+                unsigned const lidx = (wheel->next_tick >> (TW_BITS * level)) & TW_MASK;
+                cascade(wheel, level, lidx);
+                if (lidx != 0) {break;}
+            }
+        }
+        wheel->next_tick++;
+
+        //detach the slot first: the callbacks may schedule (into the wheel) or cancel (also in this list)
+        timerwheel_timer_t *due = wheel->slots[0][idx];
+        wheel->slots[0][idx] = NULL;
+        if (due != NULL) {due->pprev = &due;}
+        while (due != NULL) {
+            timerwheel_timer_t *timer = due;
+            list_unlink(timer);
+            wheel->count--;
+            expired++;
+            callback(timer, arg);
+        }
+    }
+    return expired;
+}
+
+//first non-empty slot of level 0, or the next wrap of level 0 (a cascade may bring timers down)
+int timerwheel_next_timeout(const timerwheel_t *wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {return -1;}
+    uint64_t tick = wheel->next_tick;
+    for (unsigned i = 0; i < TW_SLOTS; i++, tick++) {
+        if (wheel->slots[0][tick & TW_MASK] != NULL || (tick & TW_MASK) == 0) {break;}
+    }
+    uint64_t const due_ms = tick * wheel->tick_ms;
+    if (due_ms <= now_ms) {return 0;}
+    uint64_t const wait = due_ms - now_ms;
+    return (wait > (uint64_t)INT32_MAX) ? INT32_MAX : (int)wait;
+}
@@ -0,0 +1,74 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMERWHEEL_FAILURE -1
+#define TIMERWHEEL_SUCCESS 0
+
+typedef struct timerwheel timerwheel_t;
+
+// a timer lives inside the object it times (a connection, ...), the wheel never allocates
+// fields are private, only use the timerwheel_ functions on it
+typedef struct timerwheel_timer {
+    struct timerwheel_timer *next;
+    struct timerwheel_timer **pprev; // NULL while not scheduled
+    uint64_t expires;                // in ticks
+} timerwheel_timer_t;
+
+// called once for every expired timer, the timer is no longer scheduled and may be scheduled again
+typedef void (*timerwheel_callback_t)(timerwheel_timer_t *timer, void *arg);
+
+/**
+ * Allocates a new, empty wheel; a wheel is not thread safe, one owner thread or an external lock
+ * \param wheel a double pointer to the wheel that needs to be initialized
+ * \param tick_ms resolution: timers fire at most one tick late
+ * \param now_ms the current time (any monotonic clock in ms, the same one for every call)
+ * \return TIMERWHEEL_SUCCESS on success and TIMERWHEEL_FAILURE if an error occurred
+ */
+int timerwheel_init(timerwheel_t **wheel, uint64_t tick_ms, uint64_t now_ms);
+
+// frees the wheel, the timers that are still scheduled are just forgotten
+int timerwheel_free(timerwheel_t **wheel);
+
+// sets up a timer that is not scheduled
+void timerwheel_timer_init(timerwheel_timer_t *timer);
+
+/**
+ * Schedules 'timer' to expire at 'expires_ms', moves it if it was already scheduled: O(1)
+ * \param wheel the wheel that is used
+ * \param timer the timer, see timerwheel_timer_init
+ * \param expires_ms absolute time, a time in the past expires on the next timerwheel_advance
+ */
+void timerwheel_schedule(timerwheel_t *wheel, timerwheel_timer_t *timer, uint64_t expires_ms);
+
+// unschedules 'timer' if it is scheduled: O(1)
+void timerwheel_cancel(timerwheel_t *wheel, timerwheel_timer_t *timer);
+
+// 1 if 'timer' is scheduled and did not expire yet, 0 otherwise
+int timerwheel_pending(const timerwheel_timer_t *timer);
+
+/**
+ * Moves the wheel to 'now_ms' and calls 'callback' for every timer that expired on the way
+ * \param wheel the wheel that is used
+ * \param now_ms the current time
+ * \param callback called for every expired timer, may schedule or cancel timers
+ * \param arg passed to 'callback'
+ * \return the number of expired timers
+ */
+size_t timerwheel_advance(timerwheel_t *wheel, uint64_t now_ms, timerwheel_callback_t callback, void *arg);
+
+/**
+ * Time until the wheel has work to do, to use as poll/epoll_wait timeout
+ * \return ms until the next timer may expire (0 = now) or -1 if no timer is scheduled
+ */
+int timerwheel_next_timeout(const timerwheel_t *wheel, uint64_t now_ms);
+
+// number of scheduled timers
+size_t timerwheel_count(const timerwheel_t *wheel);
+
+#endif //_TIMERWHEEL_H_
@@ -0,0 +1,245 @@
+/**
+ * \author {Diego Vallés}
+ */
+#define _GNU_SOURCE // recvmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "sensor_db.h"
+#include "udp_listener.h"
+//UDP ingest next to the TCP connection manager: no connection, no per-sensor state, a datagram is all or nothing
+//recvmmsg: one system call takes up to UDP_BATCH datagrams, https://man7.org/linux/man-pages/man2/recvmmsg.2.html
+//SO_RXQ_OVFL: the kernel tells how many datagrams it dropped because the socket buffer was full (we were too slow),
+//https://man7.org/linux/man-pages/man7/socket.7.html; that count has no source, it goes in the totals
+//Per source counters: open addressing hash table on the IPv4 address (linear probing, doubled at 3/4 full),
+//only the listener thread touches it
+#define UDP_RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define UDP_DGRAM_SIZE (UDP_LISTENER_MAX_RECORDS * UDP_RECORD_SIZE) // longer datagrams are truncated, so malformed
+#define UDP_BATCH 64        // datagrams per recvmmsg
+#define UDP_RCVBUF (4 << 20)
+#define UDP_SOURCES_INIT 256
+#define UDP_LOG_SOURCES 32  // sources with malformed/dropped datagrams logged at stop, the others are only counted
+
+typedef struct {
+    uint32_t addr; // network byte order
+    int used;
+    uint64_t datagrams; // received, valid or not
+    uint64_t records;   // inserted into the sbuffer
+    uint64_t malformed; // datagrams refused: size not a multiple of a record, truncated, a value that is not finite
+    uint64_t dropped;   // valid datagrams the sbuffer did not take (closed)
+} udp_source_t;
+
+struct udp_listener {
+    int fd;
+    int stop_pipe[2];
+    pthread_t tid;
+    sbuffer_t *buffer;
+    udp_source_t *sources;
+    size_t nsources, cap;
+    uint64_t kernel_drops; // last SO_RXQ_OVFL value
+    unsigned char bufs[UDP_BATCH][UDP_DGRAM_SIZE];
+    sensor_data_t batch[UDP_BATCH * UDP_LISTENER_MAX_RECORDS];
+};
+
+//Fibonacci hashing: https://probablydance.com/2018/06/16/fibonacci-hashing-the-optimization-that-you-never-knew-about/
+static size_t source_slot(uint32_t addr, size_t cap) {return (size_t)(((uint64_t)addr * 11400714819323198485ull) >> 32) & (cap - 1);}
+
+static int sources_grow(udp_listener_t *l) {
+    size_t const cap = (l->cap == 0) ? UDP_SOURCES_INIT : l->cap * 2;
+    udp_source_t *table = calloc(cap, sizeof(udp_source_t));
+    if (table == NULL) {return -1;}
+    for (size_t i = 0; i < l->cap; i++) {
+        if (!l->sources[i].used) {continue;}
+        size_t k = source_slot(l->sources[i].addr, cap);
+        while (table[k].used) {k = (k + 1) & (cap - 1);}
+        table[k] = l->sources[i];
+    }
+    free(l->sources);
+    l->sources = table;
+    l->cap = cap;
+    return 0;
+}
+
+//room for 'n' new sources before a batch: the table does not move while the batch holds pointers into it
+static void sources_reserve(udp_listener_t *l, size_t n) {
+    while ((l->nsources + n) * 4 > l->cap * 3 && sources_grow(l) == 0) {}
+}
+
+//NULL only when the table could not grow, the datagram is still handled, just not counted
+static udp_source_t *source_get(udp_listener_t *l, uint32_t addr) {
+    size_t k = source_slot(addr, l->cap);
+    while (l->sources[k].used && l->sources[k].addr != addr) {k = (k + 1) & (l->cap - 1);}
+    if (!l->sources[k].used) {
+        if ((l->nsources + 1) * 4 > l->cap * 3) {return NULL;}
+        l->sources[k].used = 1;
+        l->sources[k].addr = addr;
+        l->nsources++;
+    }
+    return &l->sources[k];
+}
+
+//0 and the records in 'out' if every record of the datagram is valid
+static int datagram_decode(const unsigned char *p, size_t len, int truncated, sensor_data_t *out, size_t *n) {
+    if (truncated || len == 0 || len % UDP_RECORD_SIZE != 0) {return -1;}
+    *n = len / UDP_RECORD_SIZE;
+    for (size_t i = 0; i < *n; i++, p += UDP_RECORD_SIZE) {
+        memcpy(&out[i].id, p, sizeof(out[i].id));
+        memcpy(&out[i].value, p + sizeof(sensor_id_t), sizeof(out[i].value));
+        memcpy(&out[i].ts, p + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(out[i].ts));
+        if (!isfinite(out[i].value)) {return -1;}
+    }
+    return 0;
+}
+
+static void *udp_listener_main(void *arg) {
+    udp_listener_t *l = (udp_listener_t *)arg;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in from[UDP_BATCH];
+    union { // aligned room for one SO_RXQ_OVFL control message per datagram
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+        struct cmsghdr align;
+    } control[UDP_BATCH];
+    struct pollfd pfd[2] = {{.fd = l->fd, .events = POLLIN}, {.fd = l->stop_pipe[0], .events = POLLIN}};
+
+    while (1) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {continue;}
+            fprintf(stderr, "udp poll failed\n");
+            break;
+        }
+        if (pfd[1].revents != 0) {break;}
+
+        for (int i = 0; i < UDP_BATCH; i++) { // recvmmsg overwrites the lengths
+            iov[i] = (struct iovec){.iov_base = l->bufs[i], .iov_len = UDP_DGRAM_SIZE};
+            msgs[i].msg_hdr = (struct msghdr){.msg_name = &from[i], .msg_namelen = sizeof(from[i]), .msg_iov = &iov[i],
+                                              .msg_iovlen = 1, .msg_control = control[i].buf, .msg_controllen = sizeof(control[i].buf)};
+        }
+        int const n = recvmmsg(l->fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {continue;}
+            fprintf(stderr, "recvmmsg failed\n");
+            break;
+        }
+
+        //one sbuffer batch for every valid datagram of this call, in arrival order
+        sensor_data_t *const batch = l->batch;
+        size_t nbatch = 0;
+        udp_source_t *owner[UDP_BATCH];
+        size_t owner_records[UDP_BATCH];
+        int nvalid = 0;
+        sources_reserve(l, (size_t)n);
+        for (int i = 0; i < n; i++) {
+            struct msghdr const *h = &msgs[i].msg_hdr;
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(h); c != NULL; c = CMSG_NXTHDR((struct msghdr *)h, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t drops;
+                    memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+                    l->kernel_drops = drops;
+                }
+            }
+            udp_source_t *src = source_get(l, from[i].sin_addr.s_addr);
+            if (src != NULL) {src->datagrams++;}
+            size_t k = 0;
+            if (datagram_decode(l->bufs[i], msgs[i].msg_len, (h->msg_flags & MSG_TRUNC) != 0, batch + nbatch, &k) != 0) {
+                if (src != NULL) {src->malformed++;}
+                continue;
+            }
+            owner[nvalid] = src;
+            owner_records[nvalid++] = k;
+            nbatch += k;
+        }
+        int const inserted = (nbatch == 0 || sbuffer_insert_batch(l->buffer, batch, nbatch) == SBUFFER_SUCCESS);
+        for (int i = 0; i < nvalid; i++) {
+            if (owner[i] == NULL) {continue;}
+            if (inserted) {owner[i]->records += owner_records[i];}
+            else {owner[i]->dropped++;}
+        }
+    }
+    return NULL;
+}
+
+int udp_listener_start(udp_listener_t **listener, int port, sbuffer_t *buffer) {
+    if (listener == NULL || buffer == NULL || port <= 0 || port > 65535) {return UDP_LISTENER_FAILURE;}
+    udp_listener_t *l = malloc(sizeof(udp_listener_t));
+    if (l == NULL) {return UDP_LISTENER_FAILURE;}
+    l->buffer = buffer;
+    l->sources = NULL;
+    l->nsources = 0;
+    l->cap = 0;
+    l->kernel_drops = 0;
+    l->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (l->fd < 0) {free(l);return UDP_LISTENER_FAILURE;}
+
+    int const one = 1, rcvbuf = UDP_RCVBUF;
+    setsockopt(l->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // best effort: capped by net.core.rmem_max
+    setsockopt(l->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t)port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (bind(l->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || sources_grow(l) != 0 || pipe(l->stop_pipe) != 0) {
+        fprintf(stderr, "udp listener setup failed on port %d\n", port);
+        close(l->fd);
+        free(l->sources);
+        free(l);
+        return UDP_LISTENER_FAILURE;
+    }
+    if (pthread_create(&l->tid, NULL, udp_listener_main, l) != 0) {
+        fprintf(stderr, "pthread_create(udp listener) failed\n");
+        close(l->stop_pipe[0]);
+        close(l->stop_pipe[1]);
+        close(l->fd);
+        free(l->sources);
+        free(l);
+        return UDP_LISTENER_FAILURE;
+    }
+    log_event("UDP listener started (port=%d)", port);
+    *listener = l;
+    return UDP_LISTENER_SUCCESS;
+}
+
+int udp_listener_stop(udp_listener_t **listener) {
+    if (listener == NULL || *listener == NULL) {return UDP_LISTENER_FAILURE;}
+    udp_listener_t *l = *listener;
+    char const byte = 0;
+    if (write(l->stop_pipe[1], &byte, 1) < 0) {fprintf(stderr, "udp stop pipe write failed\n");}
+    pthread_join(l->tid, NULL);
+
+    udp_source_t total = {0};
+    size_t logged = 0, unlogged = 0;
+    for (size_t i = 0; i < l->cap; i++) {
+        udp_source_t const *s = &l->sources[i];
+        if (!s->used) {continue;}
+        total.datagrams += s->datagrams;
+        total.records += s->records;
+        total.malformed += s->malformed;
+        total.dropped += s->dropped;
+        if (s->malformed == 0 && s->dropped == 0) {continue;}
+        if (logged == UDP_LOG_SOURCES) {unlogged++;continue;}
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &s->addr, ip, sizeof(ip));
+        log_event("UDP source %s: datagrams=%llu records=%llu malformed=%llu dropped=%llu", ip,
+                  (unsigned long long)s->datagrams, (unsigned long long)s->records,
+                  (unsigned long long)s->malformed, (unsigned long long)s->dropped);
+        logged++;
+    }
+    if (unlogged > 0) {log_event("UDP: %zu more sources with malformed or dropped datagrams", unlogged);}
+    log_event("UDP listener stopped: sources=%zu datagrams=%llu records=%llu malformed=%llu dropped=%llu kernel_drops=%llu",
+              l->nsources, (unsigned long long)total.datagrams, (unsigned long long)total.records,
+              (unsigned long long)total.malformed, (unsigned long long)total.dropped, (unsigned long long)l->kernel_drops);
+
+    close(l->stop_pipe[0]);
+    close(l->stop_pipe[1]);
+    close(l->fd);
+    free(l->sources);
+    free(l);
+    *listener = NULL;
+    return UDP_LISTENER_SUCCESS;
+}
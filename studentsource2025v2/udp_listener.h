@@ -0,0 +1,35 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _UDP_LISTENER_H_
+#define _UDP_LISTENER_H_
+
+#include <stdint.h>
+#include "sbuffer.h"
+
+#define UDP_LISTENER_FAILURE -1
+#define UDP_LISTENER_SUCCESS 0
+
+// one datagram = one or more v1 records <id><value><ts> (18 bytes each), at most what fits in one Ethernet frame
+#define UDP_LISTENER_MAX_RECORDS 81 // 81 * 18 = 1458 <= 1500 - 20 (IPv4) - 8 (UDP)
+
+typedef struct udp_listener udp_listener_t;
+
+/**
+ * Binds a UDP socket on 'port' and starts the listener thread, it inserts every valid datagram into 'buffer'
+ * \param listener a double pointer to the listener that needs to be initialized
+ * \param port the UDP port
+ * \param buffer shared with the TCP connections, must stay open until udp_listener_stop returned
+ * \return UDP_LISTENER_SUCCESS on success and UDP_LISTENER_FAILURE if the socket or the thread could not be set up
+ */
+int udp_listener_start(udp_listener_t **listener, int port, sbuffer_t *buffer);
+
+/**
+ * Stops and joins the listener thread, logs its counters (totals, and every source that had malformed or dropped
+ * datagrams) and frees it
+ * \param listener a double pointer to the listener, set to NULL
+ * \return UDP_LISTENER_SUCCESS on success and UDP_LISTENER_FAILURE if 'listener' was not started
+ */
+int udp_listener_stop(udp_listener_t **listener);
+
+#endif //_UDP_LISTENER_H_
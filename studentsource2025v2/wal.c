@@ -0,0 +1,372 @@
+/**
+ * \author {Diego Vallés}
+ */
+#define _GNU_SOURCE // fdatasync, O_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "wire.h"
+#include "db_writer.h"
+#include "sensor_db.h"
+//Group commit again (db_writer.c), this time in front of the sbuffer: the connection threads only copy their records into
+//the current group under a mutex, one writer thread writes a whole group with one write() (and one fdatasync with 'sync')
+//every max_delay_ms. Two groups: the appenders fill one while the other is being written, they only wait when both are busy
+//No runtime checkpoint records: the header holds the size of data.csv when the log was started, and the sbuffer keeps the
+//records of one sensor in order (one ring per sensor, FIFO), so the rows of a sensor after that offset are the first records
+//of that sensor in the log. wal_recover counts them and replays the rest; the log is started over once the storage has
+//caught up (wal_checkpoint), which happens whenever the sensors leave the pipeline idle for a moment
+//This needs every appended record to reach the storage: no drop policy, no other storage than data.csv (main checks it)
+#define WAL_WAIT_FOREVER UINT64_MAX
+#define WAL_REPLAY_BATCH 256
+
+static const unsigned char wal_magic[5] = {'S', 'G', 'W', 'A', 'L'};
+static const unsigned char group_magic[4] = {'W', 'A', 'L', '1'};
+
+struct wal {
+    int fd;
+    bool sync;
+    const char *name; // for the log
+    uint64_t max_delay_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;    // writer thread: a group started, is full or is due, or stop
+    pthread_cond_t written;  // appenders and wal_checkpoint: the writer thread is done with a group
+    unsigned char *groups[2];
+    int cur;                 // the group the appenders fill
+    size_t used;             // bytes in groups[cur], WAL_GROUP_HEADER_SIZE when it is empty
+    uint64_t oldest_ns;      // when the first record of groups[cur] was appended
+    bool writing;            // the writer thread has the other group
+    bool stop;
+    uint64_t appended;       // records since wal_open
+    uint64_t appended_reset; // 'appended' at the last start over
+    uint64_t file_bytes;     // written to the log since the last start over, header included
+    pthread_t writer;
+};
+
+static void put_u16(unsigned char *p, uint16_t v) {p[0] = (unsigned char)v;p[1] = (unsigned char)(v >> 8);}
+
+static void put_u32(unsigned char *p, uint32_t v) {for (int i = 0; i < 4; i++) {p[i] = (unsigned char)(v >> (8 * i));}}
+
+static void put_u64(unsigned char *p, uint64_t v) {for (int i = 0; i < 8; i++) {p[i] = (unsigned char)(v >> (8 * i));}}
+
+static uint16_t get_u16(const unsigned char *p) {return (uint16_t)(p[0] | (p[1] << 8));}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {v = (v << 8) | p[i];}
+    return v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int cond_init_monotonic(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) {return -1;}
+    int rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (rc == 0) {rc = pthread_cond_init(cond, &attr);}
+    pthread_condattr_destroy(&attr);
+    return rc;
+}
+
+static void cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline) {
+    if (deadline == WAL_WAIT_FOREVER) {pthread_cond_wait(cond, mutex);return;}
+    struct timespec const ts = {.tv_sec = (time_t)(deadline / 1000000000ull), .tv_nsec = (long)(deadline % 1000000000ull)};
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+static int write_all(int fd, const void *data, size_t nbytes) {
+    const unsigned char *buf = data;
+    while (nbytes > 0) {
+        ssize_t w = write(fd, buf, nbytes);
+        if (w <= 0) {return -1;}
+        buf += (size_t)w;
+        nbytes -= (size_t)w;
+    }
+    return 0;
+}
+
+static void encode_record(unsigned char *p, const sensor_data_t *data) {
+    uint64_t bits;
+    memcpy(&bits, &data->value, sizeof(bits));
+    put_u16(p, data->id);
+    put_u64(p + 2, bits);
+    put_u64(p + 10, (uint64_t)data->ts);
+}
+
+static void decode_record(const unsigned char *p, sensor_data_t *data) {
+    uint64_t const bits = get_u64(p + 2);
+    data->id = get_u16(p);
+    memcpy(&data->value, &bits, sizeof(bits));
+    data->ts = (sensor_ts_t)get_u64(p + 10);
+}
+
+//the log starts over: only the header, with the storage offset its records count from
+static int write_header(wal_t *wal, uint64_t storage_size) {
+    unsigned char header[WAL_HEADER_SIZE] = {0};
+    memcpy(header, wal_magic, sizeof(wal_magic));
+    header[5] = WAL_VERSION;
+    put_u64(header + 8, storage_size);
+    if (ftruncate(wal->fd, 0) != 0 || write_all(wal->fd, header, sizeof(header)) != 0 ||
+        (wal->sync && fdatasync(wal->fd) != 0)) {
+        fprintf(stderr, "Error: could not start %s over\n", wal->name);
+        return WAL_FAILURE;
+    }
+    wal->file_bytes = WAL_HEADER_SIZE;
+    return WAL_SUCCESS;
+}
+
+static int write_group(wal_t *wal, unsigned char *group, size_t len) {
+    size_t const count = (len - WAL_GROUP_HEADER_SIZE) / WAL_RECORD_SIZE;
+    memcpy(group, group_magic, sizeof(group_magic));
+    put_u32(group + 4, (uint32_t)count);
+    put_u32(group + 8, wire_crc32c(0, group + WAL_GROUP_HEADER_SIZE, len - WAL_GROUP_HEADER_SIZE));
+    if (write_all(wal->fd, group, len) != 0 || (wal->sync && fdatasync(wal->fd) != 0)) {
+        fprintf(stderr, "Error: %zu records could not be written to %s\n", count, wal->name);
+        return WAL_FAILURE;
+    }
+    return WAL_SUCCESS;
+}
+
+//the group is swapped under the lock and written outside of it, the appenders go on in the other group
+static void *wal_writer_thread(void *arg) {
+    wal_t *wal = arg;
+    pthread_mutex_lock(&wal->lock);
+    while (1) {
+        bool const pending = wal->used > WAL_GROUP_HEADER_SIZE;
+        if (pending && (wal->stop || WAL_BUFFER - wal->used < WAL_RECORD_SIZE ||
+                        now_ns() - wal->oldest_ns >= wal->max_delay_ns)) {
+            unsigned char *group = wal->groups[wal->cur];
+            size_t const len = wal->used;
+            wal->cur ^= 1;
+            wal->used = WAL_GROUP_HEADER_SIZE;
+            wal->writing = true;
+            pthread_cond_broadcast(&wal->written); // appenders waiting for room have an empty group now
+            pthread_mutex_unlock(&wal->lock);
+            int const rc = write_group(wal, group, len);
+            pthread_mutex_lock(&wal->lock);
+            if (rc == WAL_SUCCESS) {wal->file_bytes += len;}
+            wal->writing = false;
+            pthread_cond_broadcast(&wal->written);
+            continue;
+        }
+        if (wal->stop) {break;}
+        cond_wait_until(&wal->ready, &wal->lock, pending ? wal->oldest_ns + wal->max_delay_ns : WAL_WAIT_FOREVER);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+int wal_open(wal_t **wal, const char *path, uint64_t storage_size, const wal_config_t *config) {
+    if (wal == NULL || path == NULL) {return WAL_FAILURE;}
+    *wal = NULL;
+    wal_t *w = calloc(1, sizeof(wal_t));
+    if (w == NULL) {return WAL_FAILURE;}
+    w->sync = (config != NULL) && config->sync;
+    int const delay_ms = (config != NULL && config->max_delay_ms > 0) ? config->max_delay_ms : WAL_MAX_DELAY_MS;
+    w->max_delay_ns = (uint64_t)delay_ms * 1000000ull;
+    w->name = (strrchr(path, '/') != NULL) ? strrchr(path, '/') + 1 : path;
+    w->used = WAL_GROUP_HEADER_SIZE;
+    w->groups[0] = malloc(WAL_BUFFER);
+    w->groups[1] = malloc(WAL_BUFFER);
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (w->groups[0] == NULL || w->groups[1] == NULL || w->fd < 0 || write_header(w, storage_size) != WAL_SUCCESS) {
+        fprintf(stderr, "Error: could not open %s in wal_open\n", path);
+        if (w->fd >= 0) {close(w->fd);}
+        free(w->groups[0]);free(w->groups[1]);free(w);
+        return WAL_FAILURE;
+    }
+    if (pthread_mutex_init(&w->lock, NULL) != 0 || cond_init_monotonic(&w->ready) != 0 ||
+        pthread_cond_init(&w->written, NULL) != 0 || pthread_create(&w->writer, NULL, wal_writer_thread, w) != 0) {
+        close(w->fd);
+        free(w->groups[0]);free(w->groups[1]);free(w);
+        return WAL_FAILURE;
+    }
+    *wal = w;
+    return WAL_SUCCESS;
+}
+
+int wal_append(wal_t *wal, const sensor_data_t *data, size_t n) {
+    if (wal == NULL || (data == NULL && n > 0)) {return WAL_FAILURE;}
+    pthread_mutex_lock(&wal->lock);
+    while (n > 0 && !wal->stop) {
+        size_t const room = (WAL_BUFFER - wal->used) / WAL_RECORD_SIZE;
+        if (room == 0) { // both groups busy
+            pthread_cond_signal(&wal->ready);
+            pthread_cond_wait(&wal->written, &wal->lock);
+            continue;
+        }
+        if (wal->used == WAL_GROUP_HEADER_SIZE) { // the writer thread sleeps without a deadline while the group is empty
+            wal->oldest_ns = now_ns();
+            pthread_cond_signal(&wal->ready);
+        }
+        size_t const k = (n < room) ? n : room;
+        unsigned char *p = wal->groups[wal->cur] + wal->used;
+        for (size_t i = 0; i < k; i++) {encode_record(p + i * WAL_RECORD_SIZE, &data[i]);}
+        wal->used += k * WAL_RECORD_SIZE;
+        wal->appended += k;
+        data += k;
+        n -= k;
+        if (WAL_BUFFER - wal->used < WAL_RECORD_SIZE) {pthread_cond_signal(&wal->ready);}
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return (n == 0) ? WAL_SUCCESS : WAL_FAILURE;
+}
+
+int wal_checkpoint(wal_t *wal, uint64_t stored, uint64_t storage_size, bool force) {
+    if (wal == NULL) {return WAL_FAILURE;}
+    int rc = WAL_SUCCESS;
+    pthread_mutex_lock(&wal->lock);
+    //the wait drops the lock: the records appended meanwhile are not stored yet, so check only once the writer is idle
+    while (wal->writing) {pthread_cond_wait(&wal->written, &wal->lock);}
+    if (stored == wal->appended && wal->appended != wal->appended_reset &&
+        (force || wal->file_bytes + wal->used >= WAL_CHECKPOINT_BYTES)) {
+        wal->used = WAL_GROUP_HEADER_SIZE; // records not written yet are stored already
+        rc = write_header(wal, storage_size);
+        wal->appended_reset = wal->appended;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+int wal_close(wal_t **wal) {
+    if (wal == NULL || *wal == NULL) {return WAL_FAILURE;}
+    wal_t *w = *wal;
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->ready);
+    pthread_cond_broadcast(&w->written);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->writer, NULL); // writes the last group
+    int rc = WAL_SUCCESS;
+    if (close(w->fd) != 0) {
+        fprintf(stderr, "Failed to close %s\n", w->name);
+        rc = WAL_FAILURE;
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->ready);
+    pthread_cond_destroy(&w->written);
+    free(w->groups[0]);
+    free(w->groups[1]);
+    free(w);
+    *wal = NULL;
+    return rc;
+}
+
+//Recovery: rows of the csv file after 'offset', per sensor; a last row without its '\n' (cut by a crash) is removed
+static int count_rows(int fd, uint64_t offset, uint32_t *rows) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {return WAL_FAILURE;}
+    uint64_t const size = (uint64_t)st.st_size;
+    if (offset > size) {
+        log_event("Recovery: the storage is smaller than when the log was started, every record of the log is replayed");
+        return WAL_SUCCESS;
+    }
+    char *buf = malloc(WAL_BUFFER);
+    if (buf == NULL) {return WAL_FAILURE;}
+    uint64_t pos = offset, row_start = offset;
+    uint32_t id = 0;
+    bool in_id = true;
+    while (pos < size) {
+        ssize_t const n = pread(fd, buf, WAL_BUFFER, (off_t)pos);
+        if (n <= 0) {free(buf); return WAL_FAILURE;}
+        for (ssize_t i = 0; i < n; i++) {
+            char const c = buf[i];
+            if (c == '\n') {
+                if (id <= UINT16_MAX) {rows[id]++;}
+                id = 0;
+                in_id = true;
+                row_start = pos + (uint64_t)i + 1;
+            } else if (in_id && c >= '0' && c <= '9') {
+                id = (id > UINT16_MAX) ? id : id * 10 + (uint32_t)(c - '0');
+            } else {
+                in_id = false;
+            }
+        }
+        pos += (uint64_t)n;
+    }
+    free(buf);
+    if (row_start < size && ftruncate(fd, (off_t)row_start) != 0) {return WAL_FAILURE;}
+    return WAL_SUCCESS;
+}
+
+int wal_recover(const char *path, const char *csv_filename, uint64_t *storage_size) {
+    if (path == NULL || csv_filename == NULL || storage_size == NULL) {return WAL_FAILURE;}
+    struct stat st;
+    FILE *log = fopen(path, "rb");
+    if (log == NULL) { // no log: nothing to replay
+        *storage_size = (stat(csv_filename, &st) == 0) ? (uint64_t)st.st_size : 0;
+        return WAL_SUCCESS;
+    }
+    unsigned char header[WAL_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), log) != sizeof(header)) { // empty or cut while it was started over
+        fclose(log);
+        *storage_size = (stat(csv_filename, &st) == 0) ? (uint64_t)st.st_size : 0;
+        return WAL_SUCCESS;
+    }
+    if (memcmp(header, wal_magic, sizeof(wal_magic)) != 0 || header[5] != WAL_VERSION) {
+        fprintf(stderr, "Error: %s is not a write-ahead log\n", path);
+        fclose(log);
+        return WAL_FAILURE;
+    }
+
+    uint32_t *rows = calloc(UINT16_MAX + 1, sizeof(uint32_t));
+    unsigned char *group = malloc(WAL_BUFFER);
+    int const fd = open(csv_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    db_writer_t *writer = NULL;
+    db_writer_config_t const config = {.format = DB_FORMAT_CSV, .sync = true}; // durable before the log starts over
+    int rc = (rows != NULL && group != NULL && fd >= 0) ? count_rows(fd, get_u64(header + 8), rows) : WAL_FAILURE;
+    if (fd >= 0) {close(fd);}
+    if (rc == WAL_SUCCESS && db_writer_open(&writer, csv_filename, true, &config) != DB_WRITER_SUCCESS) {rc = WAL_FAILURE;}
+
+    //one sequential pass, the groups are checked with their crc: the first bad one is where the crash cut the log
+    uint64_t total = 0, replayed = 0;
+    sensor_data_t batch[WAL_REPLAY_BATCH];
+    size_t nbatch = 0;
+    unsigned char gh[WAL_GROUP_HEADER_SIZE];
+    while (rc == WAL_SUCCESS && fread(gh, 1, sizeof(gh), log) == sizeof(gh)) {
+        size_t const count = get_u32(gh + 4);
+        size_t const len = count * WAL_RECORD_SIZE;
+        if (memcmp(gh, group_magic, sizeof(group_magic)) != 0 || len > WAL_BUFFER - WAL_GROUP_HEADER_SIZE ||
+            fread(group, 1, len, log) != len || wire_crc32c(0, group, len) != get_u32(gh + 8)) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            decode_record(group + i * WAL_RECORD_SIZE, &batch[nbatch]);
+            total++;
+            if (rows[batch[nbatch].id] > 0) {rows[batch[nbatch].id]--;continue;}
+            replayed++;
+            if (++nbatch == WAL_REPLAY_BATCH) {
+                if (db_writer_insert_batch(writer, batch, nbatch) != DB_WRITER_SUCCESS) {rc = WAL_FAILURE;}
+                nbatch = 0;
+            }
+        }
+    }
+    if (rc == WAL_SUCCESS && db_writer_insert_batch(writer, batch, nbatch) != DB_WRITER_SUCCESS) {rc = WAL_FAILURE;}
+    if (writer != NULL && db_writer_close(&writer) != DB_WRITER_SUCCESS) {rc = WAL_FAILURE;}
+    fclose(log);
+    free(group);
+    free(rows);
+    if (rc != WAL_SUCCESS) {
+        fprintf(stderr, "Error: recovery from %s failed, the log is kept\n", path);
+        return WAL_FAILURE;
+    }
+    log_event("Recovery: %llu records in %s, %llu replayed into %s", (unsigned long long)total, path,
+              (unsigned long long)replayed, csv_filename);
+    *storage_size = (stat(csv_filename, &st) == 0) ? (uint64_t)st.st_size : 0;
+    return WAL_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+//Write-ahead log of every record the gateway receives, so the records still in the sbuffer or in the storage buffer
+//are not lost when the gateway crashes (sbuffer_config_t.wal: appended by the connection threads before the sbuffer)
+//  file:  'S' 'G' 'W' 'A' 'L' | version u8 | reserved u16 (0) | storage offset u64: size of data.csv when the log was
+//         started, every row after it comes from a record of this log. Then groups until the end of the file,
+//         all integers little endian:
+//  group: magic u32 ("WAL1") | count u32 | crc32c u32 of the records | count records: id u16 | value f64 | ts i64
+
+#define WAL_SUCCESS 0
+#define WAL_FAILURE -1
+
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 16
+#define WAL_GROUP_HEADER_SIZE 12
+#define WAL_RECORD_SIZE 18
+
+// bytes of one group, the appends waiting for the log writer thread
+#ifndef WAL_BUFFER
+#define WAL_BUFFER (1 << 18)
+#endif
+// an appended record waits at most this long (ms) before its group is written
+#ifndef WAL_MAX_DELAY_MS
+#define WAL_MAX_DELAY_MS 10
+#endif
+// the log is only started over (wal_checkpoint) once it holds this many bytes
+#ifndef WAL_CHECKPOINT_BYTES
+#define WAL_CHECKPOINT_BYTES (1 << 20)
+#endif
+
+typedef struct wal wal_t;
+
+typedef struct {
+    bool sync;        // fdatasync after every group: the log survives a power loss, not only a crash of the gateway
+    int max_delay_ms; // 0 = WAL_MAX_DELAY_MS
+} wal_config_t;
+
+/**
+ * Replays the records of a log left by the previous run that are not in the csv file yet, appending them to it
+ * The rows after the storage offset of the log are counted per sensor: the first that many records of a sensor in the
+ * log are already stored (the sbuffer keeps the records of one sensor in order), the others are replayed
+ * \param path the log, nothing to do if it does not exist
+ * \param csv_filename the storage, a row cut by a crash at its end is removed (the log still has it)
+ * \param storage_size filled out with the size of the csv file after the replay, for wal_open
+ * \return WAL_SUCCESS on success and WAL_FAILURE if the log or the csv file could not be read or written
+ */
+int wal_recover(const char *path, const char *csv_filename, uint64_t *storage_size);
+
+/**
+ * Starts an empty log (the previous content must have been recovered) and its writer thread
+ * \param storage_size the size of the csv file, nothing has been written to it since wal_recover
+ * \param config NULL for the defaults
+ * \return WAL_SUCCESS on success and WAL_FAILURE if an error occurred
+ */
+int wal_open(wal_t **wal, const char *path, uint64_t storage_size, const wal_config_t *config);
+
+/**
+ * Copies 'n' records into the current group, no system call and no allocation; the writer thread writes the group
+ * after max_delay_ms or when it is full. Waits only when the group is full while the previous one is being written
+ * \return WAL_SUCCESS, or WAL_FAILURE after wal_close
+ */
+int wal_append(wal_t *wal, const sensor_data_t *data, size_t n);
+
+/**
+ * Starts the log over when every record appended so far is in the storage, called by the storage manager when its
+ * writer has nothing buffered any more; appenders wait for the reset
+ * \param stored records written to the storage since wal_open
+ * \param storage_size the size of the csv file now, the new storage offset
+ * \param force false: only when the log holds WAL_CHECKPOINT_BYTES or more
+ * \return WAL_SUCCESS (also when the log could not be started over yet) and WAL_FAILURE if the reset failed
+ */
+int wal_checkpoint(wal_t *wal, uint64_t stored, uint64_t storage_size, bool force);
+
+/**
+ * Writes the last group, stops the writer thread, closes the log and frees it
+ * \param wal a double pointer to the log, set to NULL
+ * \return WAL_SUCCESS on success and WAL_FAILURE if an error occurred
+ */
+int wal_close(wal_t **wal);
+
+#endif //_WAL_H_
@@ -0,0 +1,63 @@
+/**
+ * \author {Diego Vallés}
+ */
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+//Sensor protocol v2, next to v1 (bare <id><value><ts> frames of 18 bytes in host order)
+//Connection: the client sends a hello, the gateway answers with its own hello carrying the version it speaks
+//  hello:   'S' 'G' 'W' 'P' | version u8 | flags u8 (0) | reserved u16 (0)
+//Then frames, every one with many readings of one sensor (all integers little endian):
+//  len u32 (bytes after this field) | sensor_id u16 | count u16 | ts u64 (first reading) |
+//  count x (value f64 | ts delta, zigzag varint, absent for the first reading) | crc32c u32 of everything after len
+//A v1 client never starts with the magic (it would need sensor id 18259 followed by a temperature starting with "WP")
+
+#define WIRE_FAILURE -1
+#define WIRE_SUCCESS 0
+
+#define WIRE_MAGIC_SIZE 4
+#define WIRE_HELLO_SIZE 8
+#define WIRE_VERSION 2
+#define WIRE_V2_MAX_READINGS 256 // per frame
+#define WIRE_V2_HEADER_SIZE 16   // len + sensor_id + count + ts
+#define WIRE_V2_MAX_FRAME (WIRE_V2_HEADER_SIZE + WIRE_V2_MAX_READINGS * (sizeof(sensor_value_t) + 10) + 4)
+
+// fills 'out' with a hello for 'version'
+void wire_hello(unsigned char *out, uint8_t version);
+
+// 1 if the 'len' first bytes of 'p' (len <= WIRE_MAGIC_SIZE) are the start of a hello
+int wire_hello_prefix(const unsigned char *p, size_t len);
+
+/**
+ * Checks the hello in the WIRE_HELLO_SIZE bytes at 'p'
+ * \param version set to the version it announces
+ * \return WIRE_SUCCESS, or WIRE_FAILURE if it is not a hello
+ */
+int wire_parse_hello(const unsigned char *p, uint8_t *version);
+
+/**
+ * Encodes 'n' readings of one sensor (1 <= n <= WIRE_V2_MAX_READINGS, all with the id of the first) as one v2 frame
+ * \param out room for at least WIRE_V2_MAX_FRAME bytes
+ * \return the size of the frame in bytes
+ */
+size_t wire_v2_encode(unsigned char *out, const sensor_data_t *readings, size_t n);
+
+// size of the v2 frame starting at 'p' as told by its len field: 0 if len < 4, larger than WIRE_V2_MAX_FRAME if invalid
+size_t wire_v2_frame_size(const unsigned char *p, size_t len);
+
+/**
+ * Decodes one complete v2 frame (of wire_v2_frame_size bytes), checking its length, count and CRC
+ * \param out room for WIRE_V2_MAX_READINGS readings
+ * \param n set to the number of readings
+ * \return WIRE_SUCCESS, or WIRE_FAILURE if the frame is corrupt
+ */
+int wire_v2_decode(const unsigned char *frame, size_t size, sensor_data_t *out, size_t *n);
+
+// CRC32C (Castagnoli) of 'len' bytes, crc = 0 to start, the result of the previous call to continue
+uint32_t wire_crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif //_WIRE_H_